@@ -0,0 +1,497 @@
+#include "common/MessageHeader.h"
+#include "common/defines.h"
+#include "librelay/librelay.h"
+#include "node/Metrics.h"
+
+#include <algorithm>
+#include <atomic>
+#include <boost/program_options.hpp>
+#include <chrono>
+#include <condition_variable>
+#include <glog/logging.h>
+#include <iostream>
+#include <map>
+#include <mutex>
+#include <sstream>
+#include <thread>
+#include <yael/EventLoop.h>
+
+using namespace std::chrono_literals;
+namespace po = boost::program_options;
+
+using relay::channel_id_t;
+using relay::Histogram;
+
+/// sender id, sequence number and intended send time
+constexpr uint32_t PAYLOAD_HEADER_SIZE =
+    sizeof(uint32_t) + 2 * sizeof(uint64_t);
+
+uint64_t bench_time() {
+    using namespace std::chrono;
+
+    auto now = steady_clock::now().time_since_epoch();
+    return duration_cast<microseconds>(now).count();
+}
+
+struct bench_config_t {
+    bool open_loop;
+    double rate;
+    uint32_t window;
+
+    /// Closed loop: messages still outstanding after this are lost
+    uint64_t timeout;
+    uint32_t message_size;
+    uint32_t num_clients;
+    uint32_t num_channels;
+
+    /// Latencies of messages sent before this are not recorded
+    uint64_t measure_start;
+    uint64_t measure_end;
+};
+
+class Client;
+
+/// State shared by all clients of this benchmark process
+struct bench_state_t {
+    bench_config_t config;
+    std::vector<std::unique_ptr<Client>> clients;
+
+    Histogram latency;
+    Histogram relay_time;
+    Histogram wire_time;
+
+    std::atomic<uint64_t> num_sent = 0;
+    std::atomic<uint64_t> num_expected = 0;
+    std::atomic<uint64_t> num_received = 0;
+    std::atomic<uint64_t> bytes_received = 0;
+    std::atomic<uint64_t> num_timed_out = 0;
+
+    /// Receivers that are subscribed to a channel
+    std::vector<std::vector<uint32_t>> subscribers;
+};
+
+class Client : public relay::Callback {
+  public:
+    Client(bench_state_t &state, uint32_t id, channel_id_t channel)
+        : m_state(state), m_id(id), m_channel(channel) {}
+
+    void connect(const yael::network::Address &addr) {
+        m_connection = relay::create_connection(addr, *this, {m_channel});
+    }
+
+    void set_trace_rate(uint32_t rate) { m_connection->set_trace_rate(rate); }
+
+    void set_chunk_size(uint32_t size) { m_connection->set_chunk_size(size); }
+
+    channel_id_t channel() const { return m_channel; }
+
+    void close() { m_connection->close(); }
+
+    /// Number of clients that receive a message on the channel
+    size_t num_receivers(channel_id_t channel) const {
+        auto &subs = m_state.subscribers[channel];
+
+        // the relay does not echo messages back to the sender
+        return subs.size() - std::count(subs.begin(), subs.end(), m_id);
+    }
+
+    /// Send a message that should have been sent at intended_time
+    void send(channel_id_t channel, uint64_t intended_time) {
+        auto &config = m_state.config;
+
+        bitstream msg;
+        msg << m_id << m_next_seq++ << intended_time;
+
+        if (config.message_size > PAYLOAD_HEADER_SIZE) {
+            msg.resize(config.message_size);
+        }
+
+        auto expected = num_receivers(channel);
+
+        bool measured = intended_time >= config.measure_start &&
+                        intended_time < config.measure_end;
+
+        if (measured) {
+            m_state.num_sent++;
+            m_state.num_expected += expected;
+        }
+
+        bool blocking = true;
+        m_connection->send({channel}, std::move(msg), blocking);
+    }
+
+    /// Open loop: send at a fixed rate independent of the responses
+    /// Latencies are measured from the intended send time, so a stalled
+    /// sender does not hide queueing delay (coordinated omission)
+    void run_open_loop(uint64_t start, uint64_t end, double rate) {
+        auto interval = 1'000'000.0 / rate;
+        auto &num_channels = m_state.config.num_channels;
+
+        for (uint64_t i = 0;; ++i) {
+            auto offset = static_cast<double>(i) * interval;
+            auto intended = start + static_cast<uint64_t>(offset);
+
+            if (intended >= end) {
+                break;
+            }
+
+            auto now = bench_time();
+            if (now < intended) {
+                std::this_thread::sleep_for(
+                    std::chrono::microseconds(intended - now));
+            }
+
+            send((m_id + i) % num_channels, intended);
+        }
+    }
+
+    /// Closed loop: keep a fixed number of messages outstanding
+    /// A message is complete once its first receiver got it, or lost if
+    /// that takes longer than the timeout
+    void run_closed_loop(uint64_t end, uint32_t window, uint64_t timeout) {
+        auto &num_channels = m_state.config.num_channels;
+        uint64_t i = 0;
+
+        while (bench_time() < end) {
+            auto channel = (m_id + i) % num_channels;
+            ++i;
+
+            if (num_receivers(channel) == 0) {
+                // nobody would complete it
+                continue;
+            }
+
+            std::unique_lock lock(m_mutex);
+
+            while (true) {
+                expire_outstanding(timeout);
+
+                if (m_outstanding.size() < window || bench_time() >= end) {
+                    break;
+                }
+
+                m_cond.wait_for(lock, 10ms);
+            }
+
+            if (bench_time() >= end) {
+                break;
+            }
+
+            auto now = bench_time();
+            m_outstanding.emplace(m_next_seq, now);
+            lock.unlock();
+
+            send(channel, now);
+        }
+    }
+
+    void on_complete(uint64_t seq) {
+        std::unique_lock lock(m_mutex);
+
+        m_outstanding.erase(seq);
+        m_cond.notify_all();
+    }
+
+  private:
+    void on_new_message(std::set<channel_id_t> channels,
+                        bitstream &&data) override {
+        auto now = bench_time();
+        auto size = data.size();
+
+        uint32_t sender = 0;
+        uint64_t seq = 0, intended_time = 0;
+        data >> sender >> seq >> intended_time;
+
+        auto &config = m_state.config;
+
+        if (intended_time >= config.measure_start &&
+            intended_time < config.measure_end) {
+            m_state.latency.record(now - intended_time);
+            m_state.num_received++;
+            m_state.bytes_received += size;
+        }
+
+        if (config.open_loop || sender >= m_state.clients.size() ||
+            channels.empty()) {
+            return;
+        }
+
+        // the first subscriber (other than the sender) completes a message
+        for (auto sid : m_state.subscribers[*channels.begin()]) {
+            if (sid == sender) {
+                continue;
+            }
+
+            if (sid == m_id) {
+                m_state.clients[sender]->on_complete(seq);
+            }
+            break;
+        }
+    }
+
+    void on_message_trace(const std::set<channel_id_t> &,
+                          const relay::message_trace_t &trace) override {
+        auto now = relay::trace_time();
+        uint64_t prev = trace.origin_time;
+
+        for (auto &hop : trace.hops) {
+            if (hop.enqueue_time > prev) {
+                m_state.wire_time.record(hop.enqueue_time - prev);
+            }
+            if (hop.dequeue_time > hop.enqueue_time) {
+                auto residency = hop.dequeue_time - hop.enqueue_time;
+                m_state.relay_time.record(residency);
+            }
+            prev = hop.dequeue_time;
+        }
+
+        if (now > prev) {
+            m_state.wire_time.record(now - prev);
+        }
+    }
+
+    void on_disconnect() override { DLOG(INFO) << "Got disconnect"; }
+
+    /// Free the window slots of messages that never arrived
+    /// Must be called while holding the mutex
+    void expire_outstanding(uint64_t timeout) {
+        auto now = bench_time();
+
+        // sequence numbers grow with the send time
+        while (!m_outstanding.empty() &&
+               m_outstanding.begin()->second + timeout <= now) {
+            m_outstanding.erase(m_outstanding.begin());
+            m_state.num_timed_out++;
+        }
+    }
+
+    bench_state_t &m_state;
+    const uint32_t m_id;
+    const channel_id_t m_channel;
+
+    std::shared_ptr<relay::Connection> m_connection;
+
+    uint64_t m_next_seq = 0;
+
+    std::mutex m_mutex;
+    std::condition_variable m_cond;
+
+    /// Send times of outstanding messages by sequence number
+    std::map<uint64_t, uint64_t> m_outstanding;
+};
+
+yael::network::Address parse_address(const std::string &addr_str) {
+    auto found = addr_str.find(':');
+
+    if (found == std::string::npos) {
+        LOG(FATAL) << "No port specified in address " << addr_str;
+    }
+
+    auto host = addr_str.substr(0, found);
+    auto port = std::atoi(addr_str.substr(found + 1).c_str());
+
+    if (port <= 0 || port > std::numeric_limits<uint16_t>::max()) {
+        LOG(FATAL) << "Not a valid port number: " << port;
+    }
+
+    return yael::network::resolve_URL(host, port);
+}
+
+std::string histogram_json(const Histogram &histogram) {
+    auto snapshot = histogram.snapshot();
+    std::ostringstream out;
+
+    auto mean = snapshot.count > 0 ? snapshot.sum / snapshot.count : 0;
+
+    out << "{\"count\": " << snapshot.count << ", \"mean\": " << mean
+        << ", \"p50\": " << snapshot.quantile(0.5)
+        << ", \"p90\": " << snapshot.quantile(0.9)
+        << ", \"p99\": " << snapshot.quantile(0.99)
+        << ", \"p999\": " << snapshot.quantile(0.999)
+        << ", \"max\": " << snapshot.quantile(1.0) << "}";
+
+    return out.str();
+}
+
+int main(int ac, char *av[]) {
+    google::InitGoogleLogging(av[0]);
+    FLAGS_logtostderr = true;
+
+    po::options_description desc("Allowed options");
+    desc.add_options()("help", "show this help message")(
+        "address", po::value<std::vector<std::string>>()->required(),
+        "relay(s) to connect to; clients are spread round-robin")(
+        "mode", po::value<std::string>()->default_value("open"),
+        "open (fixed rate) or closed (fixed window) loop")(
+        "rate", po::value<double>()->default_value(1000.0),
+        "open loop: messages per second across all clients")(
+        "window", po::value<uint32_t>()->default_value(1),
+        "closed loop: outstanding messages per client")(
+        "timeout", po::value<double>()->default_value(1.0),
+        "closed loop: seconds after which an outstanding message is lost")(
+        "message_size", po::value<uint32_t>()->default_value(64),
+        "message size in bytes")(
+        "num_clients", po::value<uint32_t>()->default_value(4),
+        "number of clients")(
+        "num_channels", po::value<uint32_t>()->default_value(1),
+        "clients subscribe to one of these channels each; fewer channels "
+        "mean a higher fan-out")(
+        "duration", po::value<double>()->default_value(10.0),
+        "measurement duration in seconds")(
+        "warmup", po::value<double>()->default_value(1.0),
+        "seconds to run before measuring")(
+        "drain", po::value<double>()->default_value(5.0),
+        "seconds to wait for outstanding messages afterwards")(
+        "trace_rate", po::value<uint32_t>()->default_value(0),
+        "trace every n-th message (0 = disabled)")(
+        "chunk_size", po::value<uint32_t>()->default_value(DEFAULT_CHUNK_SIZE),
+        "split larger messages into chunks of this size (0 = disabled)")(
+        "label", po::value<std::string>()->default_value(""),
+        "free-form label that is copied into the output");
+
+    po::positional_options_description p;
+    p.add("address", -1);
+
+    po::variables_map vm;
+
+    try {
+        po::store(
+            po::command_line_parser(ac, av).options(desc).positional(p).run(),
+            vm);
+        po::notify(vm);
+    } catch (std::exception &err) {
+        std::cerr << "ERROR: " << err.what() << std::endl;
+        std::cout << desc << std::endl;
+        return 1;
+    }
+
+    if (vm.count("help")) {
+        std::cout << desc << std::endl;
+        return 0;
+    }
+
+    auto mode = vm["mode"].as<std::string>();
+    if (mode != "open" && mode != "closed") {
+        LOG(FATAL) << "Unknown mode: " << mode;
+    }
+
+    auto to_us = [](double seconds) {
+        return static_cast<uint64_t>(seconds * 1'000'000.0);
+    };
+
+    bench_state_t state;
+    auto &config = state.config;
+
+    config.open_loop = (mode == "open");
+    config.rate = vm["rate"].as<double>();
+    config.window = vm["window"].as<uint32_t>();
+    config.timeout = to_us(vm["timeout"].as<double>());
+    config.message_size = vm["message_size"].as<uint32_t>();
+    config.num_clients = vm["num_clients"].as<uint32_t>();
+    config.num_channels = vm["num_channels"].as<uint32_t>();
+
+    if (config.num_clients == 0 || config.num_channels == 0 ||
+        config.rate <= 0.0 || config.window == 0 || config.timeout == 0) {
+        LOG(FATAL) << "Invalid benchmark configuration";
+    }
+
+    auto addresses = vm["address"].as<std::vector<std::string>>();
+
+    yael::EventLoop::initialize();
+    auto &el = yael::EventLoop::get_instance();
+
+    state.subscribers.resize(config.num_channels);
+
+    for (uint32_t i = 0; i < config.num_clients; ++i) {
+        auto channel = static_cast<channel_id_t>(i % config.num_channels);
+
+        auto client = std::make_unique<Client>(state, i, channel);
+        state.clients.emplace_back(std::move(client));
+        state.subscribers[channel].push_back(i);
+    }
+
+    for (uint32_t i = 0; i < config.num_clients; ++i) {
+        auto &addr = addresses[i % addresses.size()];
+        state.clients[i]->connect(parse_address(addr));
+        state.clients[i]->set_trace_rate(vm["trace_rate"].as<uint32_t>());
+        state.clients[i]->set_chunk_size(vm["chunk_size"].as<uint32_t>());
+    }
+
+    // give the relays time to process all subscriptions
+    std::this_thread::sleep_for(0.5s);
+
+    auto start = bench_time();
+    config.measure_start = start + to_us(vm["warmup"].as<double>());
+    config.measure_end =
+        config.measure_start + to_us(vm["duration"].as<double>());
+
+    std::vector<std::thread> senders;
+
+    for (auto &client : state.clients) {
+        auto c = client.get();
+
+        if (config.open_loop) {
+            auto rate = config.rate / config.num_clients;
+            senders.emplace_back([c, start, &config, rate]() {
+                c->run_open_loop(start, config.measure_end, rate);
+            });
+        } else {
+            senders.emplace_back([c, &config]() {
+                c->run_closed_loop(config.measure_end, config.window,
+                                   config.timeout);
+            });
+        }
+    }
+
+    for (auto &t : senders) {
+        t.join();
+    }
+
+    // wait until everything arrived or the drain timeout passed
+    auto drain_end = bench_time() + to_us(vm["drain"].as<double>());
+
+    while (state.num_received < state.num_expected &&
+           bench_time() < drain_end) {
+        std::this_thread::sleep_for(10ms);
+    }
+
+    auto duration = static_cast<double>(config.measure_end -
+                                        config.measure_start) /
+                    1'000'000.0;
+
+    uint64_t received = state.num_received;
+    uint64_t expected = state.num_expected;
+
+    std::cout << "{\"label\": \"" << vm["label"].as<std::string>() << "\""
+              << ", \"mode\": \"" << mode << "\""
+              << ", \"message_size\": " << config.message_size
+              << ", \"num_clients\": " << config.num_clients
+              << ", \"num_channels\": " << config.num_channels
+              << ", \"num_relays\": " << addresses.size()
+              << ", \"rate\": " << (config.open_loop ? config.rate : 0.0)
+              << ", \"window\": " << (config.open_loop ? 0 : config.window)
+              << ", \"duration\": " << duration
+              << ", \"sent\": " << state.num_sent
+              << ", \"expected\": " << expected
+              << ", \"received\": " << received
+              << ", \"timed_out\": " << state.num_timed_out
+              << ", \"lost\": "
+              << (expected > received ? expected - received : 0)
+              << ", \"throughput_msgs\": "
+              << static_cast<double>(received) / duration
+              << ", \"throughput_bytes\": "
+              << static_cast<double>(state.bytes_received) / duration
+              << ", \"latency_us\": " << histogram_json(state.latency)
+              << ", \"relay_time_us\": " << histogram_json(state.relay_time)
+              << ", \"wire_time_us\": " << histogram_json(state.wire_time)
+              << "}" << std::endl;
+
+    for (auto &client : state.clients) {
+        client->close();
+    }
+
+    el.stop();
+    el.wait();
+
+    return received < expected ? 2 : 0;
+}
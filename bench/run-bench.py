@@ -0,0 +1,70 @@
+#! /usr/bin/python3
+
+''' Runs relay-bench across a grid of parameters and topologies
+
+Starts all relays of each network config (like test/testnet.py), runs one
+relay-bench invocation per parameter combination and appends every result
+(one JSON object per line) to the output file.
+'''
+
+import argparse
+import json
+import itertools
+from time import sleep
+from subprocess import Popen, run, PIPE
+
+def int_list(s):
+    return [int(x) for x in s.split(',')]
+
+parser = argparse.ArgumentParser()
+parser.add_argument('--configs', type=str, default='../test/relay.conf',
+        help='comma-separated network configs (topologies) to benchmark')
+parser.add_argument('--modes', type=str, default='open,closed')
+parser.add_argument('--sizes', type=int_list, default=[64, 4096, 65536])
+parser.add_argument('--clients', type=int_list, default=[4, 16])
+parser.add_argument('--channels', type=int_list, default=[1, 4])
+parser.add_argument('--rate', type=float, default=10000.0)
+parser.add_argument('--window', type=int, default=16)
+parser.add_argument('--duration', type=float, default=10.0)
+parser.add_argument('--trace_rate', type=int, default=100)
+parser.add_argument('--output', type=str, default='bench-results.json')
+args = parser.parse_args()
+
+out = open(args.output, 'a')
+
+for fname in args.configs.split(','):
+    nodes = json.load(open(fname))["nodes"]
+    processes = []
+
+    for name in nodes:
+        processes.append(Popen(['./relay-node', name, fname]))
+
+    # wait for servers to start
+    sleep(2.0)
+
+    grid = itertools.product(args.modes.split(','), args.sizes, args.clients,
+            args.channels)
+
+    for mode, size, clients, channels in grid:
+        cmd = ['./relay-bench'] + list(nodes.values()) + [
+            '--mode='+mode, '--message_size='+str(size),
+            '--num_clients='+str(clients), '--num_channels='+str(channels),
+            '--rate='+str(args.rate), '--window='+str(args.window),
+            '--duration='+str(args.duration),
+            '--trace_rate='+str(args.trace_rate), '--label='+fname]
+
+        res = run(cmd, stdout=PIPE, universal_newlines=True)
+
+        if not res.stdout:
+            print("relay-bench failed: " + ' '.join(cmd))
+            continue
+
+        print(res.stdout.strip())
+        out.write(res.stdout)
+        out.flush()
+
+    for p in processes:
+        p.terminate()
+        p.wait()
+
+out.close()
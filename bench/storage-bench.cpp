@@ -0,0 +1,245 @@
+#include "node/Metrics.h"
+#include "node/Storage.h"
+
+#include <boost/program_options.hpp>
+#include <chrono>
+#include <filesystem>
+#include <glog/logging.h>
+#include <iostream>
+#include <random>
+#include <sstream>
+#include <thread>
+
+using namespace std::chrono_literals;
+namespace po = boost::program_options;
+
+using relay::Histogram;
+using relay::Storage;
+
+constexpr const char *STORAGE_PREFIX = "storage-bench";
+
+uint64_t bench_time_ns() {
+    using namespace std::chrono;
+
+    auto now = steady_clock::now().time_since_epoch();
+    return duration_cast<nanoseconds>(now).count();
+}
+
+struct run_t {
+    size_t mem_size;
+    uint32_t entry_size;
+    size_t num_entries;
+    uint32_t num_threads;
+    double hit_ratio;
+};
+
+void report(const std::string &name, const run_t &run, uint64_t ops,
+            uint64_t elapsed_ns, const Histogram &latency) {
+    auto snapshot = latency.snapshot();
+    auto seconds = static_cast<double>(elapsed_ns) / 1e9;
+
+    std::cout << "{\"benchmark\": \"" << name << "\""
+              << ", \"mem_size\": " << run.mem_size
+              << ", \"entry_size\": " << run.entry_size
+              << ", \"num_entries\": " << run.num_entries
+              << ", \"threads\": " << run.num_threads
+              << ", \"hit_ratio\": " << run.hit_ratio << ", \"ops\": " << ops
+              << ", \"ops_per_sec\": " << static_cast<double>(ops) / seconds
+              << ", \"bytes_per_sec\": "
+              << static_cast<double>(ops * run.entry_size) / seconds
+              << ", \"latency_ns\": {\"p50\": " << snapshot.quantile(0.5)
+              << ", \"p99\": " << snapshot.quantile(0.99)
+              << ", \"p999\": " << snapshot.quantile(0.999)
+              << ", \"max\": " << snapshot.quantile(1.0) << "}}" << std::endl;
+}
+
+/// Run fn(thread_id, op) num_ops times spread across all threads
+template <typename Fn>
+uint64_t run_parallel(uint32_t num_threads, size_t num_ops,
+                      Histogram &latency, Fn fn) {
+    std::vector<std::thread> threads;
+    auto start = bench_time_ns();
+
+    for (uint32_t tid = 0; tid < num_threads; ++tid) {
+        threads.emplace_back([&, tid]() {
+            for (size_t i = tid; i < num_ops; i += num_threads) {
+                auto op_start = bench_time_ns();
+                fn(tid, i);
+                latency.record(bench_time_ns() - op_start);
+            }
+        });
+    }
+
+    for (auto &t : threads) {
+        t.join();
+    }
+
+    return bench_time_ns() - start;
+}
+
+void wait_for_writes(Storage &storage) {
+    while (storage.write_queue_length() > 0) {
+        std::this_thread::sleep_for(1ms);
+    }
+
+    // the last entry might still be in the process of being written
+    std::this_thread::sleep_for(100ms);
+}
+
+void run_benchmark(const run_t &run) {
+    std::filesystem::remove_all(std::string("./") + STORAGE_PREFIX + ".store");
+
+    Storage storage(STORAGE_PREFIX, run.mem_size);
+
+    bitstream payload;
+    payload.resize(run.entry_size);
+
+    const std::set<relay::channel_id_t> channels = {1};
+
+    // Insert (includes eviction once the memory budget is exhausted)
+    {
+        Histogram latency;
+        auto elapsed = run_parallel(
+            run.num_threads, run.num_entries, latency,
+            [&](uint32_t, size_t) {
+                storage.insert(channels, payload.duplicate());
+            });
+        report("insert", run, run.num_entries, elapsed, latency);
+    }
+
+    wait_for_writes(storage);
+
+    // Lookups; hits go to recent entries that are still in memory and
+    // misses go to old entries that have to be read from disk
+    {
+        auto entry_mem = run.entry_size + sizeof(relay::channel_id_t) +
+                         2 * sizeof(size_t);
+        auto resident = std::min(run.num_entries,
+                                 std::max<size_t>(run.mem_size / entry_mem, 1));
+        auto evicted = run.num_entries - resident;
+
+        Histogram latency;
+        std::vector<std::mt19937_64> random;
+        for (uint32_t tid = 0; tid < run.num_threads; ++tid) {
+            random.emplace_back(tid + 1);
+        }
+
+        auto elapsed = run_parallel(
+            run.num_threads, run.num_entries, latency,
+            [&](uint32_t tid, size_t) {
+                auto &rng = random[tid];
+                std::uniform_real_distribution<double> coin(0.0, 1.0);
+
+                size_t pos;
+                if (evicted == 0 || coin(rng) < run.hit_ratio) {
+                    pos = run.num_entries - 1 - rng() % resident;
+                } else {
+                    pos = rng() % evicted;
+                }
+
+                auto hdl = storage.get_entry(pos);
+                if (!hdl) {
+                    LOG(FATAL) << "Entry " << pos << " is missing";
+                }
+            });
+        report("get_entry", run, run.num_entries, elapsed, latency);
+    }
+
+    // Replay everything, the way new peers are caught up
+    {
+        Histogram latency;
+        auto it = storage.iterate();
+        size_t count = 0;
+
+        auto start = bench_time_ns();
+        while (true) {
+            auto op_start = bench_time_ns();
+            auto hdl = it.next();
+
+            if (!hdl) {
+                break;
+            }
+
+            latency.record(bench_time_ns() - op_start);
+            count++;
+        }
+        auto elapsed = bench_time_ns() - start;
+
+        auto single = run;
+        single.num_threads = 1;
+        report("replay", single, count, elapsed, latency);
+    }
+}
+
+template <typename T> std::vector<T> parse_list(const std::string &str) {
+    std::vector<T> result;
+    std::istringstream stream(str);
+    std::string item;
+
+    while (std::getline(stream, item, ',')) {
+        T value;
+        std::istringstream(item) >> value;
+        result.push_back(value);
+    }
+
+    return result;
+}
+
+int main(int ac, char *av[]) {
+    google::InitGoogleLogging(av[0]);
+    FLAGS_logtostderr = true;
+
+    po::options_description desc("Allowed options");
+    desc.add_options()("help", "show this help message")(
+        "mem_sizes",
+        po::value<std::string>()->default_value("1048576,67108864"),
+        "comma-separated memory budgets in bytes")(
+        "entry_sizes", po::value<std::string>()->default_value("64,4096"),
+        "comma-separated entry sizes in bytes")(
+        "threads", po::value<std::string>()->default_value("1,4"),
+        "comma-separated thread counts")(
+        "hit_ratios", po::value<std::string>()->default_value("1.0,0.5"),
+        "comma-separated fractions of lookups served from memory")(
+        "num_entries", po::value<size_t>()->default_value(100'000),
+        "entries inserted per run");
+
+    po::variables_map vm;
+
+    try {
+        po::store(po::parse_command_line(ac, av, desc), vm);
+        po::notify(vm);
+    } catch (std::exception &err) {
+        std::cerr << "ERROR: " << err.what() << std::endl;
+        std::cout << desc << std::endl;
+        return 1;
+    }
+
+    if (vm.count("help")) {
+        std::cout << desc << std::endl;
+        return 0;
+    }
+
+    auto num_entries = vm["num_entries"].as<size_t>();
+
+    for (auto mem_size :
+         parse_list<size_t>(vm["mem_sizes"].as<std::string>())) {
+        for (auto entry_size :
+             parse_list<uint32_t>(vm["entry_sizes"].as<std::string>())) {
+            for (auto threads :
+                 parse_list<uint32_t>(vm["threads"].as<std::string>())) {
+                for (auto hit_ratio :
+                     parse_list<double>(vm["hit_ratios"].as<std::string>())) {
+                    if (threads == 0) {
+                        LOG(FATAL) << "Need at least one thread";
+                    }
+
+                    run_benchmark(run_t{mem_size, entry_size, num_entries,
+                                        threads, hit_ratio});
+                }
+            }
+        }
+    }
+
+    std::filesystem::remove_all(std::string("./") + STORAGE_PREFIX + ".store");
+    return 0;
+}
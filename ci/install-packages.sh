@@ -2,4 +2,4 @@
 
 sudo apt-get update
 
-sudo apt-get install meson build-essential git librange-v3-dev g++-8 libgtest-dev libgflags-dev libboost-program-options-dev libpython3-dev libboost-python-dev pkg-config python3-pytest cmake clang-8 clang-tidy-8 libgmp-dev gdb net-tools libssl-dev libgoogle-glog-dev -y
+sudo apt-get install meson build-essential git librange-v3-dev g++-8 libgtest-dev libgflags-dev libboost-program-options-dev libpython3-dev libboost-python-dev pkg-config python3-pytest cmake clang-8 clang-tidy-8 libgmp-dev gdb net-tools libssl-dev libgoogle-glog-dev zlib1g-dev -y
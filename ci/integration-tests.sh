@@ -10,3 +10,4 @@ export PYTHONPATH=${INSTALL_DIR}/lib/${PY_VERSION}/site-packages:${INSTALL_DIR}/
 cd build
 ../test/testnet.py
 ../test/testnet-edge.py
+./relay-sim ../test/relay.conf
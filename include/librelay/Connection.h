@@ -2,6 +2,8 @@
 
 #include <memory>
 #include <set>
+#include <string>
+#include <vector>
 #include <bitstream.h>
 
 namespace relay
@@ -9,6 +11,44 @@ namespace relay
 
 using channel_id_t = uint16_t;
 
+/// Timestamps of one relay a traced message passed through
+/// All times are in microseconds since the epoch (of the relay's clock)
+struct hop_trace_t
+{
+    /// When the relay received the message
+    uint64_t enqueue_time;
+
+    /// When the relay started forwarding it
+    uint64_t dequeue_time;
+};
+
+/// Path of a sampled message through the relay network
+struct message_trace_t
+{
+    /// When the sender handed the message to the library
+    uint64_t origin_time;
+
+    std::vector<hop_trace_t> hops;
+};
+
+/// Position of a chunk within a large message
+/// Senders split messages that exceed their chunk size (see
+/// Connection::set_chunk_size), so relays can forward the parts while the
+/// rest is still arriving
+struct message_chunk_t
+{
+    /// Identifies the message among all messages in flight
+    uint64_t sender;
+    uint64_t message;
+
+    /// Chunks are numbered from 0 and delivered in order
+    uint32_t index;
+    uint32_t count;
+
+    /// Empty unless the message was published on a topic
+    std::string topic;
+};
+
 class Callback
 {
 public:
@@ -16,6 +56,40 @@ public:
 
     virtual void on_new_message(std::set<channel_id_t> channels, bitstream &&data) = 0;
 
+    /// Called right before on_new_message if the message was traced
+    virtual void on_message_trace(const std::set<channel_id_t> &channels,
+                                  const message_trace_t &trace)
+    {
+        (void)channels;
+        (void)trace;
+    }
+
+    /// Called for messages on topics that match a subscribed pattern
+    virtual void on_topic_message(const std::string &topic, bitstream &&data)
+    {
+        (void)topic;
+        (void)data;
+    }
+
+    /// Return true to receive large messages through on_message_chunk as
+    /// they arrive instead of reassembled through on_new_message
+    virtual bool stream_chunks() const
+    {
+        return false;
+    }
+
+    /// Called for every chunk of a large message if stream_chunks is set
+    /// Messages that were not split are still passed to on_new_message
+    /// (or on_topic_message)
+    virtual void on_message_chunk(const std::set<channel_id_t> &channels,
+                                  const message_chunk_t &chunk,
+                                  bitstream &&data)
+    {
+        (void)channels;
+        (void)chunk;
+        (void)data;
+    }
+
     virtual void on_disconnect() = 0;
 };
 
@@ -26,6 +100,30 @@ public:
 
     virtual void send(const std::set<channel_id_t> &channels, bitstream &&data, bool blocking) = 0;
 
+    /// Send the latest value for a key
+    /// On conflating channels, relays drop older values for the same key
+    /// that have not been forwarded yet
+    virtual void send_update(const std::set<channel_id_t> &channels, uint64_t key, bitstream &&data, bool blocking) = 0;
+
+    /// Send a message on a named topic, such as "md.eu.fx"
+    /// Topics are mapped to channels by the relays
+    virtual void publish(const std::string &topic, bitstream &&data, bool blocking) = 0;
+
+    /// Receive messages on the topics that match any of the patterns
+    /// A "*" segment matches any one segment, or everything below a prefix
+    /// if it comes last (e.g., "md.eu.*")
+    virtual void subscribe(const std::set<std::string> &patterns) = 0;
+
+    virtual void unsubscribe(const std::set<std::string> &patterns) = 0;
+
+    /// Attach a trace to every n-th message sent (0 disables tracing)
+    virtual void set_trace_rate(uint32_t rate) = 0;
+
+    /// Split messages larger than this many bytes into chunks (0 disables)
+    /// Updates are never split, as relays may drop them in favor of newer
+    /// values for the same key
+    virtual void set_chunk_size(uint32_t size) = 0;
+
     virtual void close() = 0;
 };
 
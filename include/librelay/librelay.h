@@ -1,13 +1,21 @@
 #pragma once
 
 #include <set>
+#include <string>
 #include "librelay/Connection.h"
 #include <yael/network/Address.h>
 
 namespace relay
 {
 
+/// @param history number of recent messages per channel the node replays
+///        to the new connection
 [[nodiscard]]
-std::shared_ptr<Connection> create_connection(const yael::network::Address &address, Callback &callback, std::set<channel_id_t> subscriptions);
+std::shared_ptr<Connection> create_connection(const yael::network::Address &address, Callback &callback, std::set<channel_id_t> subscriptions, uint32_t history = 0);
+
+/// Connect to "host:port" over TCP, or to a node on the same host through
+/// shared memory with "shm://name"
+[[nodiscard]]
+std::shared_ptr<Connection> create_connection(const std::string &address, Callback &callback, std::set<channel_id_t> subscriptions, uint32_t history = 0);
 
 }
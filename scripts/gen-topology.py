@@ -0,0 +1,168 @@
+#! /usr/bin/python3
+
+''' Generates network configs for relay-node, relay-sim and test/cluster.py
+
+Supported topologies: star, ring, tree, mesh, random geometric graphs (rgg)
+and geo, where relays are placed on the globe and delays are derived from
+the great-circle distance between them.
+
+Relays flood messages to all neighbors and do not detect duplicates, so
+topologies with cycles are reduced to their minimum spanning tree (by
+delay) unless --keep-cycles is given.
+'''
+
+import argparse
+import json
+import math
+import random
+import sys
+
+# Propagation speed in fiber is roughly 200km/ms
+FIBER_KM_PER_MS = 200.0
+EARTH_RADIUS_KM = 6371.0
+
+# Some well-connected locations to place relays at with --type=geo
+CITIES = [
+    ("frankfurt", 50.11, 8.68), ("london", 51.51, -0.13),
+    ("virginia", 38.03, -78.48), ("oregon", 45.52, -122.68),
+    ("saopaulo", -23.55, -46.63), ("tokyo", 35.68, 139.69),
+    ("singapore", 1.35, 103.82), ("sydney", -33.87, 151.21),
+    ("mumbai", 19.08, 72.88), ("johannesburg", -26.20, 28.05),
+    ("stockholm", 59.33, 18.07), ("montreal", 45.50, -73.57),
+]
+
+def great_circle_km(a, b):
+    lat1, lon1 = math.radians(a[0]), math.radians(a[1])
+    lat2, lon2 = math.radians(b[0]), math.radians(b[1])
+
+    h = math.sin((lat2-lat1)/2)**2 + \
+        math.cos(lat1)*math.cos(lat2)*math.sin((lon2-lon1)/2)**2
+    return 2 * EARTH_RADIUS_KM * math.asin(math.sqrt(h))
+
+def minimum_spanning_tree(num_nodes, edges):
+    ''' Kruskal on (from, to, delay) tuples '''
+    parent = list(range(num_nodes))
+
+    def find(x):
+        while parent[x] != x:
+            parent[x] = parent[parent[x]]
+            x = parent[x]
+        return x
+
+    result = []
+    for (a, b, delay) in sorted(edges, key=lambda e: e[2]):
+        ra, rb = find(a), find(b)
+        if ra != rb:
+            parent[ra] = rb
+            result.append((a, b, delay))
+
+    return result
+
+def generate(kind, num_nodes, base_port=55000, delay=50, radius=None,
+        bandwidth=0, num_channels=32, keep_cycles=False, seed=None):
+    ''' Returns a network config as a dict '''
+    rng = random.Random(seed)
+    names = ["relay%d" % i for i in range(num_nodes)]
+    edges = []
+
+    if kind == 'star':
+        edges = [(i, 0, delay) for i in range(1, num_nodes)]
+    elif kind == 'ring':
+        edges = [(i, (i+1) % num_nodes, delay) for i in range(num_nodes)]
+    elif kind == 'tree':
+        # binary tree; children connect to their parent
+        edges = [(i, (i-1) // 2, delay) for i in range(1, num_nodes)]
+    elif kind == 'mesh':
+        edges = [(i, j, delay) for i in range(num_nodes)
+                for j in range(i+1, num_nodes)]
+    elif kind == 'rgg':
+        # nodes in a unit square; delay scales with the distance
+        if radius is None:
+            radius = 2.0 * math.sqrt(math.log(max(num_nodes, 2)) / num_nodes)
+
+        pos = [(rng.random(), rng.random()) for _ in range(num_nodes)]
+
+        for i in range(num_nodes):
+            for j in range(i+1, num_nodes):
+                dist = math.dist(pos[i], pos[j])
+                if dist <= radius:
+                    edges.append((i, j, max(1, int(dist * delay * 2))))
+
+        if len(minimum_spanning_tree(num_nodes, edges)) < num_nodes - 1:
+            sys.exit("Random geometric graph is not connected; "
+                     "increase --radius")
+    elif kind == 'geo':
+        # spread relays across the cities with some random offset
+        pos = []
+        for i in range(num_nodes):
+            (city, lat, lon) = CITIES[i % len(CITIES)]
+            if i >= len(CITIES):
+                lat += rng.uniform(-2.0, 2.0)
+                lon += rng.uniform(-2.0, 2.0)
+            else:
+                names[i] = city
+            pos.append((lat, lon))
+
+        # fiber paths are not straight; assume 1.5x the distance
+        for i in range(num_nodes):
+            for j in range(i+1, num_nodes):
+                km = great_circle_km(pos[i], pos[j]) * 1.5
+                edges.append((i, j, max(1, int(km / FIBER_KM_PER_MS))))
+    else:
+        sys.exit("Unknown topology type: " + kind)
+
+    if not keep_cycles and len(edges) >= num_nodes:
+        edges = minimum_spanning_tree(num_nodes, edges)
+
+    config = {
+        "num_channels": num_channels,
+        "nodes": {},
+        "edges": [],
+    }
+
+    if seed is not None:
+        config["seed"] = seed
+
+    for i in range(num_nodes):
+        config["nodes"][names[i]] = "localhost:%d" % (base_port + i)
+
+    for (a, b, d) in edges:
+        edge = {"from": names[a], "to": names[b], "delay": d}
+        if bandwidth > 0:
+            edge["bandwidth"] = bandwidth
+        config["edges"].append(edge)
+
+    return config
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__,
+            formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument('type', type=str,
+            help='star, ring, tree, mesh, rgg or geo')
+    parser.add_argument('num_nodes', type=int)
+    parser.add_argument('--base-port', type=int, default=55000)
+    parser.add_argument('--delay', type=int, default=50,
+            help='link delay in ms (scale factor for rgg)')
+    parser.add_argument('--radius', type=float, default=None,
+            help='connection radius for rgg')
+    parser.add_argument('--bandwidth', type=int, default=0,
+            help='link bandwidth in kbit/s (0 = unlimited)')
+    parser.add_argument('--num-channels', type=int, default=32)
+    parser.add_argument('--keep-cycles', action='store_true')
+    parser.add_argument('--seed', type=int, default=None)
+    parser.add_argument('--output', type=str, default=None)
+    args = parser.parse_args()
+
+    if args.num_nodes < 1:
+        sys.exit("Need at least one node")
+
+    config = generate(args.type, args.num_nodes, args.base_port, args.delay,
+            args.radius, args.bandwidth, args.num_channels, args.keep_cycles,
+            args.seed)
+
+    out = open(args.output, 'w') if args.output else sys.stdout
+    json.dump(config, out, indent=4)
+    out.write('\n')
+
+if __name__ == '__main__':
+    main()
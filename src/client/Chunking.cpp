@@ -0,0 +1,254 @@
+#include "Chunking.h"
+#include "common/defines.h"
+
+#include <algorithm>
+#include <glog/logging.h>
+#include <random>
+
+namespace relay {
+
+// Incomplete messages kept per connection before the oldest is dropped
+// Messages stay incomplete if the client connected after they started
+constexpr size_t MAX_PARTIAL_MESSAGES = 64;
+
+// Finished messages remembered per connection to ignore late duplicates
+constexpr size_t MAX_FINISHED_MESSAGES = 1024;
+
+inline uint64_t make_sender_id() {
+    std::random_device rd;
+    return (static_cast<uint64_t>(rd()) << 32) | rd();
+}
+
+Chunker::Chunker()
+    : m_sender(make_sender_id()), m_chunk_size(DEFAULT_CHUNK_SIZE) {}
+
+std::vector<bitstream> Chunker::prepare(const message_header_t &header,
+                                        bitstream &&data) {
+    std::vector<bitstream> result;
+    auto chunk_size = m_chunk_size.load();
+
+    // updates are never split, relays might conflate some of the chunks
+    if (chunk_size == 0 || header.key || data.size() <= chunk_size) {
+        write_header(data, header);
+        result.push_back(std::move(data));
+        return result;
+    }
+
+    uint32_t count = (data.size() + chunk_size - 1) / chunk_size;
+    fragment_t fragment = {
+        message_id_t{m_sender, m_next_message.fetch_add(1)}, 0, count};
+
+    result.reserve(count);
+
+    for (uint32_t offset = 0; offset < data.size(); offset += chunk_size) {
+        auto length = std::min(chunk_size, data.size() - offset);
+
+        bitstream chunk;
+        chunk.write_raw_data(data.data() + offset, length);
+
+        message_header_t chunk_header;
+        chunk_header.channels = header.channels;
+        chunk_header.topic = header.topic;
+        chunk_header.fragment = fragment;
+
+        // the trace of the first chunk stands for the whole message
+        if (fragment.index == 0) {
+            chunk_header.trace = header.trace;
+        }
+
+        write_header(chunk, chunk_header);
+        result.push_back(std::move(chunk));
+
+        fragment.index++;
+    }
+
+    return result;
+}
+
+void Reassembler::subscribe(const std::set<std::string> &patterns) {
+    std::unique_lock lock(m_topic_mutex);
+
+    for (auto &pattern : patterns) {
+        m_topics.insert(pattern, pattern);
+    }
+}
+
+void Reassembler::unsubscribe(const std::set<std::string> &patterns) {
+    std::unique_lock lock(m_topic_mutex);
+
+    for (auto &pattern : patterns) {
+        m_topics.erase(pattern, pattern);
+    }
+}
+
+bool Reassembler::is_subscribed(const std::string &topic) {
+    std::unique_lock lock(m_topic_mutex);
+    return m_topics.matches(topic);
+}
+
+void Reassembler::deliver(message_header_t &&header, bitstream &&data) {
+    if (header.topic && !is_subscribed(*header.topic)) {
+        return;
+    }
+
+    if (!header.fragment) {
+        complete(std::move(header.channels), std::move(header.topic),
+                 header.trace, std::move(data));
+        return;
+    }
+
+    auto index = header.fragment->index;
+
+    if (index >= header.fragment->count) {
+        LOG(ERROR) << "Received invalid chunk " << index << " of "
+                   << header.fragment->count;
+        return;
+    }
+
+    expire_partials();
+
+    if (m_finished.count(header.fragment->message) > 0) {
+        // e.g., replayed again after a failover
+        return;
+    }
+
+    auto it = find_partial(header);
+    auto &partial = *it;
+
+    if (header.trace && !partial.trace) {
+        partial.trace = std::move(header.trace);
+    }
+
+    // duplicates are possible after a failover
+    if (index < partial.next || partial.early.count(index) > 0) {
+        return;
+    }
+
+    partial.last_progress = std::chrono::steady_clock::now();
+
+    if (index > partial.next) {
+        partial.early.emplace(index, std::move(data));
+        return;
+    }
+
+    bool done = hand_out(partial, std::move(data));
+
+    while (!done) {
+        auto early = partial.early.find(partial.next);
+
+        if (early == partial.early.end()) {
+            break;
+        }
+
+        auto chunk = std::move(early->second);
+        partial.early.erase(early);
+
+        done = hand_out(partial, std::move(chunk));
+    }
+
+    if (done) {
+        finish(it);
+    }
+}
+
+void Reassembler::finish(std::list<partial_t>::iterator it) {
+    m_finished.insert(it->message);
+    m_finished_order.push_back(it->message);
+
+    if (m_finished_order.size() > MAX_FINISHED_MESSAGES) {
+        m_finished.erase(m_finished_order.front());
+        m_finished_order.pop_front();
+    }
+
+    m_partials.erase(it);
+}
+
+void Reassembler::expire_partials() {
+    auto now = std::chrono::steady_clock::now();
+
+    for (auto it = m_partials.begin(); it != m_partials.end();) {
+        auto current = it++;
+
+        if (current->last_progress + m_timeout <= now) {
+            LOG(WARNING) << "Dropping incomplete message after receiving "
+                         << current->next << " of " << current->count
+                         << " chunks in order";
+            finish(current);
+        }
+    }
+}
+
+std::list<Reassembler::partial_t>::iterator
+Reassembler::find_partial(const message_header_t &header) {
+    auto &message = header.fragment->message;
+
+    for (auto it = m_partials.begin(); it != m_partials.end(); ++it) {
+        if (it->message == message) {
+            return it;
+        }
+    }
+
+    if (m_partials.size() >= MAX_PARTIAL_MESSAGES) {
+        auto &oldest = m_partials.front();
+        LOG(WARNING) << "Dropping incomplete message after receiving "
+                     << oldest.next << " of " << oldest.count << " chunks";
+        finish(m_partials.begin());
+    }
+
+    partial_t partial;
+    partial.message = message;
+    partial.last_progress = std::chrono::steady_clock::now();
+    partial.channels = header.channels;
+    partial.topic = header.topic;
+    partial.count = header.fragment->count;
+
+    return m_partials.insert(m_partials.end(), std::move(partial));
+}
+
+bool Reassembler::hand_out(partial_t &partial, bitstream &&chunk) {
+    bool streaming = m_callback.stream_chunks();
+
+    if (streaming) {
+        if (partial.next == 0 && partial.trace) {
+            m_callback.on_message_trace(partial.channels, *partial.trace);
+        }
+
+        message_chunk_t info = {partial.message.origin,
+                                partial.message.sequence, partial.next,
+                                partial.count, partial.topic.value_or("")};
+        m_callback.on_message_chunk(partial.channels, info, std::move(chunk));
+    } else {
+        partial.data.write_raw_data(chunk.data(), chunk.size());
+    }
+
+    partial.next++;
+
+    if (partial.next < partial.count) {
+        return false;
+    }
+
+    if (!streaming) {
+        partial.data.move_to(0);
+        complete(std::move(partial.channels), std::move(partial.topic),
+                 partial.trace, std::move(partial.data));
+    }
+
+    return true;
+}
+
+void Reassembler::complete(std::set<channel_id_t> &&channels,
+                           std::optional<std::string> &&topic,
+                           const std::optional<message_trace_t> &trace,
+                           bitstream &&data) {
+    if (trace) {
+        m_callback.on_message_trace(channels, *trace);
+    }
+
+    if (topic) {
+        m_callback.on_topic_message(*topic, std::move(data));
+    } else {
+        m_callback.on_new_message(std::move(channels), std::move(data));
+    }
+}
+
+} // namespace relay
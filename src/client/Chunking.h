@@ -0,0 +1,131 @@
+#pragma once
+
+#include "common/MessageHeader.h"
+#include "common/Topics.h"
+#include "librelay/Connection.h"
+
+#include <atomic>
+#include <chrono>
+#include <deque>
+#include <list>
+#include <map>
+#include <mutex>
+#include <unordered_set>
+#include <vector>
+
+namespace relay {
+
+/// Splits messages that are larger than the chunk size
+///
+/// Every chunk is a regular message to the relays, so they store and forward
+/// the first chunks while the sender is still writing the rest, and small
+/// messages are not stuck behind a large one.
+class Chunker {
+  public:
+    Chunker();
+
+    void set_chunk_size(uint32_t size) { m_chunk_size = size; }
+
+    /// Prepend the header to the data, splitting it if it is too large
+    /// @return the messages to send, in order
+    std::vector<bitstream> prepare(const message_header_t &header,
+                                   bitstream &&data);
+
+  private:
+    /// Random id that makes message ids unique across senders
+    const uint64_t m_sender;
+
+    std::atomic<uint32_t> m_chunk_size;
+    std::atomic<uint64_t> m_next_message = 0;
+};
+
+/// Passes received messages to the callback, reassembling split messages
+/// unless the callback streams chunks
+///
+/// Chunks are delivered in order even if they were received out of order
+/// (e.g., after an upstream relay failed over). Catch-up can start in the
+/// middle of a split message and chunks can be lost, so messages that did
+/// not receive a chunk for a while are given up, and chunks of messages
+/// that were completed (or given up) recently are ignored. Messages on
+/// topics that do not match the subscribed patterns are dropped; relays may
+/// still send some when they replay the history of a channel. Only subscribe
+/// and unsubscribe are thread-safe; every connection receives on a single
+/// thread.
+class Reassembler {
+  public:
+    /// Messages that receive no chunk for this long are dropped
+    static constexpr std::chrono::steady_clock::duration
+        PARTIAL_MESSAGE_TIMEOUT = std::chrono::seconds(10);
+
+    explicit Reassembler(
+        Callback &callback,
+        std::chrono::steady_clock::duration timeout = PARTIAL_MESSAGE_TIMEOUT)
+        : m_callback(callback), m_timeout(timeout) {}
+
+    void deliver(message_header_t &&header, bitstream &&data);
+
+    void subscribe(const std::set<std::string> &patterns);
+    void unsubscribe(const std::set<std::string> &patterns);
+
+  private:
+    struct partial_t {
+        message_id_t message;
+        /// When the last new chunk of the message arrived
+        std::chrono::steady_clock::time_point last_progress;
+        std::set<channel_id_t> channels;
+        std::optional<message_trace_t> trace;
+        std::optional<std::string> topic;
+        uint32_t count;
+
+        /// Index of the next chunk to hand out
+        uint32_t next = 0;
+
+        /// Chunks that arrived ahead of the next one
+        std::map<uint32_t, bitstream> early;
+
+        /// Chunks handed out so far (if not streaming)
+        bitstream data;
+    };
+
+    /// Find (or start) the message the chunk belongs to
+    std::list<partial_t>::iterator find_partial(const message_header_t &header);
+
+    /// Forget a message that is complete or will never be
+    void finish(std::list<partial_t>::iterator it);
+
+    /// Give up on messages that did not receive a chunk in time
+    void expire_partials();
+
+    /// @return true if this was the last chunk
+    bool hand_out(partial_t &partial, bitstream &&chunk);
+
+    bool is_subscribed(const std::string &topic);
+
+    /// Pass a complete message to the callback
+    void complete(std::set<channel_id_t> &&channels,
+                  std::optional<std::string> &&topic,
+                  const std::optional<message_trace_t> &trace,
+                  bitstream &&data);
+
+    Callback &m_callback;
+    const std::chrono::steady_clock::duration m_timeout;
+
+    std::mutex m_topic_mutex;
+    TopicTrie<std::string> m_topics;
+
+    /// Least recently started message first
+    std::list<partial_t> m_partials;
+
+    struct id_hash_t {
+        size_t operator()(const message_id_t &id) const {
+            return std::hash<uint64_t>()(id.origin) ^
+                   (std::hash<uint64_t>()(id.sequence) << 1);
+        }
+    };
+
+    /// Recently finished messages, oldest first
+    std::unordered_set<message_id_t, id_hash_t> m_finished;
+    std::deque<message_id_t> m_finished_order;
+};
+
+} // namespace relay
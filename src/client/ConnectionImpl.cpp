@@ -1,4 +1,5 @@
 #include "ConnectionImpl.h"
+#include "common/MessageHeader.h"
 #include "common/defines.h"
 
 #include <stdbitstream.h>
@@ -8,8 +9,10 @@ namespace relay {
 
 ConnectionImpl::ConnectionImpl(const yael::network::Address &address,
                                Callback &callback,
-                               std::set<channel_id_t> subscriptions)
-    : m_callback(callback), m_subscriptions(subscriptions) {
+                               std::set<channel_id_t> subscriptions,
+                               uint32_t history)
+    : m_callback(callback), m_reassembler(callback),
+      m_subscriptions(subscriptions) {
     using yael::network::MessageMode;
     using yael::network::TcpSocket;
 
@@ -24,7 +27,7 @@ ConnectionImpl::ConnectionImpl(const yael::network::Address &address,
                yael::SocketType::Connection);
 
     bitstream hello;
-    hello << std::string("client") << m_subscriptions;
+    hello << std::string(CLIENT_NAME) << m_subscriptions << history;
 
     NetworkSocketListener::send(hello.data(), hello.size(), true);
 }
@@ -33,20 +36,81 @@ ConnectionImpl::~ConnectionImpl() = default;
 
 void ConnectionImpl::send(const std::set<channel_id_t> &channels,
                           bitstream &&data, bool blocking) {
+    message_header_t header;
+    header.channels = channels;
+
+    send_message(std::move(header), std::move(data), blocking);
+}
+
+void ConnectionImpl::send_update(const std::set<channel_id_t> &channels,
+                                 uint64_t key, bitstream &&data,
+                                 bool blocking) {
+    message_header_t header;
+    header.channels = channels;
+    header.key = key;
+
+    send_message(std::move(header), std::move(data), blocking);
+}
+
+void ConnectionImpl::publish(const std::string &topic, bitstream &&data,
+                             bool blocking) {
+    if (!is_valid_topic(topic)) {
+        LOG(ERROR) << "Cannot publish on invalid topic \"" << topic << "\"";
+        return;
+    }
+
+    message_header_t header;
+    header.topic = topic;
+
+    send_message(std::move(header), std::move(data), blocking);
+}
+
+void ConnectionImpl::update_topics(const std::set<std::string> &added,
+                                   const std::set<std::string> &removed) {
+    for (auto &pattern : added) {
+        if (!is_valid_pattern(pattern)) {
+            LOG(ERROR) << "Invalid topic pattern \"" << pattern << "\"";
+            return;
+        }
+    }
+
+    m_reassembler.subscribe(added);
+    m_reassembler.unsubscribe(removed);
+
+    message_header_t header;
+    header.topic_subscription = true;
+
+    bitstream update;
+    update << added << removed;
+    write_header(update, header);
+
+    try {
+        NetworkSocketListener::send(update.data(), update.size(), true);
+    } catch (const yael::network::socket_error &e) {
+        LOG(ERROR) << "Failed to send topic subscription " << e.what();
+    }
+}
+
+void ConnectionImpl::send_message(message_header_t header, bitstream &&data,
+                                  bool blocking) {
     try {
-        // prepend channel id to message
-        data.move_to(0);
-        data.make_space(sizeof(uint32_t) +
-                        channels.size() * sizeof(channel_id_t));
-        data << channels;
-
-        // pass data to the network layer in form a simple buffer
-        uint8_t *ptr = 0;
-        uint32_t size;
-        data.detach(ptr, size);
-
-        NetworkSocketListener::send(std::unique_ptr<uint8_t[]>(ptr), size,
-                                    blocking);
+        auto rate = m_trace_rate.load();
+        auto count = m_num_sent.fetch_add(1);
+
+        if (rate > 0 && count % rate == 0) {
+            header.trace = message_trace_t{trace_time(), {}};
+        }
+
+        // prepend channel ids (and trace) to every chunk of the message
+        for (auto &chunk : m_chunker.prepare(header, std::move(data))) {
+            // pass data to the network layer in form a simple buffer
+            uint8_t *ptr = 0;
+            uint32_t size;
+            chunk.detach(ptr, size);
+
+            NetworkSocketListener::send(std::unique_ptr<uint8_t[]>(ptr), size,
+                                        blocking);
+        }
     } catch (const yael::network::socket_error &e) {
         LOG(ERROR) << "Failed to send message to relay network " << e.what();
     }
@@ -59,16 +123,11 @@ void ConnectionImpl::on_network_message(yael::network::message_in_t &msg) {
         return;
     }
 
-    std::set<channel_id_t> channels;
-
     bitstream bs;
     bs.assign(msg.data, msg.length, false);
-    bs >> channels;
-
-    bs.move_to(0);
-    bs.remove_space(sizeof(uint32_t) + channels.size() * sizeof(channel_id_t));
 
-    m_callback.on_new_message(channels, std::move(bs));
+    auto header = read_header(bs);
+    m_reassembler.deliver(std::move(header), std::move(bs));
 }
 
 void ConnectionImpl::on_disconnect() { m_callback.on_disconnect(); }
@@ -1,6 +1,9 @@
 #pragma once
 
+#include "Chunking.h"
 #include "librelay/Connection.h"
+#include <atomic>
+#include <optional>
 #include <set>
 #include <yael/NetworkSocketListener.h>
 
@@ -9,22 +12,53 @@ namespace relay {
 class ConnectionImpl : public yael::NetworkSocketListener, public Connection {
   public:
     ConnectionImpl(const yael::network::Address &address, Callback &callback,
-                   std::set<channel_id_t> subscriptions);
+                   std::set<channel_id_t> subscriptions, uint32_t history);
     ~ConnectionImpl();
 
     void send(const std::set<channel_id_t> &channels, bitstream &&data,
               bool blocking) override;
 
+    void send_update(const std::set<channel_id_t> &channels, uint64_t key,
+                     bitstream &&data, bool blocking) override;
+
+    void publish(const std::string &topic, bitstream &&data,
+                 bool blocking) override;
+
+    void subscribe(const std::set<std::string> &patterns) override {
+        update_topics(patterns, {});
+    }
+
+    void unsubscribe(const std::set<std::string> &patterns) override {
+        update_topics({}, patterns);
+    }
+
+    void set_trace_rate(uint32_t rate) override { m_trace_rate = rate; }
+
+    void set_chunk_size(uint32_t size) override {
+        m_chunker.set_chunk_size(size);
+    }
+
     void close() override { yael::NetworkSocketListener::close_socket(); }
 
   private:
+    void send_message(message_header_t header, bitstream &&data,
+                      bool blocking);
+
+    void update_topics(const std::set<std::string> &added,
+                       const std::set<std::string> &removed);
+
     void on_network_message(yael::network::message_in_t &msg) override;
     void on_disconnect() override;
 
     Callback &m_callback;
+    Chunker m_chunker;
+    Reassembler m_reassembler;
     const std::set<channel_id_t> m_subscriptions;
 
     bool m_set_up = false;
+
+    std::atomic<uint32_t> m_trace_rate = 0;
+    std::atomic<uint64_t> m_num_sent = 0;
 };
 
 } // namespace relay
@@ -0,0 +1,189 @@
+#include "ShmConnection.h"
+#include "common/MessageHeader.h"
+#include "common/SocketUtils.h"
+
+#include <glog/logging.h>
+#include <stdbitstream.h>
+#include <sys/un.h>
+
+namespace relay {
+
+// How often the receiver checks whether the node is still there
+constexpr auto SHM_POLL_INTERVAL = std::chrono::milliseconds(100);
+
+ShmConnection::ShmConnection(const std::string &name, Callback &callback,
+                             std::set<channel_id_t> subscriptions,
+                             uint32_t history)
+    : m_callback(callback), m_reassembler(callback) {
+    auto path = shm_socket_path(name);
+
+    sockaddr_un addr = {};
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, path.c_str(), sizeof(addr.sun_path) - 1);
+
+    m_socket = ::socket(AF_UNIX, SOCK_STREAM, 0);
+
+    if (m_socket < 0 || ::connect(m_socket, reinterpret_cast<sockaddr *>(&addr),
+                                  sizeof(addr)) != 0) {
+        LOG(FATAL) << "Failed to connect to relay node at " << path;
+    }
+
+    static std::atomic<uint32_t> next_id = 0;
+    auto segment_name = "/librelay-" + std::to_string(::getpid()) + "-" +
+                        std::to_string(next_id++);
+
+    try {
+        m_segment = ShmSegment::create(segment_name);
+    } catch (std::exception &e) {
+        LOG(FATAL) << e.what();
+    }
+
+    bitstream hello;
+    hello << segment_name << subscriptions << history;
+
+    uint32_t length = hello.size();
+    uint8_t ack = 0;
+
+    bool res = send_all(m_socket, reinterpret_cast<uint8_t *>(&length),
+                        sizeof(length)) &&
+               send_all(m_socket, hello.data(), hello.size()) &&
+               recv_all(m_socket, &ack, sizeof(ack));
+
+    // the node has it mapped now (or failed to)
+    shm_unlink(segment_name.c_str());
+
+    if (!res || ack != 1) {
+        LOG(FATAL) << "Shared-memory handshake with relay node failed";
+    }
+
+    m_receive_thread = std::thread(&ShmConnection::receive_loop, this);
+}
+
+ShmConnection::~ShmConnection() { close(); }
+
+void ShmConnection::close() {
+    if (!m_okay.exchange(false)) {
+        return;
+    }
+
+    m_segment->close();
+
+    if (m_receive_thread.joinable() &&
+        m_receive_thread.get_id() != std::this_thread::get_id()) {
+        m_receive_thread.join();
+    }
+
+    ::close(m_socket);
+}
+
+void ShmConnection::send(const std::set<channel_id_t> &channels,
+                         bitstream &&data, bool blocking) {
+    // writes only block while the ring is full
+    (void)blocking;
+
+    message_header_t header;
+    header.channels = channels;
+
+    send_message(std::move(header), std::move(data));
+}
+
+void ShmConnection::send_update(const std::set<channel_id_t> &channels,
+                                uint64_t key, bitstream &&data,
+                                bool blocking) {
+    (void)blocking;
+
+    message_header_t header;
+    header.channels = channels;
+    header.key = key;
+
+    send_message(std::move(header), std::move(data));
+}
+
+void ShmConnection::publish(const std::string &topic, bitstream &&data,
+                            bool blocking) {
+    (void)blocking;
+
+    if (!is_valid_topic(topic)) {
+        LOG(ERROR) << "Cannot publish on invalid topic \"" << topic << "\"";
+        return;
+    }
+
+    message_header_t header;
+    header.topic = topic;
+
+    send_message(std::move(header), std::move(data));
+}
+
+void ShmConnection::update_topics(const std::set<std::string> &added,
+                                  const std::set<std::string> &removed) {
+    for (auto &pattern : added) {
+        if (!is_valid_pattern(pattern)) {
+            LOG(ERROR) << "Invalid topic pattern \"" << pattern << "\"";
+            return;
+        }
+    }
+
+    m_reassembler.subscribe(added);
+    m_reassembler.unsubscribe(removed);
+
+    message_header_t header;
+    header.topic_subscription = true;
+
+    bitstream update;
+    update << added << removed;
+    write_header(update, header);
+
+    try {
+        if (!m_segment->to_node().write(update.data(), update.size())) {
+            LOG(ERROR) << "Failed to send topic subscription: connection "
+                          "closed";
+        }
+    } catch (std::exception &e) {
+        LOG(ERROR) << "Failed to send topic subscription " << e.what();
+    }
+}
+
+void ShmConnection::send_message(message_header_t header, bitstream &&data) {
+    auto rate = m_trace_rate.load();
+    auto count = m_num_sent.fetch_add(1);
+
+    if (rate > 0 && count % rate == 0) {
+        header.trace = message_trace_t{trace_time(), {}};
+    }
+
+    try {
+        for (auto &chunk : m_chunker.prepare(header, std::move(data))) {
+            if (!m_segment->to_node().write(chunk.data(), chunk.size())) {
+                LOG(ERROR) << "Failed to send message: connection closed";
+                return;
+            }
+        }
+    } catch (std::exception &e) {
+        LOG(ERROR) << "Failed to send message to relay network " << e.what();
+    }
+}
+
+void ShmConnection::receive_loop() {
+    auto &ring = m_segment->to_client();
+
+    while (m_okay) {
+        bitstream bs;
+
+        if (!ring.read(bs, SHM_POLL_INTERVAL)) {
+            if (ring.is_closed() || is_hung_up(m_socket)) {
+                break;
+            }
+
+            continue;
+        }
+
+        auto header = read_header(bs);
+        m_reassembler.deliver(std::move(header), std::move(bs));
+    }
+
+    if (m_okay) {
+        m_callback.on_disconnect();
+    }
+}
+
+} // namespace relay
@@ -0,0 +1,75 @@
+#pragma once
+
+#include "Chunking.h"
+#include "common/ShmRing.h"
+#include "librelay/Connection.h"
+
+#include <atomic>
+#include <memory>
+#include <optional>
+#include <set>
+#include <thread>
+
+namespace relay {
+
+/// Connection to a node on the same host through shared memory
+///
+/// Messages are exchanged through a pair of ring buffers, so local delivery
+/// only costs a copy into and out of shared memory. A unix socket is used
+/// for the handshake and to notice when the other side goes away.
+class ShmConnection : public Connection {
+  public:
+    /// @param name the shm name of the node (see --shm_name)
+    /// @param history recent messages per channel to replay on connect
+    ShmConnection(const std::string &name, Callback &callback,
+                  std::set<channel_id_t> subscriptions, uint32_t history);
+    ~ShmConnection();
+
+    void send(const std::set<channel_id_t> &channels, bitstream &&data,
+              bool blocking) override;
+
+    void send_update(const std::set<channel_id_t> &channels, uint64_t key,
+                     bitstream &&data, bool blocking) override;
+
+    void publish(const std::string &topic, bitstream &&data,
+                 bool blocking) override;
+
+    void subscribe(const std::set<std::string> &patterns) override {
+        update_topics(patterns, {});
+    }
+
+    void unsubscribe(const std::set<std::string> &patterns) override {
+        update_topics({}, patterns);
+    }
+
+    void set_trace_rate(uint32_t rate) override { m_trace_rate = rate; }
+
+    void set_chunk_size(uint32_t size) override {
+        m_chunker.set_chunk_size(size);
+    }
+
+    void close() override;
+
+  private:
+    void send_message(message_header_t header, bitstream &&data);
+
+    void update_topics(const std::set<std::string> &added,
+                       const std::set<std::string> &removed);
+
+    void receive_loop();
+
+    Callback &m_callback;
+    Chunker m_chunker;
+    Reassembler m_reassembler;
+
+    int m_socket = -1;
+    std::unique_ptr<ShmSegment> m_segment;
+
+    std::atomic<bool> m_okay = true;
+    std::thread m_receive_thread;
+
+    std::atomic<uint32_t> m_trace_rate = 0;
+    std::atomic<uint64_t> m_num_sent = 0;
+};
+
+} // namespace relay
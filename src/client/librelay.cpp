@@ -1,17 +1,48 @@
 #include "librelay/librelay.h"
 #include "ConnectionImpl.h"
+#include "ShmConnection.h"
 
+#include <glog/logging.h>
+#include <limits>
 #include <yael/EventLoop.h>
 
 namespace relay {
 
 std::shared_ptr<Connection>
 create_connection(const yael::network::Address &address, Callback &callback,
-                  std::set<channel_id_t> subscriptions) {
+                  std::set<channel_id_t> subscriptions, uint32_t history) {
     auto &el = yael::EventLoop::get_instance();
-    auto conn = el.make_event_listener<ConnectionImpl>(address, callback,
-                                                       subscriptions);
+    auto conn = el.make_event_listener<ConnectionImpl>(
+        address, callback, subscriptions, history);
     return std::dynamic_pointer_cast<Connection>(conn);
 }
 
+std::shared_ptr<Connection>
+create_connection(const std::string &address, Callback &callback,
+                  std::set<channel_id_t> subscriptions, uint32_t history) {
+    std::string prefix = SHM_ADDRESS_PREFIX;
+
+    if (address.rfind(prefix, 0) == 0) {
+        auto name = address.substr(prefix.size());
+        return std::make_shared<ShmConnection>(name, callback, subscriptions,
+                                               history);
+    }
+
+    auto found = address.find(':');
+
+    if (found == std::string::npos) {
+        LOG(FATAL) << "No port specified in address " << address;
+    }
+
+    auto host = address.substr(0, found);
+    auto port = std::atoi(address.substr(found + 1).c_str());
+
+    if (port <= 0 || port > std::numeric_limits<uint16_t>::max()) {
+        LOG(FATAL) << "Not a valid port number: " << port;
+    }
+
+    return create_connection(yael::network::resolve_URL(host, port), callback,
+                             subscriptions, history);
+}
+
 } // namespace relay
@@ -0,0 +1,257 @@
+#pragma once
+
+#include <chrono>
+#include <optional>
+#include <set>
+#include <string>
+
+#include <bitstream.h>
+#include <stdbitstream.h>
+
+#include "librelay/Connection.h"
+
+namespace relay {
+
+/// Relays add at most this many hops to a trace
+constexpr size_t MAX_TRACE_HOPS = 255;
+
+/// Identifies a message across the relay network
+/// Assigned by the first node that forwards the message
+struct message_id_t {
+    /// Random id of the assigning node
+    uint64_t origin;
+    uint64_t sequence;
+
+    bool operator==(const message_id_t &other) const = default;
+};
+
+/// Position of a chunk within a large message that was split by the sender
+struct fragment_t {
+    /// Chosen by the sender, so it is the same on every chunk
+    message_id_t message;
+
+    uint32_t index;
+    uint32_t count;
+};
+
+/// Header that is prepended to every message on the wire
+///
+/// Layout: channels | flags (2 bytes) | optional fields selected by flags
+/// (trace, then key, then id, then fragment, then topic)
+struct message_header_t {
+    enum flag_t : uint16_t {
+        HAS_TRACE = 1 << 0,
+        HAS_KEY = 1 << 1,
+        SUBSCRIPTION_UPDATE = 1 << 2,
+        HAS_ID = 1 << 3,
+        HISTORY_REQUEST = 1 << 4,
+        RESUME = 1 << 5,
+        FRAGMENT = 1 << 6,
+        COMPRESSED = 1 << 7,
+        HAS_TOPIC = 1 << 8,
+        TOPIC_SUBSCRIPTION = 1 << 9,
+    };
+
+    std::set<channel_id_t> channels;
+    std::optional<message_trace_t> trace;
+
+    /// Messages with the same key (and channels) supersede each other
+    std::optional<uint64_t> key;
+
+    /// The body is a change of subscriptions between relays, not a message
+    bool subscription_update = false;
+
+    /// The body asks a relay to replay recent messages on the channels
+    bool history_request = false;
+
+    /// Asks a relay to resend what was lost with the previous connection
+    /// The id (if any) is the last message received over that connection
+    bool resume = false;
+
+    /// The body holds one or more messages compressed by the sending relay
+    bool compressed = false;
+
+    /// The body changes the topic patterns a client subscribed to
+    bool topic_subscription = false;
+
+    /// Used to drop copies that arrive over more than one path
+    std::optional<message_id_t> id;
+
+    /// Set if the body is one chunk of a larger message
+    std::optional<fragment_t> fragment;
+
+    /// Named topic of the message (see Topics.h)
+    /// The first relay maps it to a channel
+    std::optional<std::string> topic;
+
+    uint16_t flags() const {
+        uint16_t result = 0;
+        if (trace) {
+            result |= HAS_TRACE;
+        }
+        if (key) {
+            result |= HAS_KEY;
+        }
+        if (subscription_update) {
+            result |= SUBSCRIPTION_UPDATE;
+        }
+        if (history_request) {
+            result |= HISTORY_REQUEST;
+        }
+        if (resume) {
+            result |= RESUME;
+        }
+        if (compressed) {
+            result |= COMPRESSED;
+        }
+        if (topic_subscription) {
+            result |= TOPIC_SUBSCRIPTION;
+        }
+        if (id) {
+            result |= HAS_ID;
+        }
+        if (fragment) {
+            result |= FRAGMENT;
+        }
+        if (topic) {
+            result |= HAS_TOPIC;
+        }
+        return result;
+    }
+
+    /// Size of the header on the wire in bytes
+    uint32_t size() const {
+        uint32_t result = sizeof(uint32_t) +
+                          channels.size() * sizeof(channel_id_t) +
+                          sizeof(uint16_t);
+
+        if (trace) {
+            result += sizeof(uint64_t) + sizeof(uint8_t) +
+                      trace->hops.size() * 2 * sizeof(uint64_t);
+        }
+
+        if (key) {
+            result += sizeof(uint64_t);
+        }
+
+        if (id) {
+            result += 2 * sizeof(uint64_t);
+        }
+
+        if (fragment) {
+            result += 2 * sizeof(uint64_t) + 2 * sizeof(uint32_t);
+        }
+
+        if (topic) {
+            result += sizeof(uint32_t) + topic->size();
+        }
+
+        return result;
+    }
+};
+
+/// Timestamps used for traces (microseconds since the epoch)
+inline uint64_t trace_time() {
+    using namespace std::chrono;
+
+    auto now = system_clock::now().time_since_epoch();
+    return duration_cast<microseconds>(now).count();
+}
+
+/// Prepend the header to a message
+inline void write_header(bitstream &bs, const message_header_t &header) {
+    bs.move_to(0);
+    bs.make_space(header.size());
+
+    bs << header.channels << header.flags();
+
+    if (header.trace) {
+        auto &trace = *header.trace;
+        bs << trace.origin_time << static_cast<uint8_t>(trace.hops.size());
+
+        for (auto &hop : trace.hops) {
+            bs << hop.enqueue_time << hop.dequeue_time;
+        }
+    }
+
+    if (header.key) {
+        bs << *header.key;
+    }
+
+    if (header.id) {
+        bs << header.id->origin << header.id->sequence;
+    }
+
+    if (header.fragment) {
+        auto &fragment = *header.fragment;
+        bs << fragment.message.origin << fragment.message.sequence
+           << fragment.index << fragment.count;
+    }
+
+    if (header.topic) {
+        bs << *header.topic;
+    }
+}
+
+/// Parse and remove the header at the beginning of a message
+inline message_header_t read_header(bitstream &bs) {
+    message_header_t header;
+
+    bs.move_to(0);
+
+    uint16_t flags = 0;
+    bs >> header.channels >> flags;
+
+    header.subscription_update = flags & message_header_t::SUBSCRIPTION_UPDATE;
+    header.history_request = flags & message_header_t::HISTORY_REQUEST;
+    header.resume = flags & message_header_t::RESUME;
+    header.compressed = flags & message_header_t::COMPRESSED;
+    header.topic_subscription = flags & message_header_t::TOPIC_SUBSCRIPTION;
+
+    if (flags & message_header_t::HAS_TRACE) {
+        message_trace_t trace;
+        uint8_t num_hops = 0;
+
+        bs >> trace.origin_time >> num_hops;
+
+        for (size_t i = 0; i < num_hops; ++i) {
+            hop_trace_t hop;
+            bs >> hop.enqueue_time >> hop.dequeue_time;
+            trace.hops.push_back(hop);
+        }
+
+        header.trace = std::move(trace);
+    }
+
+    if (flags & message_header_t::HAS_KEY) {
+        uint64_t key = 0;
+        bs >> key;
+        header.key = key;
+    }
+
+    if (flags & message_header_t::HAS_ID) {
+        message_id_t id = {0, 0};
+        bs >> id.origin >> id.sequence;
+        header.id = id;
+    }
+
+    if (flags & message_header_t::FRAGMENT) {
+        fragment_t fragment = {{0, 0}, 0, 0};
+        bs >> fragment.message.origin >> fragment.message.sequence >>
+            fragment.index >> fragment.count;
+        header.fragment = fragment;
+    }
+
+    if (flags & message_header_t::HAS_TOPIC) {
+        std::string topic;
+        bs >> topic;
+        header.topic = std::move(topic);
+    }
+
+    bs.move_to(0);
+    bs.remove_space(header.size());
+
+    return header;
+}
+
+} // namespace relay
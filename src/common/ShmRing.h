@@ -0,0 +1,349 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <ctime>
+#include <fcntl.h>
+#include <linux/futex.h>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <stdexcept>
+#include <string>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <bitstream.h>
+
+namespace relay {
+
+/// Prefix of addresses that select the shared-memory transport
+constexpr const char *SHM_ADDRESS_PREFIX = "shm://";
+
+/// Capacity of each direction of a shared-memory connection
+constexpr uint32_t SHM_RING_CAPACITY = 4 * 1024 * 1024;
+
+/// Where a node with the specified shm name accepts connections
+inline std::string shm_socket_path(const std::string &name) {
+    return "/tmp/librelay-" + name + ".sock";
+}
+
+inline void futex_wait(std::atomic<uint32_t> &word, uint32_t expected,
+                       std::chrono::milliseconds timeout) {
+    timespec ts;
+    ts.tv_sec = timeout.count() / 1000;
+    ts.tv_nsec = (timeout.count() % 1000) * 1000 * 1000;
+
+    // not FUTEX_PRIVATE: the word is shared between processes
+    syscall(SYS_futex, reinterpret_cast<uint32_t *>(&word), FUTEX_WAIT,
+            expected, &ts, nullptr, 0);
+}
+
+inline void futex_wake(std::atomic<uint32_t> &word) {
+    syscall(SYS_futex, reinterpret_cast<uint32_t *>(&word), FUTEX_WAKE,
+            INT32_MAX, nullptr, nullptr, 0);
+}
+
+/// Single-producer single-consumer message queue in shared memory
+///
+/// Messages are stored as a 32-bit length followed by the payload and may
+/// wrap around the end of the buffer. Sleeping readers and writers are woken
+/// up with futexes. Multiple local threads may write, as writes are
+/// serialized by a (process-local) mutex.
+class ShmRing {
+  public:
+    static_assert(std::atomic<uint32_t>::is_always_lock_free);
+    static_assert(std::atomic<uint64_t>::is_always_lock_free);
+
+    /// Bytes of shared memory needed for a ring of the specified capacity
+    static size_t required_size(uint32_t capacity) {
+        return sizeof(header_t) + capacity;
+    }
+
+    /// @param init set up a new ring (only done by the creator)
+    ShmRing(void *memory, uint32_t capacity, bool init)
+        : m_header(reinterpret_cast<header_t *>(memory)),
+          m_data(reinterpret_cast<uint8_t *>(memory) + sizeof(header_t)),
+          m_capacity(capacity) {
+        if (init) {
+            new (m_header) header_t();
+        }
+    }
+
+    /// Append a message
+    /// Blocks while the ring is full, unless it gets closed
+    ///
+    /// @return false if the ring was closed
+    bool write(const uint8_t *data, uint32_t length) {
+        uint64_t size = sizeof(length) + length;
+
+        if (size > m_capacity) {
+            throw std::runtime_error("Message too large for shared memory");
+        }
+
+        std::unique_lock lock(m_write_mutex);
+        auto head = m_header->head.load(std::memory_order_relaxed);
+
+        while (true) {
+            if (is_closed()) {
+                return false;
+            }
+
+            auto tail = m_header->tail.load(std::memory_order_acquire);
+            if (m_capacity - (head - tail) >= size) {
+                break;
+            }
+
+            m_header->writer_waiting = 1;
+            auto seq = m_header->space_seq.load();
+            tail = m_header->tail.load();
+
+            if (m_capacity - (head - tail) < size) {
+                futex_wait(m_header->space_seq, seq, WAIT_INTERVAL);
+            }
+
+            m_header->writer_waiting = 0;
+        }
+
+        append(head, data, length);
+        return true;
+    }
+
+    /// Append a message if there is room for it
+    ///
+    /// @return false if the ring is full or was closed
+    bool try_write(const uint8_t *data, uint32_t length) {
+        uint64_t size = sizeof(length) + length;
+
+        if (size > m_capacity) {
+            throw std::runtime_error("Message too large for shared memory");
+        }
+
+        std::unique_lock lock(m_write_mutex);
+
+        if (is_closed()) {
+            return false;
+        }
+
+        auto head = m_header->head.load(std::memory_order_relaxed);
+        auto tail = m_header->tail.load(std::memory_order_acquire);
+
+        if (m_capacity - (head - tail) < size) {
+            return false;
+        }
+
+        append(head, data, length);
+        return true;
+    }
+
+    /// Remove the next message
+    /// Waits up to timeout for one to arrive
+    ///
+    /// The other process can write anything to the ring, so a message that
+    /// does not fit what was written closes the ring
+    ///
+    /// @return false if there was no (valid) message
+    bool read(bitstream &out, std::chrono::milliseconds timeout) {
+        auto tail = m_header->tail.load(std::memory_order_relaxed);
+        auto head = m_header->head.load(std::memory_order_acquire);
+
+        if (head == tail) {
+            m_header->reader_waiting = 1;
+            auto seq = m_header->data_seq.load();
+            head = m_header->head.load();
+
+            if (head == tail) {
+                futex_wait(m_header->data_seq, seq, timeout);
+                head = m_header->head.load(std::memory_order_acquire);
+            }
+
+            m_header->reader_waiting = 0;
+
+            if (head == tail) {
+                return false;
+            }
+        }
+
+        uint64_t available = head - tail;
+        uint32_t length = 0;
+
+        if (available < sizeof(length) || available > m_capacity) {
+            close();
+            return false;
+        }
+
+        copy_out(tail, reinterpret_cast<uint8_t *>(&length), sizeof(length));
+
+        if (length > available - sizeof(length)) {
+            close();
+            return false;
+        }
+
+        out.resize(length);
+        copy_out(tail + sizeof(length), out.data(), length);
+        out.move_to(0);
+
+        m_header->tail.store(tail + sizeof(length) + length,
+                             std::memory_order_release);
+        m_header->space_seq.fetch_add(1);
+
+        if (m_header->writer_waiting) {
+            futex_wake(m_header->space_seq);
+        }
+
+        return true;
+    }
+
+    /// Wake up and stop both sides
+    void close() {
+        m_header->closed = 1;
+        m_header->data_seq.fetch_add(1);
+        m_header->space_seq.fetch_add(1);
+        futex_wake(m_header->data_seq);
+        futex_wake(m_header->space_seq);
+    }
+
+    bool is_closed() const { return m_header->closed != 0; }
+
+  private:
+    static constexpr auto WAIT_INTERVAL = std::chrono::milliseconds(100);
+
+    struct header_t {
+        /// Total number of bytes written and read
+        alignas(64) std::atomic<uint64_t> head = 0;
+        alignas(64) std::atomic<uint64_t> tail = 0;
+
+        /// Futex words that change whenever head (or tail) moves
+        alignas(64) std::atomic<uint32_t> data_seq = 0;
+        std::atomic<uint32_t> reader_waiting = 0;
+
+        alignas(64) std::atomic<uint32_t> space_seq = 0;
+        std::atomic<uint32_t> writer_waiting = 0;
+
+        std::atomic<uint32_t> closed = 0;
+    };
+
+    /// Write a message at head and wake up the reader
+    /// Must be called while holding the write mutex
+    void append(uint64_t head, const uint8_t *data, uint32_t length) {
+        copy_in(head, reinterpret_cast<const uint8_t *>(&length),
+                sizeof(length));
+        copy_in(head + sizeof(length), data, length);
+
+        m_header->head.store(head + sizeof(length) + length,
+                             std::memory_order_release);
+        m_header->data_seq.fetch_add(1);
+
+        if (m_header->reader_waiting) {
+            futex_wake(m_header->data_seq);
+        }
+    }
+
+    void copy_in(uint64_t pos, const uint8_t *src, uint32_t length) {
+        auto offset = pos % m_capacity;
+        auto first = std::min<uint64_t>(length, m_capacity - offset);
+
+        memcpy(m_data + offset, src, first);
+        memcpy(m_data, src + first, length - first);
+    }
+
+    void copy_out(uint64_t pos, uint8_t *dst, uint32_t length) const {
+        auto offset = pos % m_capacity;
+        auto first = std::min<uint64_t>(length, m_capacity - offset);
+
+        memcpy(dst, m_data + offset, first);
+        memcpy(dst + first, m_data, length - first);
+    }
+
+    header_t *m_header;
+    uint8_t *m_data;
+    const uint32_t m_capacity;
+
+    std::mutex m_write_mutex;
+};
+
+/// Both directions of a shared-memory connection
+///
+/// The client creates the segment and passes its name to the node over a
+/// unix socket. The segment is unlinked once the node mapped it, so it goes
+/// away with the last process using it.
+class ShmSegment {
+  public:
+    /// Create and initialize a new segment (client side)
+    static std::unique_ptr<ShmSegment> create(const std::string &name) {
+        auto fd = shm_open(name.c_str(), O_CREAT | O_EXCL | O_RDWR, 0600);
+
+        if (fd < 0) {
+            throw std::runtime_error("Failed to create shared memory " + name);
+        }
+
+        if (ftruncate(fd, 2 * ShmRing::required_size(SHM_RING_CAPACITY)) !=
+            0) {
+            ::close(fd);
+            shm_unlink(name.c_str());
+            throw std::runtime_error("Failed to resize shared memory " + name);
+        }
+
+        return std::unique_ptr<ShmSegment>(new ShmSegment(fd, true));
+    }
+
+    /// Map an existing segment (node side)
+    static std::unique_ptr<ShmSegment> open(const std::string &name) {
+        auto fd = shm_open(name.c_str(), O_RDWR, 0);
+
+        if (fd < 0) {
+            throw std::runtime_error("Failed to open shared memory " + name);
+        }
+
+        return std::unique_ptr<ShmSegment>(new ShmSegment(fd, false));
+    }
+
+    ~ShmSegment() {
+        m_to_node.reset();
+        m_to_client.reset();
+        munmap(m_memory, size());
+    }
+
+    ShmRing &to_node() { return *m_to_node; }
+    ShmRing &to_client() { return *m_to_client; }
+
+    /// Stop both directions
+    void close() {
+        m_to_node->close();
+        m_to_client->close();
+    }
+
+  private:
+    static size_t size() {
+        return 2 * ShmRing::required_size(SHM_RING_CAPACITY);
+    }
+
+    ShmSegment(int fd, bool init) {
+        m_memory =
+            mmap(nullptr, size(), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        ::close(fd);
+
+        if (m_memory == MAP_FAILED) {
+            throw std::runtime_error("Failed to map shared memory");
+        }
+
+        auto ring_size = ShmRing::required_size(SHM_RING_CAPACITY);
+        auto base = reinterpret_cast<uint8_t *>(m_memory);
+
+        m_to_node =
+            std::make_unique<ShmRing>(base, SHM_RING_CAPACITY, init);
+        m_to_client = std::make_unique<ShmRing>(base + ring_size,
+                                                SHM_RING_CAPACITY, init);
+    }
+
+    void *m_memory;
+    std::unique_ptr<ShmRing> m_to_node;
+    std::unique_ptr<ShmRing> m_to_client;
+};
+
+} // namespace relay
@@ -0,0 +1,46 @@
+#pragma once
+
+#include <cerrno>
+#include <cstddef>
+#include <cstdint>
+#include <sys/socket.h>
+
+namespace relay {
+
+/// Write (or read) exactly length bytes on a blocking socket
+inline bool send_all(int fd, const uint8_t *data, size_t length) {
+    while (length > 0) {
+        auto res = ::send(fd, data, length, MSG_NOSIGNAL);
+        if (res <= 0) {
+            return false;
+        }
+
+        data += res;
+        length -= res;
+    }
+
+    return true;
+}
+
+inline bool recv_all(int fd, uint8_t *data, size_t length) {
+    while (length > 0) {
+        auto res = ::recv(fd, data, length, 0);
+        if (res <= 0) {
+            return false;
+        }
+
+        data += res;
+        length -= res;
+    }
+
+    return true;
+}
+
+/// Is the other end of a (unix) socket gone?
+inline bool is_hung_up(int fd) {
+    uint8_t byte;
+    auto res = ::recv(fd, &byte, 1, MSG_PEEK | MSG_DONTWAIT);
+    return res == 0 || (res < 0 && errno != EAGAIN && errno != EWOULDBLOCK);
+}
+
+} // namespace relay
@@ -0,0 +1,185 @@
+#pragma once
+
+#include <cstdint>
+#include <memory>
+#include <set>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+namespace relay {
+
+/// Topics are dot-separated paths, such as "md.eu.fx"
+///
+/// In subscription patterns, a "*" segment matches exactly one segment,
+/// except at the end, where it matches one or more trailing segments.
+/// So "md.eu.*" subscribes to everything below "md.eu".
+constexpr char TOPIC_SEPARATOR = '.';
+constexpr std::string_view TOPIC_WILDCARD = "*";
+
+inline std::vector<std::string_view> split_topic(std::string_view topic) {
+    std::vector<std::string_view> segments;
+
+    while (true) {
+        auto pos = topic.find(TOPIC_SEPARATOR);
+        segments.push_back(topic.substr(0, pos));
+
+        if (pos == std::string_view::npos) {
+            return segments;
+        }
+
+        topic.remove_prefix(pos + 1);
+    }
+}
+
+/// Patterns may contain wildcards, topic names may not
+inline bool is_valid_pattern(std::string_view pattern) {
+    if (pattern.empty()) {
+        return false;
+    }
+
+    for (auto segment : split_topic(pattern)) {
+        if (segment.empty()) {
+            return false;
+        }
+
+        if (segment != TOPIC_WILDCARD &&
+            segment.find(TOPIC_WILDCARD) != std::string_view::npos) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+inline bool is_valid_topic(std::string_view topic) {
+    return is_valid_pattern(topic) &&
+           topic.find(TOPIC_WILDCARD) == std::string_view::npos;
+}
+
+/// FNV-1a, so that all nodes map topics to the same channels
+inline uint64_t topic_hash(std::string_view str) {
+    uint64_t hash = 14695981039346656037ULL;
+
+    for (auto c : str) {
+        hash ^= static_cast<uint8_t>(c);
+        hash *= 1099511628211ULL;
+    }
+
+    return hash;
+}
+
+/// Index of subscription patterns by their segments
+///
+/// Matching a topic visits one node per segment (plus the wildcard
+/// branches), independent of the number of patterns. Not thread-safe.
+template <typename Value> class TopicTrie {
+  public:
+    void insert(std::string_view pattern, const Value &value) {
+        auto segments = split_topic(pattern);
+        auto node = &m_root;
+
+        for (size_t i = 0; i < segments.size(); ++i) {
+            if (i + 1 == segments.size() && segments[i] == TOPIC_WILDCARD) {
+                node->below.insert(value);
+                return;
+            }
+
+            auto &child = node->children[std::string(segments[i])];
+
+            if (!child) {
+                child = std::make_unique<node_t>();
+            }
+
+            node = child.get();
+        }
+
+        node->exact.insert(value);
+    }
+
+    void erase(std::string_view pattern, const Value &value) {
+        auto segments = split_topic(pattern);
+        erase(m_root, segments, 0, value);
+    }
+
+    /// Call fn with the value of every pattern that matches the topic
+    /// Values of several matching patterns are reported more than once
+    template <typename Fn> void match(std::string_view topic, Fn &&fn) const {
+        auto segments = split_topic(topic);
+        match(m_root, segments, 0, fn);
+    }
+
+    bool matches(std::string_view topic) const {
+        bool found = false;
+        match(topic, [&](const Value &) { found = true; });
+        return found;
+    }
+
+  private:
+    struct node_t {
+        std::unordered_map<std::string, std::unique_ptr<node_t>> children;
+
+        /// Values of patterns that end at this node
+        std::set<Value> exact;
+
+        /// Values of patterns that end in a wildcard after this node
+        std::set<Value> below;
+
+        bool empty() const {
+            return children.empty() && exact.empty() && below.empty();
+        }
+    };
+
+    /// @return true if the node can be removed
+    bool erase(node_t &node, const std::vector<std::string_view> &segments,
+               size_t index, const Value &value) {
+        if (index == segments.size()) {
+            node.exact.erase(value);
+        } else if (index + 1 == segments.size() &&
+                   segments[index] == TOPIC_WILDCARD) {
+            node.below.erase(value);
+        } else {
+            auto it = node.children.find(std::string(segments[index]));
+
+            if (it != node.children.end() &&
+                erase(*it->second, segments, index + 1, value)) {
+                node.children.erase(it);
+            }
+        }
+
+        return node.empty();
+    }
+
+    template <typename Fn>
+    void match(const node_t &node,
+               const std::vector<std::string_view> &segments, size_t index,
+               Fn &fn) const {
+        if (index == segments.size()) {
+            for (auto &value : node.exact) {
+                fn(value);
+            }
+            return;
+        }
+
+        for (auto &value : node.below) {
+            fn(value);
+        }
+
+        auto it = node.children.find(std::string(segments[index]));
+
+        if (it != node.children.end()) {
+            match(*it->second, segments, index + 1, fn);
+        }
+
+        auto wildcard = node.children.find(std::string(TOPIC_WILDCARD));
+
+        if (wildcard != node.children.end()) {
+            match(*wildcard->second, segments, index + 1, fn);
+        }
+    }
+
+    node_t m_root;
+};
+
+} // namespace relay
@@ -4,3 +4,25 @@
 
 // TODO differentiate between other relay nodes and clients
 constexpr size_t MAX_SEND_QUEUE = 1024 * 1024 * 1024;
+
+// Peers queue messages by priority once this many bytes wait in the socket
+constexpr size_t SEND_WATERMARK = 256 * 1024;
+
+// Peers that have this many bytes queued are served from storage instead
+constexpr size_t PULL_THRESHOLD = 16 * 1024 * 1024;
+
+// Name clients use in their hello message
+constexpr const char *CLIENT_NAME = "client";
+
+// Edge nodes resend this many recent messages when an upstream relay fails
+constexpr size_t RESEND_WINDOW = 64 * 1024;
+
+// Number of message ids a node remembers to drop duplicates
+constexpr size_t DEDUP_WINDOW = 1024 * 1024;
+
+// A re-established link resumes this many storage entries before the last
+// message the peer received, as messages can be sent out of order
+constexpr size_t RESUME_MARGIN = 1024;
+
+// Clients split messages larger than this into chunks by default
+constexpr uint32_t DEFAULT_CHUNK_SIZE = 64 * 1024;
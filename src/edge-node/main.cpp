@@ -1,6 +1,8 @@
 #include <iostream>
+#include <sstream>
 
 #include "node/Node.h"
+#include "node/affinity.h"
 #include "node/sighandler.h"
 
 #include <boost/program_options.hpp>
@@ -30,11 +32,27 @@ int main(int ac, char *av[]) {
     desc.add_options()("addr", po::value<std::string>()->required(),
                        "address of this edge node to connect to")(
         "peer_addr", po::value<std::string>()->required(),
-        "address of the peer to connect to")(
+        "comma-separated addresses of the upstream relays to connect to")(
         "config", po::value<std::string>()->required(),
         "the string of all peers to connect to")(
-        "wait", po::value<uint32_t>()->default_value(1),
-        "how long to wait before connecting to other peers");
+        "ready_file", po::value<std::string>()->default_value(""),
+        "create this file once all links to other relays are up")(
+        "metrics_file", po::value<std::string>()->default_value(""),
+        "periodically write metrics to this file (disabled if empty)")(
+        "metrics_interval", po::value<uint32_t>()->default_value(10),
+        "seconds between two metric dumps")(
+        "num_workers", po::value<uint32_t>()->default_value(0),
+        "number of broadcast workers (0 picks a default)")(
+        "shard_peers", po::bool_switch()->default_value(false),
+        "give each worker its own queue and assign every peer to one worker")(
+        "pin_cpus", po::value<std::string>()->default_value(""),
+        "pin workers to these CPUs, e.g. \"0-3,8\" (disabled if empty)")(
+        "event_loop_threads", po::value<int32_t>()->default_value(-1),
+        "number of event loop threads (-1 picks a default)")(
+        "shm_name", po::value<std::string>()->default_value(""),
+        "accept local clients at shm://<name> (disabled if empty)")(
+        "history_size", po::value<uint32_t>()->default_value(1000),
+        "recent messages per channel kept for client catch-up");
 
     po::variables_map vm;
     try {
@@ -52,12 +70,41 @@ int main(int ac, char *av[]) {
         return 1;
     }
 
-    yael::EventLoop::initialize();
+    node_options_t options;
+    options.ready_file = vm["ready_file"].as<std::string>();
+    options.num_workers = vm["num_workers"].as<uint32_t>();
+    options.shard_peers = vm["shard_peers"].as<bool>();
+    options.cpus = parse_cpu_list(vm["pin_cpus"].as<std::string>());
+    options.history_size = vm["history_size"].as<uint32_t>();
+
+    yael::EventLoop::initialize(vm["event_loop_threads"].as<int32_t>());
     auto &el = yael::EventLoop::get_instance();
 
-    auto node = el.make_event_listener<Node>(
-        vm["addr"].as<std::string>(), vm["peer_addr"].as<std::string>(),
-        vm["config"].as<std::string>(), vm["wait"].as<uint32_t>());
+    std::vector<std::string> upstreams;
+    std::stringstream peer_addrs(vm["peer_addr"].as<std::string>());
+    std::string peer_addr;
+
+    while (std::getline(peer_addrs, peer_addr, ',')) {
+        if (!peer_addr.empty()) {
+            upstreams.push_back(peer_addr);
+        }
+    }
+
+    auto node = el.make_event_listener<Node>(vm["addr"].as<std::string>(),
+                                             upstreams,
+                                             vm["config"].as<std::string>(),
+                                             options);
+
+    auto metrics_file = vm["metrics_file"].as<std::string>();
+    if (!metrics_file.empty()) {
+        auto interval = vm["metrics_interval"].as<uint32_t>();
+        node->start_metrics(metrics_file, interval);
+    }
+
+    auto shm_name = vm["shm_name"].as<std::string>();
+    if (!shm_name.empty()) {
+        node->start_shm(shm_name);
+    }
 
     el.wait();
 
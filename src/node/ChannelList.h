@@ -0,0 +1,62 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <memory>
+#include <set>
+
+#include "librelay/Connection.h"
+
+namespace relay {
+
+/// Sorted list of channel ids that is stored inline for the common case of
+/// a message being sent on a handful of channels
+///
+/// Unlike std::set, this needs no allocation per channel and the ids are
+/// contiguous in memory.
+class channel_list_t {
+  public:
+    static constexpr size_t INLINE_CAPACITY = 6;
+
+    /// Empty list of the given size; fill in sorted order through data()
+    explicit channel_list_t(size_t size) : m_size(size) {
+        if (size > INLINE_CAPACITY) {
+            m_heap = std::make_unique<channel_id_t[]>(size);
+        }
+    }
+
+    channel_list_t(const std::set<channel_id_t> &channels)
+        : channel_list_t(channels.size()) {
+        std::copy(channels.begin(), channels.end(), data());
+    }
+
+    channel_list_t(channel_list_t &&other) = default;
+    channel_list_t(const channel_list_t &other) = delete;
+
+    channel_id_t *data() {
+        return m_heap ? m_heap.get() : m_inline.data();
+    }
+
+    const channel_id_t *begin() const {
+        return m_heap ? m_heap.get() : m_inline.data();
+    }
+
+    const channel_id_t *end() const { return begin() + m_size; }
+
+    size_t size() const { return m_size; }
+
+    bool empty() const { return m_size == 0; }
+
+    bool contains(channel_id_t cid) const {
+        return std::binary_search(begin(), end(), cid);
+    }
+
+    std::set<channel_id_t> to_set() const { return {begin(), end()}; }
+
+  private:
+    uint16_t m_size;
+    std::array<channel_id_t, INLINE_CAPACITY> m_inline;
+    std::unique_ptr<channel_id_t[]> m_heap;
+};
+
+} // namespace relay
@@ -0,0 +1,97 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <optional>
+#include <unordered_map>
+
+#include "common/MessageHeader.h"
+
+namespace relay {
+
+/// Remembers the ids of the most recent messages
+///
+/// Copies of a message that arrive over another path (or are resent after a
+/// failover) are expected shortly after the original, so a bounded window
+/// is enough.
+///
+/// Every broadcast worker checks every message, so ids are striped by hash
+/// and each stripe has its own lock and a window of capacity / NUM_STRIPES.
+class DedupFilter {
+  public:
+    static constexpr size_t NUM_STRIPES = 64;
+
+    explicit DedupFilter(size_t capacity)
+        : m_stripe_capacity(std::max<size_t>(capacity / NUM_STRIPES, 1)) {}
+
+    /// @return false if the id is already known
+    bool insert(const message_id_t &id) {
+        auto &stripe = get_stripe(id);
+        std::unique_lock lock(stripe.mutex);
+
+        if (!stripe.ids.emplace(id, std::nullopt).second) {
+            return false;
+        }
+
+        stripe.order.push_back(id);
+
+        if (stripe.order.size() > m_stripe_capacity) {
+            stripe.ids.erase(stripe.order.front());
+            stripe.order.pop_front();
+        }
+
+        return true;
+    }
+
+    /// Remember where a message was stored
+    void set_position(const message_id_t &id, size_t position) {
+        auto &stripe = get_stripe(id);
+        std::unique_lock lock(stripe.mutex);
+        auto it = stripe.ids.find(id);
+
+        if (it != stripe.ids.end()) {
+            it->second = position;
+        }
+    }
+
+    /// The storage position of a recent message (if still known)
+    std::optional<size_t> position(const message_id_t &id) {
+        auto &stripe = get_stripe(id);
+        std::unique_lock lock(stripe.mutex);
+        auto it = stripe.ids.find(id);
+
+        if (it == stripe.ids.end()) {
+            return std::nullopt;
+        }
+
+        return it->second;
+    }
+
+  private:
+    struct hash_t {
+        size_t operator()(const message_id_t &id) const {
+            return std::hash<uint64_t>()(id.origin) ^
+                   (std::hash<uint64_t>()(id.sequence) << 1);
+        }
+    };
+
+    struct stripe_t {
+        std::mutex mutex;
+        std::unordered_map<message_id_t, std::optional<size_t>, hash_t> ids;
+        std::deque<message_id_t> order;
+    };
+
+    stripe_t &get_stripe(const message_id_t &id) {
+        // sequence numbers only differ in the low bits, so mix them up
+        uint64_t hash = hash_t()(id) * 0x9E3779B97F4A7C15ULL;
+        return m_stripes[(hash >> 32) % NUM_STRIPES];
+    }
+
+    const size_t m_stripe_capacity;
+    std::array<stripe_t, NUM_STRIPES> m_stripes;
+};
+
+} // namespace relay
@@ -0,0 +1,90 @@
+#pragma once
+
+#include <algorithm>
+#include <deque>
+#include <mutex>
+#include <set>
+#include <vector>
+
+#include "librelay/Connection.h"
+
+namespace relay {
+
+/// Storage positions of the most recent messages of every channel
+///
+/// Lets a node replay the tail of a channel to a new client without
+/// scanning storage. The tail is recent, so it is usually still in memory.
+///
+/// Every broadcast worker adds to the cache, so each channel has its own
+/// lock and only the channels of a message are locked.
+class HistoryCache {
+  public:
+    /// @param capacity messages kept per channel (0 disables the cache)
+    HistoryCache(size_t num_channels, size_t capacity)
+        : m_capacity(capacity), m_channels(num_channels) {}
+
+    template <typename Channels>
+    void add(const Channels &channels, size_t position) {
+        if (m_capacity == 0) {
+            return;
+        }
+
+        // messages without channels go to everybody
+        if (channels.empty()) {
+            push(m_broadcasts, position);
+            return;
+        }
+
+        for (auto cid : channels) {
+            if (cid < m_channels.size()) {
+                push(m_channels[cid], position);
+            }
+        }
+    }
+
+    /// The last count messages of each of the channels
+    /// @return positions in storage order, without duplicates
+    std::vector<size_t> recent(const std::set<channel_id_t> &channels,
+                               size_t count) {
+        std::set<size_t> result;
+
+        auto take = [&](channel_t &channel) {
+            std::unique_lock lock(channel.mutex);
+            auto &positions = channel.positions;
+            auto n = std::min(count, positions.size());
+            result.insert(positions.end() - n, positions.end());
+        };
+
+        take(m_broadcasts);
+
+        for (auto cid : channels) {
+            if (cid < m_channels.size()) {
+                take(m_channels[cid]);
+            }
+        }
+
+        return {result.begin(), result.end()};
+    }
+
+  private:
+    struct channel_t {
+        std::mutex mutex;
+        std::deque<size_t> positions;
+    };
+
+    void push(channel_t &channel, size_t position) {
+        std::unique_lock lock(channel.mutex);
+        channel.positions.push_back(position);
+
+        if (channel.positions.size() > m_capacity) {
+            channel.positions.pop_front();
+        }
+    }
+
+    const size_t m_capacity;
+
+    std::vector<channel_t> m_channels;
+    channel_t m_broadcasts;
+};
+
+} // namespace relay
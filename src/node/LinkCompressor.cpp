@@ -0,0 +1,127 @@
+#include "LinkCompressor.h"
+#include "common/MessageHeader.h"
+#include "common/defines.h"
+
+#include <algorithm>
+#include <cstring>
+#include <glog/logging.h>
+#include <stdexcept>
+#include <zlib.h>
+
+namespace relay {
+
+// Frames have to be this much smaller than their contents to be worth it
+constexpr double MIN_SAVINGS = 0.1;
+
+// Most messages skipped after failing to compress
+constexpr uint32_t MAX_BACKOFF = 1024;
+
+std::optional<bitstream>
+LinkCompressor::compress(const std::vector<payload_t> &messages) {
+    uint64_t raw_size = 0;
+    for (auto &msg : messages) {
+        raw_size += sizeof(uint32_t) + msg.length;
+    }
+
+    if (raw_size < m_config.min_size || raw_size > MAX_SEND_QUEUE) {
+        return std::nullopt;
+    }
+
+    if (m_skip > 0) {
+        m_skip--;
+        return std::nullopt;
+    }
+
+    // Layout: #messages | raw size | deflated (length | message)*
+    std::vector<uint8_t> raw(raw_size);
+    size_t offset = 0;
+
+    for (auto &msg : messages) {
+        memcpy(raw.data() + offset, &msg.length, sizeof(msg.length));
+        offset += sizeof(msg.length);
+
+        memcpy(raw.data() + offset, msg.data, msg.length);
+        offset += msg.length;
+    }
+
+    uLongf length = compressBound(raw.size());
+    std::vector<uint8_t> deflated(length);
+
+    auto res = compress2(deflated.data(), &length, raw.data(), raw.size(),
+                         m_config.level);
+
+    if (res != Z_OK) {
+        LOG(ERROR) << "Failed to compress messages: " << res;
+        return std::nullopt;
+    }
+
+    if (length > raw.size() * (1.0 - MIN_SAVINGS)) {
+        m_backoff = std::clamp<uint32_t>(m_backoff * 2, 1, MAX_BACKOFF);
+        m_skip = m_backoff;
+        return std::nullopt;
+    }
+
+    m_backoff = 0;
+
+    bitstream frame;
+    frame << static_cast<uint32_t>(messages.size())
+          << static_cast<uint32_t>(raw.size());
+    frame.write_raw_data(deflated.data(), length);
+
+    message_header_t header;
+    header.compressed = true;
+    write_header(frame, header);
+
+    return frame;
+}
+
+std::vector<bitstream> decompress_frame(bitstream &input) {
+    uint32_t num_messages = 0;
+    uint32_t raw_size = 0;
+    input >> num_messages >> raw_size;
+
+    if (raw_size > MAX_SEND_QUEUE) {
+        throw std::runtime_error("Compressed frame is too large");
+    }
+
+    std::vector<uint8_t> raw(raw_size);
+    uLongf length = raw_size;
+
+    auto res = uncompress(raw.data(), &length, input.current(),
+                          input.remaining_size());
+
+    if (res != Z_OK || length != raw_size) {
+        throw std::runtime_error("Corrupted compressed frame");
+    }
+
+    std::vector<bitstream> messages;
+    messages.reserve(num_messages);
+
+    size_t offset = 0;
+
+    for (uint32_t i = 0; i < num_messages; ++i) {
+        uint32_t msg_length = 0;
+
+        if (offset + sizeof(msg_length) > raw.size()) {
+            throw std::runtime_error("Truncated compressed frame");
+        }
+
+        memcpy(&msg_length, raw.data() + offset, sizeof(msg_length));
+        offset += sizeof(msg_length);
+
+        if (offset + msg_length > raw.size()) {
+            throw std::runtime_error("Truncated compressed frame");
+        }
+
+        bitstream msg;
+        msg.write_raw_data(raw.data() + offset, msg_length);
+        msg.move_to(0);
+        offset += msg_length;
+
+        messages.push_back(std::move(msg));
+    }
+
+    return messages;
+}
+
+} // namespace relay
@@ -0,0 +1,49 @@
+#pragma once
+
+#include <bitstream.h>
+#include <cstdint>
+#include <optional>
+#include <vector>
+
+#include "NetworkConfig.h"
+
+namespace relay {
+
+/// Compresses the messages sent over one link
+///
+/// Data that does not shrink is sent as is. After a failed attempt, the
+/// compressor skips a growing number of messages before it tries again, so
+/// links that carry incompressible (e.g., encrypted) payloads spend little
+/// time on them. Not thread-safe.
+class LinkCompressor {
+  public:
+    /// A message without the framing of the socket
+    struct payload_t {
+        const uint8_t *data;
+        uint32_t length;
+    };
+
+    explicit LinkCompressor(const NetworkConfig::compression_t &config)
+        : m_config(config) {}
+
+    uint32_t batch_size() const { return m_config.batch_size; }
+
+    /// Compress the messages into a single frame (with header)
+    /// @return nullopt if the messages should be sent as they are
+    std::optional<bitstream> compress(const std::vector<payload_t> &messages);
+
+  private:
+    const NetworkConfig::compression_t m_config;
+
+    /// Messages to send uncompressed before trying again
+    uint32_t m_skip = 0;
+    uint32_t m_backoff = 0;
+};
+
+/// Unpack a frame created by LinkCompressor::compress
+/// Throws std::runtime_error if the frame is corrupted
+///
+/// @param input the frame with its header already removed
+std::vector<bitstream> decompress_frame(bitstream &input);
+
+} // namespace relay
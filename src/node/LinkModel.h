@@ -0,0 +1,154 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstdint>
+#include <mutex>
+#include <optional>
+#include <random>
+
+#include "NetworkConfig.h"
+#include "TokenBucket.h"
+
+namespace relay {
+
+/// Emulates one direction of a wide-area link
+///
+/// Messages first have to pass through the token bucket (serialization and
+/// queueing delay) and then travel for the propagation delay, which is drawn
+/// from the configured distribution.
+///
+/// Jitter alone does not reorder messages, as the link behaves like a FIFO.
+/// Only messages that are explicitly picked for reordering skip the
+/// propagation delay and overtake everything that is in flight.
+class LinkModel {
+  public:
+    LinkModel() : m_bucket(0, 0) {}
+
+    LinkModel(const LinkModel &other) = delete;
+
+    /// Set the link parameters from the network config
+    /// The trace (if any) is replayed starting at time now
+    void configure(const NetworkConfig::link_t &link, uint64_t seed,
+                   uint64_t now) {
+        std::unique_lock lock(m_mutex);
+
+        m_link = link;
+        m_trace_start = now;
+        m_last_release = 0;
+
+        // bandwidth is given in kbit/s
+        auto rate = static_cast<uint64_t>(link.bandwidth) * 1000 / 8;
+        m_bucket = TokenBucket(rate, link.burst);
+
+        if (seed == 0) {
+            seed = std::random_device()();
+        }
+        m_random.seed(seed);
+
+        m_emulated = link.delay > 0 || link.jitter > 0 || link.loss > 0.0 ||
+                     link.reorder > 0.0 || m_bucket.is_limited() ||
+                     link.trace != nullptr;
+    }
+
+    /// Does this link affect messages at all?
+    bool is_emulated() const { return m_emulated; }
+
+    /// Compute when a message of the given size (in bytes) that is sent at
+    /// time now arrives at the other end of the link (both in microseconds)
+    ///
+    /// @return the release time or nullopt if the message was lost
+    std::optional<uint64_t> release_time(uint64_t size, uint64_t now) {
+        std::unique_lock lock(m_mutex);
+
+        auto delay = m_link.delay;
+        auto loss = m_link.loss;
+
+        if (m_link.trace) {
+            auto &sample = m_link.trace->at(now - m_trace_start);
+
+            delay = sample.delay;
+            loss = sample.loss;
+
+            auto rate = static_cast<uint64_t>(sample.bandwidth) * 1000 / 8;
+            m_bucket.set_rate(rate, now);
+        }
+
+        auto departure = m_bucket.reserve(size, now);
+
+        if (loss > 0.0 && m_uniform(m_random) < loss) {
+            return std::nullopt;
+        }
+
+        if (m_link.reorder > 0.0 && m_uniform(m_random) < m_link.reorder) {
+            return departure;
+        }
+
+        auto release = departure + sample_delay(delay);
+
+        // preserve FIFO order
+        release = std::max(release, m_last_release);
+        m_last_release = release;
+
+        return release;
+    }
+
+    uint64_t backlog(uint64_t now) {
+        std::unique_lock lock(m_mutex);
+        return m_bucket.backlog(now);
+    }
+
+  private:
+    /// Shape parameter of the pareto distribution
+    static constexpr double PARETO_SHAPE = 1.5;
+
+    /// Draw a propagation delay (in microseconds)
+    /// @param base_delay the delay without jitter in milliseconds
+    uint64_t sample_delay(uint32_t base_delay) {
+        using DelayDistribution = NetworkConfig::DelayDistribution;
+
+        auto delay = static_cast<double>(base_delay) * 1000.0;
+        auto jitter = static_cast<double>(m_link.jitter) * 1000.0;
+
+        if (jitter <= 0.0) {
+            return static_cast<uint64_t>(delay);
+        }
+
+        switch (m_link.distribution) {
+        case DelayDistribution::Constant:
+            break;
+        case DelayDistribution::Uniform:
+            delay += (2.0 * m_uniform(m_random) - 1.0) * jitter;
+            break;
+        case DelayDistribution::Normal:
+            delay += m_normal(m_random) * jitter;
+            break;
+        case DelayDistribution::Pareto: {
+            // heavy tail on top of the base delay; jitter is the mean
+            auto scale = jitter * (PARETO_SHAPE - 1.0) / PARETO_SHAPE;
+            auto u = 1.0 - m_uniform(m_random);
+            delay += scale / std::pow(u, 1.0 / PARETO_SHAPE);
+            break;
+        }
+        }
+
+        return static_cast<uint64_t>(std::max(delay, 0.0));
+    }
+
+    std::mutex m_mutex;
+
+    std::atomic<bool> m_emulated = false;
+
+    NetworkConfig::link_t m_link;
+    TokenBucket m_bucket;
+
+    uint64_t m_last_release = 0;
+    uint64_t m_trace_start = 0;
+
+    std::mt19937_64 m_random;
+    std::uniform_real_distribution<double> m_uniform{0.0, 1.0};
+    std::normal_distribution<double> m_normal{0.0, 1.0};
+};
+
+} // namespace relay
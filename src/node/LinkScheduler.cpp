@@ -0,0 +1,83 @@
+#include "LinkScheduler.h"
+#include "Peer.h"
+
+#include <chrono>
+
+namespace relay {
+
+LinkScheduler::LinkScheduler()
+    : m_pending(current_time() / 1000),
+      m_thread(std::thread(&LinkScheduler::work, this)) {}
+
+LinkScheduler::~LinkScheduler() {
+    {
+        std::unique_lock lock(m_mutex);
+        m_okay = false;
+        m_cond.notify_all();
+    }
+
+    m_thread.join();
+}
+
+uint64_t LinkScheduler::current_time() {
+    using namespace std::chrono;
+
+    auto now = steady_clock::now().time_since_epoch();
+    return duration_cast<microseconds>(now).count();
+}
+
+void LinkScheduler::schedule(uint64_t release_time,
+                             const std::shared_ptr<Peer> &peer,
+                             std::shared_ptr<uint8_t[]> &&data,
+                             uint32_t length) {
+    std::unique_lock lock(m_mutex);
+
+    bool was_empty = m_pending.empty();
+    m_pending.insert(to_tick(release_time),
+                     pending_send_t{peer, std::move(data), length});
+
+    // the worker only sleeps indefinitely if there is nothing to do
+    if (was_empty) {
+        m_cond.notify_one();
+    }
+}
+
+size_t LinkScheduler::num_pending() const {
+    std::unique_lock lock(m_mutex);
+    return m_pending.size();
+}
+
+void LinkScheduler::work() {
+    std::vector<pending_send_t> batch;
+    std::unique_lock lock(m_mutex);
+
+    while (m_okay) {
+        if (m_pending.empty()) {
+            m_cond.wait(lock);
+            continue;
+        }
+
+        auto now = current_time();
+        auto tick = now / 1000;
+
+        if (tick <= m_pending.current_tick()) {
+            // sleep until the next tick starts
+            m_cond.wait_for(lock, std::chrono::microseconds(1000 - now % 1000));
+            continue;
+        }
+
+        m_pending.advance(tick, batch);
+        lock.unlock();
+
+        for (auto &msg : batch) {
+            if (auto peer = msg.peer.lock()) {
+                peer->transmit(std::move(msg.data), msg.length);
+            }
+        }
+
+        batch.clear();
+        lock.lock();
+    }
+}
+
+} // namespace relay
@@ -0,0 +1,58 @@
+#pragma once
+
+#include <condition_variable>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "TimingWheel.h"
+
+namespace relay {
+
+class Peer;
+
+/// Releases messages on emulated links once they reach the end of the link
+///
+/// There is one scheduler per relay that is shared by all peers. Messages
+/// are bucketed into millisecond ticks using a timing wheel, so scheduling
+/// is O(1) and all messages of a tick are released in one batch.
+class LinkScheduler {
+  public:
+    LinkScheduler();
+    ~LinkScheduler();
+
+    /// The current time in microseconds
+    static uint64_t current_time();
+
+    /// Send (prepared) data to the peer at the specified time
+    /// The release time is rounded up to the next millisecond
+    void schedule(uint64_t release_time, const std::shared_ptr<Peer> &peer,
+                  std::shared_ptr<uint8_t[]> &&data, uint32_t length);
+
+    /// Number of messages that are currently in flight
+    size_t num_pending() const;
+
+  private:
+    struct pending_send_t {
+        std::weak_ptr<Peer> peer;
+        std::shared_ptr<uint8_t[]> data;
+        uint32_t length;
+    };
+
+    static uint64_t to_tick(uint64_t time) { return (time + 999) / 1000; }
+
+    void work();
+
+    bool m_okay = true;
+
+    mutable std::mutex m_mutex;
+    std::condition_variable m_cond;
+
+    TimingWheel<pending_send_t> m_pending;
+
+    std::thread m_thread;
+};
+
+} // namespace relay
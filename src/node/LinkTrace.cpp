@@ -0,0 +1,82 @@
+#include "LinkTrace.h"
+
+#include <algorithm>
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+
+namespace relay {
+
+LinkTrace::LinkTrace(const std::string &filename, bool loop) : m_loop(loop) {
+    std::ifstream file(filename);
+
+    if (!file.is_open()) {
+        throw std::runtime_error("Failed to open link trace " + filename);
+    }
+
+    std::string line;
+    size_t line_no = 0;
+
+    while (std::getline(file, line)) {
+        line_no++;
+
+        std::replace(line.begin(), line.end(), ',', ' ');
+        std::istringstream stream(line);
+
+        std::string first;
+        if (!(stream >> first) || first[0] == '#') {
+            // empty line or comment
+            continue;
+        }
+
+        double time = 0.0, delay = 0.0, bandwidth = 0.0, loss = 0.0;
+        std::istringstream(first) >> time;
+
+        if (!(stream >> delay >> bandwidth)) {
+            throw std::runtime_error("Invalid link trace entry in line " +
+                                     std::to_string(line_no));
+        }
+
+        // loss is optional
+        stream >> loss;
+
+        if (time < 0.0 || delay < 0.0 || bandwidth < 0.0 || loss < 0.0 ||
+            loss > 1.0) {
+            throw std::runtime_error("Invalid link trace entry in line " +
+                                     std::to_string(line_no));
+        }
+
+        sample_t sample = {static_cast<uint64_t>(time * 1000.0),
+                           static_cast<uint32_t>(delay),
+                           static_cast<uint32_t>(bandwidth), loss};
+
+        if (!m_samples.empty() && m_samples.back().time >= sample.time) {
+            throw std::runtime_error("Link trace is not sorted by time");
+        }
+
+        m_samples.push_back(sample);
+    }
+
+    if (m_samples.empty()) {
+        throw std::runtime_error("Link trace " + filename + " is empty");
+    }
+}
+
+const LinkTrace::sample_t &LinkTrace::at(uint64_t elapsed) const {
+    if (m_loop && duration() > 0) {
+        elapsed %= duration();
+    }
+
+    // find the last sample that started before elapsed
+    auto it = std::upper_bound(
+        m_samples.begin(), m_samples.end(), elapsed,
+        [](uint64_t time, const sample_t &s) { return time < s.time; });
+
+    if (it == m_samples.begin()) {
+        return *it;
+    }
+
+    return *(--it);
+}
+
+} // namespace relay
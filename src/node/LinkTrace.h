@@ -0,0 +1,48 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace relay {
+
+/// A recorded time series of link conditions that is replayed during a run
+///
+/// Traces are text files with one sample per line:
+///     <time in ms> <delay in ms> <bandwidth in kbit/s> [loss rate]
+/// Values can be separated by whitespace or commas and lines starting with
+/// '#' are ignored. A sample is in effect until the next one starts.
+/// When looping, the last sample only marks the end of the trace.
+class LinkTrace {
+  public:
+    struct sample_t {
+        /// Offset from the start of the trace in microseconds
+        uint64_t time;
+
+        /// Propagation delay in milliseconds
+        uint32_t delay;
+
+        /// Bandwidth in kbit/s (0 = unlimited)
+        uint32_t bandwidth;
+
+        double loss;
+    };
+
+    /// Load a trace from disk
+    /// @param loop restart from the beginning once the trace ended
+    LinkTrace(const std::string &filename, bool loop);
+
+    /// Get the sample in effect the specified time after the trace started
+    const sample_t &at(uint64_t elapsed) const;
+
+    /// The length of the trace in microseconds
+    uint64_t duration() const { return m_samples.back().time; }
+
+    bool loops() const { return m_loop; }
+
+  private:
+    const bool m_loop;
+    std::vector<sample_t> m_samples;
+};
+
+} // namespace relay
@@ -0,0 +1,186 @@
+#include "Metrics.h"
+
+#include <chrono>
+#include <cstdio>
+#include <fstream>
+
+#include <glog/logging.h>
+
+namespace relay {
+
+Histogram::snapshot_t Histogram::snapshot() const {
+    snapshot_t result;
+    result.buckets.resize(NUM_BUCKETS, 0);
+
+    for (auto &shard : m_shards) {
+        result.count += shard.count.load(std::memory_order_relaxed);
+        result.sum += shard.sum.load(std::memory_order_relaxed);
+
+        for (size_t i = 0; i < NUM_BUCKETS; ++i) {
+            result.buckets[i] +=
+                shard.buckets[i].load(std::memory_order_relaxed);
+        }
+    }
+
+    return result;
+}
+
+uint64_t Histogram::snapshot_t::quantile(double q) const {
+    uint64_t total = 0;
+    for (auto c : buckets) {
+        total += c;
+    }
+
+    if (total == 0) {
+        return 0;
+    }
+
+    auto target = static_cast<uint64_t>(q * static_cast<double>(total - 1));
+    uint64_t seen = 0;
+
+    for (size_t i = 0; i < buckets.size(); ++i) {
+        seen += buckets[i];
+
+        if (seen > target) {
+            return upper_bound(i);
+        }
+    }
+
+    return upper_bound(buckets.size() - 1);
+}
+
+inline std::string format_labels(const MetricsWriter::labels_t &labels) {
+    if (labels.empty()) {
+        return "";
+    }
+
+    std::string result = "{";
+
+    for (size_t i = 0; i < labels.size(); ++i) {
+        if (i > 0) {
+            result += ",";
+        }
+
+        result += labels[i].first + "=\"";
+
+        for (auto c : labels[i].second) {
+            if (c == '"' || c == '\\') {
+                result += '\\';
+            } else if (c == '\n') {
+                result += "\\n";
+                continue;
+            }
+            result += c;
+        }
+
+        result += "\"";
+    }
+
+    return result + "}";
+}
+
+void MetricsWriter::header(const std::string &name, const std::string &help,
+                           const std::string &type) {
+    if (name == m_last_name) {
+        return;
+    }
+
+    m_stream << "# HELP " << name << " " << help << "\n"
+             << "# TYPE " << name << " " << type << "\n";
+    m_last_name = name;
+}
+
+void MetricsWriter::counter(const std::string &name, const std::string &help,
+                            uint64_t value, const labels_t &labels) {
+    header(name, help, "counter");
+    m_stream << name << format_labels(labels) << " " << value << "\n";
+}
+
+void MetricsWriter::gauge(const std::string &name, const std::string &help,
+                          int64_t value, const labels_t &labels) {
+    header(name, help, "gauge");
+    m_stream << name << format_labels(labels) << " " << value << "\n";
+}
+
+void MetricsWriter::summary(const std::string &name, const std::string &help,
+                            const Histogram &histogram,
+                            const labels_t &labels) {
+    header(name, help, "summary");
+
+    auto snapshot = histogram.snapshot();
+
+    for (auto q : {0.5, 0.9, 0.99, 0.999}) {
+        std::ostringstream qstr;
+        qstr << q;
+
+        auto qlabels = labels;
+        qlabels.emplace_back("quantile", qstr.str());
+
+        m_stream << name << format_labels(qlabels) << " "
+                 << snapshot.quantile(q) << "\n";
+    }
+
+    m_stream << name << "_sum" << format_labels(labels) << " " << snapshot.sum
+             << "\n"
+             << name << "_count" << format_labels(labels) << " "
+             << snapshot.count << "\n";
+}
+
+MetricsReporter::MetricsReporter(std::string path, uint32_t interval,
+                                 collect_fn_t collect)
+    : m_path(std::move(path)), m_interval(interval),
+      m_collect(std::move(collect)),
+      m_thread(std::thread(&MetricsReporter::work, this)) {
+    LOG(INFO) << "Writing metrics to " << m_path << " every " << m_interval
+              << "s";
+}
+
+MetricsReporter::~MetricsReporter() {
+    {
+        std::unique_lock lock(m_mutex);
+        m_okay = false;
+        m_cond.notify_all();
+    }
+
+    m_thread.join();
+}
+
+void MetricsReporter::work() {
+    std::unique_lock lock(m_mutex);
+
+    while (m_okay) {
+        m_cond.wait_for(lock, std::chrono::seconds(m_interval));
+
+        if (!m_okay) {
+            break;
+        }
+
+        lock.unlock();
+        dump();
+        lock.lock();
+    }
+}
+
+void MetricsReporter::dump() {
+    MetricsWriter writer;
+    m_collect(writer);
+
+    // write to a temporary file first, so readers never see partial output
+    auto tmp_path = m_path + ".tmp";
+
+    {
+        std::ofstream file(tmp_path, std::fstream::trunc);
+        file << writer.str();
+
+        if (file.bad()) {
+            LOG(ERROR) << "Failed to write metrics to " << tmp_path;
+            return;
+        }
+    }
+
+    if (std::rename(tmp_path.c_str(), m_path.c_str()) != 0) {
+        LOG(ERROR) << "Failed to move metrics file to " << m_path;
+    }
+}
+
+} // namespace relay
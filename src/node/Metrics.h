@@ -0,0 +1,169 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <bit>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace relay {
+
+/// Number of shards every metric is split into
+/// Threads are assigned to shards round-robin so they (mostly) do not share
+/// cache lines when updating the same metric
+constexpr size_t NUM_METRIC_SHARDS = 8;
+
+inline size_t metric_shard() {
+    static std::atomic<size_t> next_shard = 0;
+    thread_local size_t shard = next_shard.fetch_add(1) % NUM_METRIC_SHARDS;
+    return shard;
+}
+
+/// A monotonically increasing counter that is sharded by thread
+class Counter {
+  public:
+    void add(uint64_t value = 1) {
+        m_shards[metric_shard()].value.fetch_add(value,
+                                                 std::memory_order_relaxed);
+    }
+
+    uint64_t value() const {
+        uint64_t result = 0;
+        for (auto &shard : m_shards) {
+            result += shard.value.load(std::memory_order_relaxed);
+        }
+        return result;
+    }
+
+  private:
+    struct alignas(64) shard_t {
+        std::atomic<uint64_t> value = 0;
+    };
+
+    std::array<shard_t, NUM_METRIC_SHARDS> m_shards;
+};
+
+/// Log-linear histogram (in the spirit of HdrHistogram)
+///
+/// Every power of two is split into 8 sub-buckets, which bounds the relative
+/// error of a recorded value to 12.5%. Values larger than 2^40 are clamped.
+class Histogram {
+  public:
+    void record(uint64_t value) {
+        auto &shard = m_shards[metric_shard()];
+
+        shard.buckets[to_bucket(value)].fetch_add(1,
+                                                  std::memory_order_relaxed);
+        shard.count.fetch_add(1, std::memory_order_relaxed);
+        shard.sum.fetch_add(value, std::memory_order_relaxed);
+    }
+
+    struct snapshot_t {
+        uint64_t count = 0;
+        uint64_t sum = 0;
+        std::vector<uint64_t> buckets;
+
+        /// Upper bound of the bucket containing the specified quantile
+        uint64_t quantile(double q) const;
+    };
+
+    snapshot_t snapshot() const;
+
+  private:
+    static constexpr size_t SUB_BITS = 4;
+    static constexpr size_t SUB_BUCKETS = 1 << (SUB_BITS - 1);
+    static constexpr size_t MAX_BITS = 40;
+    static constexpr size_t NUM_BUCKETS =
+        (MAX_BITS - SUB_BITS + 1) * SUB_BUCKETS + 2 * SUB_BUCKETS;
+
+    static size_t to_bucket(uint64_t value) {
+        value = std::min<uint64_t>(value, (uint64_t(1) << MAX_BITS) - 1);
+
+        if (value < 2 * SUB_BUCKETS) {
+            return value;
+        }
+
+        size_t msb = std::bit_width(value) - 1;
+        size_t shift = msb - SUB_BITS + 1;
+        return shift * SUB_BUCKETS + (value >> shift);
+    }
+
+    static uint64_t upper_bound(size_t bucket) {
+        if (bucket < 2 * SUB_BUCKETS) {
+            return bucket;
+        }
+
+        size_t shift = bucket / SUB_BUCKETS - 1;
+        uint64_t sub = bucket % SUB_BUCKETS + SUB_BUCKETS;
+        return ((sub + 1) << shift) - 1;
+    }
+
+    struct alignas(64) shard_t {
+        std::atomic<uint64_t> count = 0;
+        std::atomic<uint64_t> sum = 0;
+        std::array<std::atomic<uint64_t>, NUM_BUCKETS> buckets = {};
+    };
+
+    std::array<shard_t, NUM_METRIC_SHARDS> m_shards;
+};
+
+/// Formats metrics in the Prometheus text exposition format
+class MetricsWriter {
+  public:
+    using labels_t = std::vector<std::pair<std::string, std::string>>;
+
+    void counter(const std::string &name, const std::string &help,
+                 uint64_t value, const labels_t &labels = {});
+
+    void gauge(const std::string &name, const std::string &help,
+               int64_t value, const labels_t &labels = {});
+
+    /// Histograms are exported as summaries with a fixed set of quantiles
+    void summary(const std::string &name, const std::string &help,
+                 const Histogram &histogram, const labels_t &labels = {});
+
+    std::string str() const { return m_stream.str(); }
+
+  private:
+    /// Write HELP and TYPE only for the first sample of a metric
+    void header(const std::string &name, const std::string &help,
+                const std::string &type);
+
+    std::string m_last_name;
+    std::ostringstream m_stream;
+};
+
+/// Periodically dumps metrics to a file
+///
+/// The file is replaced atomically, so it can be consumed by the
+/// node_exporter textfile collector or just be inspected by hand.
+class MetricsReporter {
+  public:
+    using collect_fn_t = std::function<void(MetricsWriter &)>;
+
+    MetricsReporter(std::string path, uint32_t interval, collect_fn_t collect);
+    ~MetricsReporter();
+
+  private:
+    void work();
+    void dump();
+
+    const std::string m_path;
+    const uint32_t m_interval;
+    const collect_fn_t m_collect;
+
+    bool m_okay = true;
+    std::mutex m_mutex;
+    std::condition_variable m_cond;
+
+    std::thread m_thread;
+};
+
+} // namespace relay
@@ -1,6 +1,9 @@
 #include "NetworkConfig.h"
+#include "common/Topics.h"
 
+#include <filesystem>
 #include <fstream>
+#include <stdexcept>
 #include <streambuf>
 
 #include <glog/logging.h>
@@ -10,6 +13,141 @@ namespace relay {
 
 constexpr uint16_t SERVER_PORT = 5050;
 
+// Allow sending up to 64kb at full speed if the link was idle
+constexpr uint32_t DEFAULT_BURST_SIZE = 64 * 1024;
+
+inline std::optional<json::Document> get_child(const json::Document &doc,
+                                               const std::string &key) {
+    try {
+        return json::Document(doc, key);
+    } catch (std::exception &) {
+        return std::nullopt;
+    }
+}
+
+inline int64_t read_integer(const json::Document &doc, const std::string &key,
+                            int64_t default_value) {
+    auto child = get_child(doc, key);
+    return child ? child->as_integer() : default_value;
+}
+
+inline double read_float(const json::Document &doc, const std::string &key,
+                         double default_value) {
+    auto child = get_child(doc, key);
+    return child ? child->as_float() : default_value;
+}
+
+NetworkConfig::DelayDistribution parse_distribution(const std::string &str) {
+    using DelayDistribution = NetworkConfig::DelayDistribution;
+
+    if (str == "constant") {
+        return DelayDistribution::Constant;
+    } else if (str == "uniform") {
+        return DelayDistribution::Uniform;
+    } else if (str == "normal") {
+        return DelayDistribution::Normal;
+    } else if (str == "pareto") {
+        return DelayDistribution::Pareto;
+    } else {
+        LOG(FATAL) << "Unknown delay distribution: " << str;
+    }
+}
+
+/// Parse the compression settings of a link
+/// A level of 0 disables compression (e.g., for the reverse direction)
+std::optional<NetworkConfig::compression_t>
+parse_compression(const json::Document &doc,
+                  const std::optional<NetworkConfig::compression_t> &defaults) {
+    auto compression = defaults.value_or(NetworkConfig::compression_t{});
+
+    auto level = read_integer(doc, "level", compression.level);
+    auto min_size = read_integer(doc, "min_size", compression.min_size);
+    auto batch_size = read_integer(doc, "batch", compression.batch_size);
+
+    if (level < 0 || level > 9 || min_size < 0 || batch_size <= 0) {
+        throw std::runtime_error("Invalid compression parameters");
+    }
+
+    if (level == 0) {
+        return std::nullopt;
+    }
+
+    compression.level = static_cast<int>(level);
+    compression.min_size = static_cast<uint32_t>(min_size);
+    compression.batch_size = static_cast<uint32_t>(batch_size);
+
+    return compression;
+}
+
+/// Parse the link parameters of one direction of an edge
+/// Unset fields are taken from defaults
+///
+/// @param config_dir the directory relative to which traces are loaded
+NetworkConfig::link_t parse_link(const json::Document &doc,
+                                 const NetworkConfig::link_t &defaults,
+                                 const std::filesystem::path &config_dir) {
+    auto delay = read_integer(doc, "delay", defaults.delay);
+    auto jitter = read_integer(doc, "jitter", defaults.jitter);
+    auto bandwidth = read_integer(doc, "bandwidth", defaults.bandwidth);
+    auto burst = read_integer(doc, "burst", defaults.burst);
+
+    NetworkConfig::link_t link;
+    link.loss = read_float(doc, "loss", defaults.loss);
+    link.reorder = read_float(doc, "reorder", defaults.reorder);
+
+    if (auto dist = get_child(doc, "distribution")) {
+        link.distribution = parse_distribution(dist->as_string());
+    } else if (jitter > 0 && defaults.jitter == 0) {
+        link.distribution = NetworkConfig::DelayDistribution::Uniform;
+    } else {
+        link.distribution = defaults.distribution;
+    }
+
+    if (delay < 0 || jitter < 0 || bandwidth < 0 || burst <= 0) {
+        throw std::runtime_error("Invalid link parameters");
+    }
+
+    if (link.loss < 0.0 || link.loss > 1.0 || link.reorder < 0.0 ||
+        link.reorder > 1.0) {
+        throw std::runtime_error("Loss and reorder rates must be in [0,1]");
+    }
+
+    if (auto trace = get_child(doc, "trace")) {
+        auto path = config_dir / trace->as_string();
+
+        auto loop_doc = get_child(doc, "trace_loop");
+        bool loop = loop_doc ? loop_doc->as_bool() : false;
+
+        link.trace = std::make_shared<const LinkTrace>(path.string(), loop);
+    } else {
+        link.trace = defaults.trace;
+    }
+
+    if (auto compression = get_child(doc, "compression")) {
+        link.compression =
+            parse_compression(*compression, defaults.compression);
+    } else {
+        link.compression = defaults.compression;
+    }
+
+    link.delay = static_cast<uint32_t>(delay);
+    link.jitter = static_cast<uint32_t>(jitter);
+    link.bandwidth = static_cast<uint32_t>(bandwidth);
+    link.burst = static_cast<uint32_t>(burst);
+
+    return link;
+}
+
+NetworkConfig::Scheduling parse_scheduling(const std::string &str) {
+    if (str == "strict") {
+        return NetworkConfig::Scheduling::Strict;
+    } else if (str == "weighted") {
+        return NetworkConfig::Scheduling::Weighted;
+    } else {
+        LOG(FATAL) << "Unknown scheduling policy: " << str;
+    }
+}
+
 yael::network::Address read_address(const std::string &addr_str) {
     size_t found = addr_str.find(':');
 
@@ -40,7 +178,34 @@ NetworkConfig::NetworkConfig(const std::string &local_name,
 
         json::Document doc(str);
 
+        auto config_dir = std::filesystem::path(filename).parent_path();
+
         m_num_channels = json::Document(doc, "num_channels").as_integer();
+        m_seed = read_integer(doc, "seed", 0);
+
+        if (auto priorities = get_child(doc, "priorities")) {
+            parse_priorities(*priorities);
+        } else {
+            m_channel_priorities.resize(m_num_channels, 0);
+        }
+
+        m_conflating.resize(m_num_channels, false);
+
+        if (auto conflating = get_child(doc, "conflating_channels")) {
+            for (size_t i = 0; i < conflating->get_size(); ++i) {
+                auto cid = json::Document(*conflating, i).as_integer();
+
+                if (cid < 0 || cid >= m_num_channels) {
+                    throw std::runtime_error("Invalid conflating channel");
+                }
+
+                m_conflating[cid] = true;
+            }
+        }
+
+        if (auto topics = get_child(doc, "topics")) {
+            parse_topics(*topics);
+        }
 
         json::Document nodes(doc, "nodes");
 
@@ -57,14 +222,138 @@ NetworkConfig::NetworkConfig(const std::string &local_name,
 
             auto from = json::Document(entry, "from").as_string();
             auto to = json::Document(entry, "to").as_string();
-            auto delay = json::Document(entry, "delay").as_integer();
 
-            m_edges.emplace_back(
-                edge_t{from, to, static_cast<uint32_t>(delay)});
+            // make sure the delay is always specified
+            json::Document(entry, "delay").as_integer();
+
+            link_t defaults;
+            defaults.burst = DEFAULT_BURST_SIZE;
+
+            edge_t edge = {from, to, parse_link(entry, defaults, config_dir),
+                           std::nullopt};
+
+            // the reverse direction inherits everything it does not override
+            if (auto reverse = get_child(entry, "reverse")) {
+                edge.reverse = parse_link(*reverse, edge.forward, config_dir);
+            }
+
+            m_edges.emplace_back(std::move(edge));
         }
     } catch (std::exception &e) {
         LOG(FATAL) << "Failed to load network config: " << e.what();
     }
 }
 
+void NetworkConfig::parse_priorities(const json::Document &doc) {
+    if (auto scheduling = get_child(doc, "scheduling")) {
+        m_scheduling = parse_scheduling(scheduling->as_string());
+    }
+
+    // one weight per class, the first class has the highest priority
+    json::Document weights(doc, "weights");
+    m_priority_weights.clear();
+
+    for (size_t i = 0; i < weights.get_size(); ++i) {
+        auto weight = json::Document(weights, i).as_integer();
+
+        if (weight <= 0) {
+            throw std::runtime_error("Priority weights must be positive");
+        }
+
+        m_priority_weights.push_back(static_cast<uint32_t>(weight));
+    }
+
+    if (m_priority_weights.empty()) {
+        throw std::runtime_error("Need at least one priority class");
+    }
+
+    // channels that are not listed go to the lowest class by default
+    auto default_priority =
+        read_integer(doc, "default", m_priority_weights.size() - 1);
+
+    if (default_priority < 0 ||
+        default_priority >= static_cast<int64_t>(m_priority_weights.size())) {
+        throw std::runtime_error("Invalid default priority class");
+    }
+
+    m_default_priority = static_cast<uint32_t>(default_priority);
+    m_channel_priorities.resize(m_num_channels, m_default_priority);
+
+    if (auto channels = get_child(doc, "channels")) {
+        for (size_t i = 0; i < channels->get_size(); ++i) {
+            auto cid = std::stoul(channels->get_key(i));
+            auto priority = channels->get_child(i).as_integer();
+
+            if (cid >= m_num_channels || priority < 0 ||
+                priority >= static_cast<int64_t>(m_priority_weights.size())) {
+                throw std::runtime_error("Invalid channel priority");
+            }
+
+            m_channel_priorities[cid] = static_cast<uint32_t>(priority);
+        }
+    }
+}
+
+void NetworkConfig::parse_topics(const json::Document &doc) {
+    auto first_channel = read_integer(doc, "first_channel", 0);
+    auto depth = read_integer(doc, "depth", 1);
+
+    if (first_channel < 0 || first_channel >= m_num_channels) {
+        throw std::runtime_error("Invalid first topic channel");
+    }
+
+    if (depth <= 0) {
+        throw std::runtime_error("Topic depth must be positive");
+    }
+
+    m_first_topic_channel = static_cast<uint32_t>(first_channel);
+    m_topic_depth = static_cast<uint32_t>(depth);
+}
+
+channel_id_t NetworkConfig::topic_channel(std::string_view topic) const {
+    // the first m_topic_depth segments decide the channel
+    size_t end = std::string_view::npos;
+    size_t start = 0;
+
+    for (uint32_t i = 0; i < m_topic_depth; ++i) {
+        end = topic.find(TOPIC_SEPARATOR, start);
+
+        if (end == std::string_view::npos) {
+            break;
+        }
+
+        start = end + 1;
+    }
+
+    auto num_topic_channels = m_num_channels - m_first_topic_channel;
+    auto hash = topic_hash(topic.substr(0, end));
+
+    return m_first_topic_channel + hash % num_topic_channels;
+}
+
+std::set<channel_id_t>
+NetworkConfig::topic_channels(const std::set<std::string> &patterns) const {
+    std::set<channel_id_t> result;
+
+    for (auto &pattern : patterns) {
+        auto segments = split_topic(pattern);
+        auto wildcard = std::find(segments.begin(), segments.end(),
+                                  TOPIC_WILDCARD);
+
+        auto literal = static_cast<size_t>(wildcard - segments.begin());
+
+        if (wildcard == segments.end() || literal >= m_topic_depth) {
+            result.insert(topic_channel(pattern));
+            continue;
+        }
+
+        // the pattern spans topics on every channel
+        for (auto cid = m_first_topic_channel; cid < m_num_channels; ++cid) {
+            result.insert(cid);
+        }
+    }
+
+    return result;
+}
+
 } // namespace relay
@@ -1,19 +1,84 @@
 #pragma once
 
+#include <algorithm>
 #include <glog/logging.h>
+#include <json/Document.h>
+#include <memory>
+#include <optional>
+#include <set>
 #include <string>
+#include <string_view>
 #include <unordered_map>
 #include <vector>
 #include <yael/network/Address.h>
 
+#include "LinkTrace.h"
+#include "librelay/Connection.h"
+
 namespace relay {
 
 class NetworkConfig {
   public:
+    enum class DelayDistribution { Constant, Uniform, Normal, Pareto };
+
+    /// How queued messages of different priority classes are served
+    enum class Scheduling {
+        /// Always serve the highest (lowest numbered) class first
+        Strict,
+        /// Share the bandwidth between classes according to their weights
+        Weighted
+    };
+
+    /// Compression of the messages sent over a link
+    struct compression_t {
+        /// zlib level from 1 (fastest) to 9 (smallest)
+        int level = 1;
+
+        /// Messages (or batches) smaller than this are sent as is
+        uint32_t min_size = 128;
+
+        /// Queued messages that are compressed together (1 = no batching)
+        uint32_t batch_size = 1;
+    };
+
+    /// Parameters for one direction of an edge
+    struct link_t {
+        /// Base propagation delay in milliseconds
+        uint32_t delay = 0;
+
+        /// Jitter in milliseconds that is added to the base delay
+        uint32_t jitter = 0;
+        DelayDistribution distribution = DelayDistribution::Constant;
+
+        /// Probability of a message being dropped
+        double loss = 0.0;
+
+        /// Probability of a message overtaking the ones in flight
+        double reorder = 0.0;
+
+        /// Bandwidth in kbit/s (0 = unlimited)
+        uint32_t bandwidth = 0;
+
+        /// Maximum burst size in bytes
+        uint32_t burst = 0;
+
+        /// Time-varying delay, bandwidth and loss (optional)
+        /// Overrides the static values while it is replayed
+        std::shared_ptr<const LinkTrace> trace;
+
+        /// Not compressed if unset
+        std::optional<compression_t> compression;
+    };
+
     struct edge_t {
         std::string from;
         std::string to;
-        uint32_t delay;
+
+        /// The link from->to
+        link_t forward;
+
+        /// The link to->from; not emulated if unset
+        std::optional<link_t> reverse;
     };
 
     NetworkConfig(const std::string &local_name, const std::string &filename);
@@ -39,10 +104,79 @@ class NetworkConfig {
 
     uint32_t num_channels() const { return m_num_channels; }
 
+    /// Seed for the randomness of the link emulation (0 = random)
+    uint64_t seed() const { return m_seed; }
+
+    /// Number of priority classes (at least one)
+    uint32_t num_priorities() const { return m_priority_weights.size(); }
+
+    const std::vector<uint32_t> &priority_weights() const {
+        return m_priority_weights;
+    }
+
+    Scheduling scheduling() const { return m_scheduling; }
+
+    /// The priority class of a message is the highest one of its channels
+    template <typename Channels>
+    uint32_t priority(const Channels &channels) const {
+        if (channels.empty()) {
+            return m_default_priority;
+        }
+
+        uint32_t result = num_priorities() - 1;
+        for (auto cid : channels) {
+            if (cid < m_channel_priorities.size()) {
+                result = std::min(result, m_channel_priorities[cid]);
+            }
+        }
+
+        return result;
+    }
+
+    /// Only keep the latest pending value per key for these channels
+    /// A message is conflated if all of its channels are conflating
+    template <typename Channels>
+    bool is_conflating(const Channels &channels) const {
+        if (channels.empty()) {
+            return false;
+        }
+
+        for (auto cid : channels) {
+            if (cid >= m_conflating.size() || !m_conflating[cid]) {
+                return false;
+            }
+        }
+
+        return true;
+    }
+
+    /// The channel that carries a topic
+    /// Topics are hashed onto the topic channels by their first segments,
+    /// so everything below a prefix of that depth shares a channel
+    channel_id_t topic_channel(std::string_view topic) const;
+
+    /// The channels a client needs to receive the topics matching patterns
+    std::set<channel_id_t>
+    topic_channels(const std::set<std::string> &patterns) const;
+
   private:
+    void parse_priorities(const json::Document &doc);
+    void parse_topics(const json::Document &doc);
+
     const std::string m_local_name;
 
     uint32_t m_num_channels;
+    uint32_t m_default_priority = 0;
+    std::vector<uint32_t> m_channel_priorities;
+    std::vector<bool> m_conflating;
+    std::vector<uint32_t> m_priority_weights = {1};
+    Scheduling m_scheduling = Scheduling::Strict;
+
+    /// Topics go to channels [m_first_topic_channel, m_num_channels)
+    uint32_t m_first_topic_channel = 0;
+    uint32_t m_topic_depth = 1;
+
+    uint64_t m_seed;
     std::unordered_map<std::string, yael::network::Address> m_nodes;
     std::vector<edge_t> m_edges;
 };
@@ -1,9 +1,17 @@
 #include "Node.h"
 #include "Peer.h"
+#include "ShmEndpoint.h"
+#include "Snapshot.h"
+#include "affinity.h"
 
+#include <algorithm>
 #include <chrono>
+#include <fstream>
+#include <random>
+#include <sstream>
 #include <stdbitstream.h>
 #include <thread>
+#include <unistd.h>
 
 #include <yael/EventLoop.h>
 #include <yael/network/TcpSocket.h>
@@ -14,6 +22,19 @@ namespace relay {
 // FIXME expose this through meson config
 constexpr size_t MEM_SIZE = 10 * 1024 * 1024 * 1024L;
 
+// How often peers with queued messages retry sending
+constexpr auto FLUSH_INTERVAL = std::chrono::milliseconds(1);
+
+// Backoff between attempts to connect to a relay that is not up yet
+constexpr auto MIN_CONNECT_BACKOFF = std::chrono::milliseconds(10);
+constexpr auto MAX_CONNECT_BACKOFF = std::chrono::milliseconds(1000);
+
+/// Random id for the messages of this node
+inline uint64_t make_node_id() {
+    std::random_device rd;
+    return (static_cast<uint64_t>(rd()) << 32) | rd();
+}
+
 inline yael::network::Address read_address(const std::string &addr_str) {
     size_t found = addr_str.find(':');
 
@@ -33,10 +54,19 @@ inline yael::network::Address read_address(const std::string &addr_str) {
 }
 
 Node::Node(const std::string &name, const std::string &config_file,
-           uint32_t wait)
-    : m_config(name, config_file), m_message_cache("relay-" + name, MEM_SIZE) {
+           const node_options_t &options)
+    : m_options(options), m_config(name, config_file),
+      m_message_cache("relay-" + name, MEM_SIZE), m_node_id(make_node_id()),
+      m_seen_messages(DEDUP_WINDOW),
+      m_history(m_config.num_channels(), options.history_size),
+      m_channel_messages(m_config.num_channels()) {
     LOG(INFO) << "Starting relay node " << name;
 
+    // nothing may be stored before the snapshot is adopted
+    if (!m_options.bootstrap_from.empty()) {
+        bootstrap(m_options.bootstrap_from);
+    }
+
     auto sock = new yael::network::TcpSocket();
     auto addr = m_config.get_node(name);
     addr.IP = "0.0.0.0";
@@ -51,27 +81,33 @@ Node::Node(const std::string &name, const std::string &config_file,
     this->set_socket(std::unique_ptr<yael::network::Socket>(sock),
                      yael::SocketType::Acceptor);
 
-    // Wait for other nodes to come up
-    std::this_thread::sleep_for(std::chrono::seconds(wait));
+    if (m_options.snapshot_port != 0) {
+        m_snapshot_server = std::make_unique<SnapshotServer>(
+            m_message_cache, m_options.snapshot_port);
+    }
+
+    // relays forward more traffic than edge nodes
+    start_workers(2 * std::thread::hardware_concurrency());
 
     // Set up topology
+    // Neighbors might not be up yet, so this happens in the background
     for (auto &e : m_config.edges()) {
         if (e.from == m_config.local_name()) {
-            auto &to_addr = m_config.get_node(e.to);
-            connect(e.to, to_addr);
+            add_link(e.to, m_config.get_node(e.to), false);
         }
     }
 
-    // start worker threads
-    size_t num_threads = 2 * std::thread::hardware_concurrency();
-    for (size_t i = 0; i < num_threads; ++i) {
-        m_workers.emplace_back(std::thread(&Node::work, this));
-    }
+    m_connect_thread = std::thread(&Node::connect_links, this);
 }
 
-Node::Node(const std::string &addr_str, const std::string &peer_addr_str,
-           const std::string &config_file, uint32_t wait)
-    : m_config("", config_file), m_message_cache("relay-edge-node", MEM_SIZE) {
+Node::Node(const std::string &addr_str,
+           const std::vector<std::string> &upstreams,
+           const std::string &config_file, const node_options_t &options)
+    : m_options(options), m_config("", config_file),
+      m_message_cache("relay-edge-node", MEM_SIZE), m_node_id(make_node_id()),
+      m_seen_messages(DEDUP_WINDOW),
+      m_history(m_config.num_channels(), options.history_size),
+      m_channel_messages(m_config.num_channels()) {
     LOG(INFO) << "Starting relay edge node";
 
     auto sock = new yael::network::TcpSocket();
@@ -87,128 +123,489 @@ Node::Node(const std::string &addr_str, const std::string &peer_addr_str,
     this->set_socket(std::unique_ptr<yael::network::Socket>(sock),
                      yael::SocketType::Acceptor);
 
-    // Wait for other nodes to come up
-    std::this_thread::sleep_for(std::chrono::seconds(wait));
+    start_workers(std::thread::hardware_concurrency());
 
-    // Connect to the peer node
-    auto peer_addr = read_address(peer_addr_str);
-    connect("", peer_addr);
-
-    // start worker threads
-    size_t num_threads = std::thread::hardware_concurrency();
-    for (size_t i = 0; i < num_threads; ++i) {
-        m_workers.emplace_back(std::thread(&Node::work, this));
+    // Connect to the upstream relays
+    // Clients are served by whichever ones are up
+    for (auto &peer_addr_str : upstreams) {
+        add_link("", read_address(peer_addr_str), true);
     }
+
+    m_connect_thread = std::thread(&Node::connect_links, this);
 }
 
 Node::~Node() {
-    m_in_condition.notify_all();
-    m_out_condition.notify_all();
+    m_metrics_reporter.reset();
+
+    m_snapshot_server.reset();
+
+    // stop accepting and disconnect local clients before the workers
+    m_shm_listener.reset();
+
+    std::unique_lock shm_lock(m_shm_mutex);
+    auto shm_clients = std::move(m_shm_clients);
+    m_shm_clients.clear();
+    shm_lock.unlock();
+
+    for (auto &client : shm_clients) {
+        client->stop();
+    }
+
+    for (auto &queue : m_task_queues) {
+        std::unique_lock lock(queue->mutex);
+        queue->condition.notify_all();
+    }
+
+    {
+        std::unique_lock lock(m_flush_mutex);
+        m_flush_condition.notify_all();
+    }
+
+    {
+        std::unique_lock lock(m_link_mutex);
+        m_link_condition.notify_all();
+    }
+
+    if (m_connect_thread.joinable()) {
+        m_connect_thread.join();
+    }
+
+    // waits for attempts that are still connecting
+    m_connect_attempts.clear();
 
     for (auto &t : m_workers) {
         t.join();
     }
 
-    for (auto tasks : m_tasks) {
-        delete tasks;
+    if (m_flush_thread.joinable()) {
+        m_flush_thread.join();
+    }
+
+    for (auto &queue : m_task_queues) {
+        for (auto &tasks : queue->tasks) {
+            for (auto task : tasks) {
+                delete task;
+            }
+        }
     }
 }
 
-void Node::connect(const std::string &name,
-                   const yael::network::Address &addr) {
-    auto &el = yael::EventLoop::get_instance();
-    auto p = el.make_event_listener<Peer>(addr, *this, m_config, name);
+Node::Task *Node::task_queue_t::pop() {
+    auto priority =
+        scheduler.next([this](size_t i) { return !tasks[i].empty(); });
 
-    std::unique_lock lock(m_peer_mutex);
-    m_peers.push_back(p);
+    if (!priority) {
+        return nullptr;
+    }
+
+    auto task = tasks[*priority].front();
+    tasks[*priority].pop_front();
+    return task;
 }
 
-void Node::on_new_connection(std::unique_ptr<yael::network::Socket> &&socket) {
-    auto &el = yael::EventLoop::get_instance();
-    auto peer =
-        el.make_event_listener<Peer>(std::move(socket), *this, m_config);
+size_t Node::task_queue_t::size() const {
+    size_t result = 0;
+    for (auto &t : tasks) {
+        result += t.size();
+    }
+    return result;
+}
 
-    std::unique_lock lock(m_peer_mutex);
-    m_peers.push_back(peer);
-    lock.unlock();
+void Node::start_workers(size_t default_count) {
+    size_t num_workers = m_options.num_workers;
+    if (num_workers == 0) {
+        num_workers = std::max<size_t>(default_count, 1);
+    }
 
-    auto it = m_message_cache.iterate();
+    size_t num_queues = m_options.shard_peers ? num_workers : 1;
+    for (size_t i = 0; i < num_queues; ++i) {
+        m_task_queues.emplace_back(std::make_unique<task_queue_t>(m_config));
+    }
 
-    // loop until we sent everything we saw
-    // FIXME only forward messages from relevant channels here
-    while (peer->is_connected()) {
-        auto hdl = it.next();
+    LOG(INFO) << "Starting " << num_workers << " workers with " << num_queues
+              << " task queue(s)";
 
-        if (!hdl) {
-            break;
+    for (size_t i = 0; i < num_workers; ++i) {
+        m_workers.emplace_back(std::thread(&Node::work, this, i));
+    }
+
+    m_flush_thread = std::thread(&Node::flush_peers, this);
+}
+
+size_t Node::assign_worker() {
+    return m_next_queue.fetch_add(1) % m_task_queues.size();
+}
+
+void Node::add_link(const std::string &name,
+                    const yael::network::Address &addr, bool upstream) {
+    std::unique_lock lock(m_link_mutex);
+    m_ready = false;
+    m_pending_links.push_back(
+        link_t{name, addr, upstream, 0, std::chrono::steady_clock::now()});
+    m_link_condition.notify_one();
+}
+
+void Node::connect_links() {
+    std::unique_lock lock(m_link_mutex);
+
+    while (is_valid()) {
+        m_connect_attempts.remove_if([](std::future<void> &attempt) {
+            return attempt.wait_for(std::chrono::seconds(0)) ==
+                   std::future_status::ready;
+        });
+
+        if (m_pending_links.empty()) {
+            if (!m_ready && m_num_connecting == 0) {
+                set_ready();
+            }
+
+            m_link_condition.wait(lock);
+            continue;
         }
 
-        if (!peer->has_subscription(hdl->channels())) {
+        auto it = std::min_element(m_pending_links.begin(),
+                                   m_pending_links.end(),
+                                   [](const link_t &a, const link_t &b) {
+                                       return a.next_attempt < b.next_attempt;
+                                   });
+
+        if (it->next_attempt > std::chrono::steady_clock::now()) {
+            m_link_condition.wait_until(lock, it->next_attempt);
             continue;
         }
 
-        // there might be a lot of messages queued up,
-        // so we might need to block
-        //
-        // TODO move this to the peer class so it does not block the acceptor
-        bool blocking = true;
+        // connecting blocks until the peer answers (or the kernel gives up),
+        // so every attempt gets its own thread
+        auto link = *it;
+        m_pending_links.erase(it);
+        m_num_connecting++;
+
+        m_connect_attempts.push_back(std::async(
+            std::launch::async, &Node::attempt_link, this, std::move(link)));
+    }
+}
 
-        // Defer writing to socket to the event loop
-        bool async = true;
+void Node::attempt_link(link_t link) {
+    bool success = connect(link.name, link.address, link.upstream);
 
-        auto msg = hdl->data();
-        peer->send(msg.data(), msg.size(), blocking, async);
+    std::unique_lock lock(m_link_mutex);
+    m_num_connecting--;
+    m_link_condition.notify_one();
+
+    if (success) {
+        return;
     }
+
+    auto backoff = MIN_CONNECT_BACKOFF * (1 << std::min(link.attempts, 7U));
+    backoff =
+        std::min<std::chrono::milliseconds>(backoff, MAX_CONNECT_BACKOFF);
+
+    LOG(WARNING) << "Relay at " << link.address
+                 << " is not reachable; retrying in " << backoff.count()
+                 << "ms";
+
+    link.attempts++;
+    link.next_attempt = std::chrono::steady_clock::now() + backoff;
+    m_pending_links.push_back(std::move(link));
 }
 
-void Node::work() {
+void Node::set_ready() {
+    m_ready = true;
+
+    LOG(INFO) << "All links to other relays are up";
+
+    if (!m_options.ready_file.empty()) {
+        std::ofstream(m_options.ready_file) << ::getpid() << std::endl;
+    }
+}
+
+void Node::bootstrap(const std::string &address) {
+    if (!fetch_snapshot(m_message_cache, read_address(address))) {
+        LOG(WARNING) << "Starting without history";
+        return;
+    }
+
+    auto num_entries = m_message_cache.num_entries();
+
+    if (num_entries == 0) {
+        return;
+    }
+
+    // links resume a little before the end of the snapshot,
+    // so the last messages have to be known as duplicates
+    std::optional<message_id_t> last_id;
+    auto start = num_entries - std::min(num_entries, RESUME_MARGIN);
+
+    for (auto pos = start; pos < num_entries; ++pos) {
+        auto hdl = m_message_cache.get_entry(pos);
+
+        if (!hdl) {
+            continue;
+        }
+
+        auto data = hdl->data().duplicate();
+        auto header = read_header(data);
+
+        if (header.id) {
+            m_seen_messages.insert(*header.id);
+            m_seen_messages.set_position(*header.id, pos);
+            last_id = header.id;
+        }
+
+        m_history.add(hdl->channels(), pos);
+    }
+
+    // every neighbor can resume from the last message of the snapshot
+    std::unique_lock lock(m_link_state_mutex);
+
+    // (see Peer::link_key for how links are identified)
+    for (auto &e : m_config.edges()) {
+        if (e.from == m_config.local_name()) {
+            std::ostringstream key;
+            key << m_config.get_node(e.to);
+            m_link_states[key.str()] = link_state_t{last_id, std::nullopt};
+        } else if (e.to == m_config.local_name()) {
+            m_link_states[e.from] = link_state_t{last_id, std::nullopt};
+        }
+    }
+
+    LOG(INFO) << "Bootstrapped " << num_entries << " messages from "
+              << address;
+}
+
+bool Node::connect(const std::string &name,
+                   const yael::network::Address &addr, bool upstream) {
+    auto &el = yael::EventLoop::get_instance();
+    std::shared_ptr<Peer> p;
+
+    try {
+        p = el.make_event_listener<Peer>(addr, *this, m_config, name,
+                                         upstream);
+    } catch (std::runtime_error &) {
+        return false;
+    }
+
+    std::unique_lock lock(m_peer_mutex);
+    m_peers.push_back(p);
+    return true;
+}
+
+void Node::on_new_connection(std::unique_ptr<yael::network::Socket> &&socket) {
+    auto &el = yael::EventLoop::get_instance();
+    auto peer =
+        el.make_event_listener<Peer>(std::move(socket), *this, m_config);
+
+    std::unique_lock lock(m_peer_mutex);
+    m_peers.push_back(peer);
+
+    // catching up happens once the peer sent its hello:
+    // relays resume from where they left off (see resume_peer),
+    // clients ask for the history they need
+}
+
+void Node::work(size_t index) {
+    if (!m_options.cpus.empty()) {
+        pin_current_thread(m_options.cpus[index % m_options.cpus.size()]);
+    }
+
+    auto &queue = *m_task_queues[index % m_task_queues.size()];
+
     while (is_valid()) {
         Task *task = nullptr;
 
         {
-            std::unique_lock lock(m_task_mutex);
+            std::unique_lock lock(queue.mutex);
             while (is_valid() && task == nullptr) {
-                if (m_tasks.empty()) {
-                    m_in_condition.wait(lock);
-                } else {
-                    task = m_tasks.front();
-                    m_tasks.pop_front();
-                    m_out_condition.notify_all();
+                task = queue.pop();
+
+                if (task == nullptr) {
+                    queue.condition.wait(lock);
                 }
             }
         }
 
         if (task) {
-            broadcast(std::move(task->channels), std::move(task->msg),
-                      task->except);
+            auto start = LinkScheduler::current_time();
+            m_queue_time.record(start - task->queue_time);
+
+            broadcast(std::move(task->header), std::move(task->msg),
+                      task->except, task->shm_except, task->priority);
             delete task;
+
+            m_broadcast_time.record(LinkScheduler::current_time() - start);
         }
     }
 }
 
-void Node::queue_broadcast(std::set<channel_id_t> channels, bitstream &&msg,
+bool Node::assign_topic_channel(message_header_t &header) {
+    if (!header.topic || !header.channels.empty()) {
+        return true;
+    }
+
+    if (!is_valid_topic(*header.topic)) {
+        LOG(ERROR) << "Dropping message on invalid topic \"" << *header.topic
+                   << "\"";
+        return false;
+    }
+
+    header.channels.insert(m_config.topic_channel(*header.topic));
+    return true;
+}
+
+void Node::queue_broadcast(message_header_t header, bitstream &&msg,
                            const std::shared_ptr<Peer> &except) {
-    std::unique_lock lock(m_task_mutex);
+    if (!assign_topic_channel(header)) {
+        return;
+    }
+
+    auto priority = m_config.priority(header.channels);
+    auto task = new Task{{},
+                         std::move(header),
+                         std::move(msg),
+                         except,
+                         nullptr,
+                         priority,
+                         LinkScheduler::current_time()};
+
+    // with sharding, all messages of a peer go to the same worker
+    push_task(except ? except->worker() : 0, task);
+}
+
+void Node::queue_broadcast(message_header_t header, bitstream &&msg,
+                           const std::shared_ptr<ShmEndpoint> &except) {
+    if (!assign_topic_channel(header)) {
+        return;
+    }
+
+    auto priority = m_config.priority(header.channels);
+    auto task = new Task{{},
+                         std::move(header),
+                         std::move(msg),
+                         nullptr,
+                         except,
+                         priority,
+                         LinkScheduler::current_time()};
+
+    push_task(except->worker(), task);
+}
+
+void Node::push_task(size_t worker, Task *task) {
+    auto &queue = *m_task_queues[worker];
+
+    std::unique_lock lock(queue.mutex);
+    queue.tasks[task->priority].push_back(task);
+    queue.condition.notify_one();
+}
+
+void Node::schedule_flush(const std::shared_ptr<Peer> &peer) {
+    std::unique_lock lock(m_flush_mutex);
+    m_flush_peers.push_back(peer);
+    m_flush_condition.notify_one();
+}
+
+void Node::flush_peers() {
+    while (is_valid()) {
+        std::vector<std::weak_ptr<Peer>> peers;
 
-    /* Find a way to do this without locking up all worker threads
-     * while(m_tasks.size() > MAX_QUEUE_LENGTH && is_valid())
         {
-            m_out_condition.wait(lock);
-        }*/
+            std::unique_lock lock(m_flush_mutex);
+            while (is_valid() && m_flush_peers.empty()) {
+                m_flush_condition.wait(lock);
+            }
+
+            peers = std::move(m_flush_peers);
+            m_flush_peers.clear();
+        }
 
-    m_tasks.push_back(new Task{std::move(channels), std::move(msg), except});
-    m_in_condition.notify_one();
+        // give the sockets some time to drain
+        std::this_thread::sleep_for(FLUSH_INTERVAL);
+
+        std::vector<std::weak_ptr<Peer>> pending;
+        for (auto &weak_peer : peers) {
+            auto peer = weak_peer.lock();
+
+            if (peer && peer->flush()) {
+                pending.push_back(peer);
+            }
+        }
+
+        std::unique_lock lock(m_flush_mutex);
+        m_flush_peers.insert(m_flush_peers.end(), pending.begin(),
+                             pending.end());
+    }
 }
 
-void Node::broadcast(std::set<channel_id_t> channels, bitstream &&msg,
-                     const std::shared_ptr<Peer> &except) {
-    // prepend channel id to message
-    msg.move_to(0);
-    msg.make_space(sizeof(uint32_t) + channels.size() * sizeof(channel_id_t));
+void Node::broadcast(message_header_t header, bitstream &&msg,
+                     const std::shared_ptr<Peer> &except,
+                     const std::shared_ptr<ShmEndpoint> &shm_except,
+                     uint32_t priority) {
+    if (!header.id) {
+        header.id = message_id_t{m_node_id, m_next_sequence.fetch_add(1)};
+    }
 
-    msg << channels;
+    // the same message might arrive from more than one upstream relay
+    if (!m_seen_messages.insert(*header.id)) {
+        m_num_duplicates.add();
+        return;
+    }
+
+    if (header.trace && !header.trace->hops.empty()) {
+        header.trace->hops.back().dequeue_time = trace_time();
+    }
+
+    std::optional<conflation_key_t> key;
+    if (header.key && m_config.is_conflating(header.channels)) {
+        key = conflation_key_t{header.channels, *header.key};
+    }
+
+    // prepend channel ids (and trace) to message
+    write_header(msg, header);
+
+    auto &channels = header.channels;
+
+    m_num_messages.add();
+    m_num_bytes.add(msg.size());
+
+    for (auto cid : channels) {
+        if (cid < m_channel_messages.size()) {
+            m_channel_messages[cid].add();
+        }
+    }
 
-    auto hdl = m_message_cache.insert(std::move(channels), std::move(msg));
+    auto hdl = except ? except->store_own_message(m_message_cache,
+                                                  std::move(channels),
+                                                  std::move(msg))
+                      : m_message_cache.insert(std::move(channels),
+                                               std::move(msg));
+
+    m_history.add(hdl.channels(), hdl.position());
+    m_seen_messages.set_position(*header.id, hdl.position());
+
+    // clients only get topics that match one of their patterns
+    std::shared_ptr<const TopicIndex::subscribers_t> topic_clients;
+
+    if (header.topic) {
+        topic_clients = m_topics.match(*header.topic);
+    }
+
+    auto is_topic_client = [&](const void *client) {
+        return !topic_clients || topic_clients->count(client) > 0;
+    };
+
+    std::unique_lock shm_lock(m_shm_mutex);
+    auto shm_clients = m_shm_clients;
+    shm_lock.unlock();
+
+    if (!shm_clients.empty()) {
+        auto data = hdl.data();
+
+        for (auto &c : shm_clients) {
+            if (c != shm_except && c->has_subscription(hdl.channels()) &&
+                is_topic_client(c.get())) {
+                c->send(data.data(), data.size());
+            }
+        }
+    }
 
     std::unique_lock lock(m_peer_mutex);
     std::vector<std::shared_ptr<Peer>> ccopy(m_peers.size());
@@ -231,6 +628,14 @@ void Node::broadcast(std::set<channel_id_t> channels, bitstream &&msg,
     ccopy[0]->message_slicer().prepare_message_raw(data_raw_ptr, data_size);
 
     auto data_ptr = std::shared_ptr<uint8_t[]>(data_raw_ptr);
+    std::shared_ptr<const bitstream> payload;
+
+    // messages from upstream only go downstream, and messages from local
+    // clients only go to one of the upstream relays
+    bool from_upstream = except && except->is_upstream();
+    auto upstream = from_upstream
+                        ? nullptr
+                        : choose_upstream(hdl.channels(), ccopy);
 
     for (auto p : ccopy) {
         if (p == except) {
@@ -238,27 +643,446 @@ void Node::broadcast(std::set<channel_id_t> channels, bitstream &&msg,
             continue;
         }
 
+        if (p->is_upstream() && p != upstream) {
+            continue;
+        }
+
         if (!p->has_subscription(hdl.channels())) {
             continue;
         }
 
-        bool blocking = true;
+        if (!p->is_relay() && !is_topic_client(p.get())) {
+            continue;
+        }
 
-        // Defer writing to socket to the event loop
-        bool async = true;
+        // compressing links need the message without framing
+        if (p->compresses() && !payload) {
+            payload =
+                std::make_shared<const bitstream>(hdl.data().duplicate(true));
+        }
 
         auto ptr_cpy = data_ptr;
-        p->send(std::move(ptr_cpy), data_size, blocking, async);
+        p->send(std::move(ptr_cpy), data_size, priority, key, hdl.position(),
+                payload);
     }
 }
 
-void Node::remove_peer(std::shared_ptr<Peer> peer) {
+void Node::replay_history(const std::shared_ptr<Peer> &peer,
+                          const std::set<channel_id_t> &channels,
+                          uint32_t count) {
+    for (auto position : m_history.recent(channels, count)) {
+        auto hdl = m_message_cache.get_entry(position);
+
+        if (hdl) {
+            peer->resend(*hdl);
+        }
+    }
+}
+
+void Node::replay_history(const std::shared_ptr<ShmEndpoint> &client,
+                          const std::set<channel_id_t> &channels,
+                          uint32_t count) {
+    for (auto position : m_history.recent(channels, count)) {
+        auto hdl = m_message_cache.get_entry(position);
+
+        if (hdl) {
+            auto data = hdl->data();
+            client->send(data.data(), data.size());
+        }
+    }
+}
+
+void Node::fetch_history(const std::set<channel_id_t> &channels,
+                         uint32_t count) {
+    if (channels.empty() || count == 0) {
+        return;
+    }
+
+    std::unique_lock lock(m_peer_mutex);
+    auto peers = m_peers;
+    lock.unlock();
+
+    auto upstream = choose_upstream(channels, peers);
+
+    if (upstream) {
+        upstream->request_history(channels, count);
+    }
+}
+
+bool Node::routes_upstream(const Peer &upstream,
+                           const Storage::entry_handle_t &hdl) {
+    // clients do not set ids, so only messages of local clients
+    // carry the id of this node
+    auto data = hdl.data().duplicate();
+    auto header = read_header(data);
+
+    if (!header.id || header.id->origin != m_node_id) {
+        return false;
+    }
+
+    std::unique_lock lock(m_peer_mutex);
+    auto peers = m_peers;
+    lock.unlock();
+
+    return choose_upstream(hdl.channels(), peers).get() == &upstream;
+}
+
+template <typename Channels>
+std::shared_ptr<Peer>
+Node::choose_upstream(const Channels &channels,
+                      const std::vector<std::shared_ptr<Peer>> &peers) {
+    std::vector<std::shared_ptr<Peer>> upstreams;
+
+    for (auto &p : peers) {
+        if (p->is_upstream() && p->is_connected()) {
+            upstreams.push_back(p);
+        }
+    }
+
+    if (upstreams.empty()) {
+        return nullptr;
+    }
+
+    size_t hash = 0;
+    for (auto cid : channels) {
+        hash = hash * 31 + cid;
+    }
+
+    return upstreams[hash % upstreams.size()];
+}
+
+void Node::fail_over(const std::shared_ptr<Peer> &upstream) {
     std::unique_lock lock(m_peer_mutex);
-    for (auto it = m_peers.begin(); it != m_peers.end(); ++it) {
-        if (*it == peer) {
-            m_peers.erase(it);
+    auto peers = m_peers;
+    lock.unlock();
+
+    // duplicates of messages that did get through are dropped by the
+    // receivers
+    size_t num_resent = 0;
+
+    for (auto position : upstream->recent_positions()) {
+        auto hdl = m_message_cache.get_entry(position);
+
+        if (!hdl) {
+            continue;
+        }
+
+        auto target = choose_upstream(hdl->channels(), peers);
+
+        if (!target) {
+            LOG(ERROR) << "No upstream relay left to fail over to";
             return;
         }
+
+        if (target->has_subscription(hdl->channels())) {
+            target->resend(*hdl);
+            num_resent++;
+        }
+    }
+
+    LOG(INFO) << "Resent " << num_resent
+              << " messages after losing an upstream relay";
+}
+
+void Node::start_metrics(const std::string &path, uint32_t interval) {
+    if (interval == 0) {
+        LOG(FATAL) << "Metrics interval must be at least one second";
+    }
+
+    m_metrics_reporter = std::make_unique<MetricsReporter>(
+        path, interval, [this](MetricsWriter &w) { write_metrics(w); });
+}
+
+void Node::write_metrics(MetricsWriter &writer) {
+    std::vector<size_t> queue_lengths;
+    size_t num_tasks = 0;
+
+    for (auto &queue : m_task_queues) {
+        std::unique_lock lock(queue->mutex);
+        queue_lengths.push_back(queue->size());
+        num_tasks += queue->size();
+    }
+
+    std::unique_lock lock(m_peer_mutex);
+    auto peers = m_peers;
+    lock.unlock();
+
+    writer.gauge("relay_task_queue_length",
+                 "Messages waiting to be broadcast by a worker", num_tasks);
+
+    if (queue_lengths.size() > 1) {
+        for (size_t i = 0; i < queue_lengths.size(); ++i) {
+            writer.gauge("relay_task_queue_shard_length",
+                         "Messages waiting in the queue of one worker",
+                         queue_lengths[i], {{"shard", std::to_string(i)}});
+        }
+    }
+
+    writer.gauge("relay_workers", "Number of worker threads",
+                 m_workers.size());
+    writer.gauge("relay_ready", "Whether all links to other relays are up",
+                 m_ready ? 1 : 0);
+    writer.summary("relay_task_queue_time_us",
+                   "Time messages spent in the task queue", m_queue_time);
+    writer.summary("relay_broadcast_time_us",
+                   "Time it took to store and forward a message",
+                   m_broadcast_time);
+
+    writer.counter("relay_messages_total", "Messages relayed",
+                   m_num_messages.value());
+    writer.counter("relay_bytes_total", "Bytes relayed (including headers)",
+                   m_num_bytes.value());
+    writer.counter("relay_duplicates_total",
+                   "Messages dropped because they were already relayed",
+                   m_num_duplicates.value());
+
+    for (size_t cid = 0; cid < m_channel_messages.size(); ++cid) {
+        auto count = m_channel_messages[cid].value();
+
+        if (count > 0) {
+            writer.counter("relay_channel_messages_total",
+                           "Messages relayed per channel", count,
+                           {{"channel", std::to_string(cid)}});
+        }
+    }
+
+    writer.gauge("relay_link_messages_in_flight",
+                 "Messages travelling over emulated links",
+                 m_link_scheduler.num_pending());
+    writer.gauge("relay_peers", "Number of connected peers", peers.size());
+
+    {
+        std::unique_lock shm_lock(m_shm_mutex);
+        writer.gauge("relay_shm_clients",
+                     "Number of clients connected through shared memory",
+                     m_shm_clients.size());
+    }
+
+    // all samples of a metric have to be grouped together
+    std::vector<MetricsWriter::labels_t> labels;
+    for (auto &p : peers) {
+        labels.push_back(p->metric_labels());
+    }
+
+    for (size_t i = 0; i < peers.size(); ++i) {
+        writer.counter("relay_peer_messages_sent_total",
+                       "Messages sent to a peer",
+                       peers[i]->messages_sent().value(), labels[i]);
+    }
+
+    for (size_t i = 0; i < peers.size(); ++i) {
+        writer.counter("relay_peer_bytes_sent_total", "Bytes sent to a peer",
+                       peers[i]->bytes_sent().value(), labels[i]);
+    }
+
+    for (size_t i = 0; i < peers.size(); ++i) {
+        writer.counter("relay_peer_messages_lost_total",
+                       "Messages dropped by the emulated link",
+                       peers[i]->messages_lost().value(), labels[i]);
+    }
+
+    for (size_t i = 0; i < peers.size(); ++i) {
+        writer.counter("relay_peer_messages_conflated_total",
+                       "Queued messages replaced by a newer value",
+                       peers[i]->messages_conflated().value(), labels[i]);
+    }
+
+    for (size_t i = 0; i < peers.size(); ++i) {
+        writer.counter("relay_peer_compression_saved_bytes_total",
+                       "Bytes saved by compressing messages to a peer",
+                       peers[i]->bytes_saved().value(), labels[i]);
+    }
+
+    for (size_t i = 0; i < peers.size(); ++i) {
+        writer.gauge("relay_peer_send_queue_length",
+                     "Messages queued in front of the socket of a peer",
+                     peers[i]->send_queue_length(), labels[i]);
+    }
+
+    for (size_t i = 0; i < peers.size(); ++i) {
+        writer.gauge("relay_peer_send_queue_bytes",
+                     "Bytes queued in front of the socket of a peer",
+                     peers[i]->send_queue_bytes(), labels[i]);
+    }
+
+    for (size_t i = 0; i < peers.size(); ++i) {
+        writer.gauge("relay_peer_pull_lag",
+                     "Messages a peer in pull mode still has to read",
+                     peers[i]->pull_lag(), labels[i]);
+    }
+
+    for (size_t i = 0; i < peers.size(); ++i) {
+        writer.gauge("relay_peer_link_backlog_bytes",
+                     "Bytes queued in front of the emulated link",
+                     peers[i]->link_backlog(), labels[i]);
+    }
+
+    m_message_cache.write_metrics(writer);
+}
+
+void Node::start_shm(const std::string &name) {
+    m_shm_listener = std::make_unique<ShmListener>(*this, name);
+}
+
+void Node::add_shm_client(std::shared_ptr<ShmEndpoint> client) {
+    std::unique_lock lock(m_shm_mutex);
+    m_shm_clients.push_back(std::move(client));
+    lock.unlock();
+
+    update_interest();
+}
+
+void Node::remove_shm_client(std::shared_ptr<ShmEndpoint> client) {
+    std::unique_lock lock(m_shm_mutex);
+    auto it = std::find(m_shm_clients.begin(), m_shm_clients.end(), client);
+
+    if (it == m_shm_clients.end()) {
+        return;
+    }
+
+    m_shm_clients.erase(it);
+    lock.unlock();
+
+    m_topics.remove(client.get());
+    update_interest();
+}
+
+void Node::update_topics(TopicIndex::subscriber_t client,
+                         const std::set<std::string> &added,
+                         const std::set<std::string> &removed) {
+    m_topics.update(client, added, removed);
+    update_interest();
+}
+
+void Node::remove_peer(std::shared_ptr<Peer> peer) {
+    std::unique_lock lock(m_peer_mutex);
+    auto it = std::find(m_peers.begin(), m_peers.end(), peer);
+
+    if (it == m_peers.end()) {
+        return;
+    }
+
+    m_peers.erase(it);
+    lock.unlock();
+
+    m_topics.remove(peer.get());
+
+    auto key = peer->link_key();
+
+    if (peer->is_relay() && !key.empty()) {
+        std::unique_lock state_lock(m_link_state_mutex);
+        m_link_states[key] =
+            link_state_t{peer->last_received(), peer->unsent_position()};
+    }
+
+    if (peer->is_upstream()) {
+        fail_over(peer);
+    }
+
+    update_interest();
+
+    // we set up this link, so we also bring it back
+    if (peer->is_outbound() && is_valid()) {
+        LOG(INFO) << "Reconnecting to relay at " << *peer->link_address();
+        add_link(peer->name(), *peer->link_address(), peer->is_upstream());
+    }
+}
+
+std::optional<message_id_t> Node::last_received(const std::string &link_key) {
+    std::unique_lock lock(m_link_state_mutex);
+    auto it = m_link_states.find(link_key);
+
+    if (link_key.empty() || it == m_link_states.end()) {
+        return std::nullopt;
+    }
+
+    return it->second.last_received;
+}
+
+void Node::resume_peer(const std::shared_ptr<Peer> &peer,
+                       std::optional<message_id_t> last_received) {
+    std::optional<size_t> start;
+
+    if (last_received) {
+        auto position = m_seen_messages.position(*last_received);
+
+        if (position) {
+            start = *position + 1 - std::min(*position + 1, RESUME_MARGIN);
+        } else {
+            LOG(WARNING) << "Last message peer " << peer->name()
+                         << " received is unknown; resending everything";
+            start = 0;
+        }
+
+        std::unique_lock lock(m_link_state_mutex);
+        auto it = m_link_states.find(peer->link_key());
+
+        if (it != m_link_states.end() && it->second.unsent_position) {
+            start = std::min(*start, *it->second.unsent_position);
+        }
+    } else if (!peer->is_outbound() && !peer->is_edge()) {
+        // a new relay gets everything we have seen so far; edge nodes
+        // fetch the history their clients ask for instead (see
+        // fetch_history), or their clients would get it twice
+        start = 0;
+    }
+
+    if (!start || *start >= m_message_cache.num_entries()) {
+        return;
+    }
+
+    LOG(INFO) << "Resuming link to " << peer->name() << " with "
+              << m_message_cache.num_entries() - *start << " messages";
+
+    peer->pull_from(*start);
+}
+
+std::set<channel_id_t> Node::downstream_interest(const Peer *except) {
+    std::unique_lock lock(m_peer_mutex);
+    auto peers = m_peers;
+    lock.unlock();
+
+    std::unique_lock shm_lock(m_shm_mutex);
+    auto shm_clients = m_shm_clients;
+    shm_lock.unlock();
+
+    std::set<channel_id_t> result;
+
+    for (auto &p : peers) {
+        if (p.get() == except || !p->is_set_up()) {
+            continue;
+        }
+
+        // only what is behind us counts, not what upstream relays want
+        if (p->is_upstream()) {
+            continue;
+        }
+
+        auto subscriptions = p->subscriptions();
+        result.insert(subscriptions.begin(), subscriptions.end());
+    }
+
+    for (auto &c : shm_clients) {
+        auto subscriptions = c->subscriptions();
+        result.insert(subscriptions.begin(), subscriptions.end());
+    }
+
+    return result;
+}
+
+void Node::update_interest() {
+    std::unique_lock interest_lock(m_interest_mutex);
+
+    std::unique_lock lock(m_peer_mutex);
+    auto peers = m_peers;
+    lock.unlock();
+
+    // a relay gets the interest of everybody but itself,
+    // so it does not forward messages back just because it asked for them
+    for (auto &p : peers) {
+        if (p->is_relay()) {
+            p->advertise(downstream_interest(p.get()));
+        }
     }
 }
 
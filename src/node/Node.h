@@ -1,8 +1,12 @@
 #pragma once
 
 #include <bitstream.h>
+#include <chrono>
 #include <condition_variable>
+#include <future>
+#include <atomic>
 #include <list>
+#include <map>
 #include <memory>
 #include <set>
 #include <thread>
@@ -10,45 +14,237 @@
 #include <yael/NetworkSocketListener.h>
 #include <yael/network/Address.h>
 
+#include "DedupFilter.h"
+#include "HistoryCache.h"
+#include "LinkScheduler.h"
 #include "MessageCache.h"
+#include "Metrics.h"
 #include "NetworkConfig.h"
+#include "Pool.h"
+#include "PriorityScheduler.h"
 #include "Storage.h"
+#include "TopicIndex.h"
+#include "common/MessageHeader.h"
 #include "librelay/Connection.h"
 
 namespace relay {
 
 class Peer;
+class ShmEndpoint;
+class ShmListener;
+class SnapshotServer;
+
+struct node_options_t {
+    /// Number of worker threads (0 picks a default based on the core count)
+    uint32_t num_workers = 0;
+
+    /// Give every worker its own task queue and let each peer be served by
+    /// exactly one worker, instead of sharing one queue between all workers
+    bool shard_peers = false;
+
+    /// CPUs the workers are pinned to (round-robin); no pinning if empty
+    std::vector<uint32_t> cpus;
+
+    /// Recent messages per channel that can be replayed to new clients
+    uint32_t history_size = 1000;
+
+    /// Created once all links to other relays are up (disabled if empty)
+    std::string ready_file;
+
+    /// Serve storage snapshots to new relays on this port (0 disables it)
+    uint16_t snapshot_port = 0;
+
+    /// Copy the storage of the relay whose snapshot server is at this
+    /// address ("host:port") before joining the network
+    std::string bootstrap_from;
+};
 
 class Node : public yael::NetworkSocketListener {
   public:
     // Constructor for full nodes
     Node(const std::string &name, const std::string &config_file,
-         uint32_t wait);
+         const node_options_t &options);
 
     // Constructor for edge nodes
-    Node(const std::string &address, const std::string &peer,
-         const std::string &config_file, uint32_t wait);
+    // Messages from clients are spread over all reachable upstream relays
+    Node(const std::string &address, const std::vector<std::string> &upstreams,
+         const std::string &config_file, const node_options_t &options);
 
     ~Node();
 
     void remove_peer(std::shared_ptr<Peer> peer);
 
-    void queue_broadcast(std::set<channel_id_t> channels, bitstream &&msg,
-                         const std::shared_ptr<Peer> &excpet);
+    /// Union of the subscriptions of all clients and relays except one
+    std::set<channel_id_t> downstream_interest(const Peer *except);
+
+    /// Advertise changed interest to all relay peers
+    /// Must be called whenever a subscription changes or a peer goes away
+    void update_interest();
+
+    LinkScheduler &link_scheduler() { return m_link_scheduler; }
+
+    Storage &message_cache() { return m_message_cache; }
+
+    const NetworkConfig &config() const { return m_config; }
+
+    /// Periodically write metrics to the specified file
+    /// @param interval the dump interval in seconds
+    void start_metrics(const std::string &path, uint32_t interval);
+
+    /// Pick the task queue for a new peer
+    size_t assign_worker();
+
+    /// Are all links to other relays established?
+    bool is_ready() const { return m_ready; }
+
+    /// Accept clients on this host through shared memory
+    /// They connect with the address "shm://<name>"
+    void start_shm(const std::string &name);
+
+    void add_shm_client(std::shared_ptr<ShmEndpoint> client);
+    void remove_shm_client(std::shared_ptr<ShmEndpoint> client);
+
+    /// Change the topic patterns of a client (a Peer or ShmEndpoint)
+    void update_topics(TopicIndex::subscriber_t client,
+                       const std::set<std::string> &added,
+                       const std::set<std::string> &removed);
+
+    void queue_broadcast(message_header_t header, bitstream &&msg,
+                         const std::shared_ptr<Peer> &except);
+
+    void queue_broadcast(message_header_t header, bitstream &&msg,
+                         const std::shared_ptr<ShmEndpoint> &except);
+
+    /// Retry sending the queued messages of a peer until they are all sent
+    void schedule_flush(const std::shared_ptr<Peer> &peer);
+
+    /// Replay recent messages on the channels from the history cache
+    void replay_history(const std::shared_ptr<Peer> &peer,
+                        const std::set<channel_id_t> &channels,
+                        uint32_t count);
+
+    void replay_history(const std::shared_ptr<ShmEndpoint> &client,
+                        const std::set<channel_id_t> &channels,
+                        uint32_t count);
+
+    /// The last message received over a link before it went down
+    std::optional<message_id_t> last_received(const std::string &link_key);
+
+    /// Catch up a relay on what it missed while its link was down
+    /// @param last_received the last message it got from us (if any)
+    void resume_peer(const std::shared_ptr<Peer> &peer,
+                     std::optional<message_id_t> last_received);
+
+    /// Ask an upstream relay for the history of channels this node has not
+    /// been receiving
+    /// The replies are forwarded like any other message from upstream
+    void fetch_history(const std::set<channel_id_t> &channels,
+                       uint32_t count);
+
+    /// Should an upstream relay get a message that it pulls from storage?
+    /// Follows the routing of broadcast: messages that came from upstream
+    /// are not sent back, and the others only go to the upstream relay
+    /// their channels map to
+    bool routes_upstream(const Peer &upstream,
+                         const Storage::entry_handle_t &hdl);
 
   private:
-    struct Task {
-        std::set<channel_id_t> channels;
+    struct Task : PoolAllocated<Task> {
+        message_header_t header;
         bitstream msg;
         std::shared_ptr<Peer> except;
+        std::shared_ptr<ShmEndpoint> shm_except;
+        uint32_t priority;
+
+        /// When the task was queued (in microseconds)
+        uint64_t queue_time;
     };
 
-    void work();
+    /// Broadcast tasks of all peers assigned to the same queue
+    /// Tasks are kept in one list per priority class
+    struct task_queue_t {
+        explicit task_queue_t(const NetworkConfig &config)
+            : tasks(config.num_priorities()), scheduler(config) {}
+
+        /// Remove the next task (or return nullptr if there is none)
+        /// Must be called while holding the mutex
+        Task *pop();
 
-    void broadcast(std::set<channel_id_t> channel, bitstream &&msg,
-                   const std::shared_ptr<Peer> &except);
+        size_t size() const;
 
-    void connect(const std::string &name, const yael::network::Address &addr);
+        std::mutex mutex;
+        std::condition_variable_any condition;
+        std::vector<std::list<Task *, PoolAllocator<Task *>>> tasks;
+        PriorityScheduler scheduler;
+    };
+
+    void write_metrics(MetricsWriter &writer);
+
+    /// An outgoing connection to another relay
+    struct link_t {
+        std::string name;
+        yael::network::Address address;
+        bool upstream;
+
+        /// Failed attempts so far
+        uint32_t attempts;
+        std::chrono::steady_clock::time_point next_attempt;
+    };
+
+    void start_workers(size_t default_count);
+
+    /// Connect to a relay in the background, retrying until it is up
+    void add_link(const std::string &name, const yael::network::Address &addr,
+                  bool upstream);
+
+    /// Works through pending links with exponential backoff
+    void connect_links();
+
+    /// Try to connect once; requeues the link if that fails
+    void attempt_link(link_t link);
+
+    void set_ready();
+
+    /// Adopt the storage of another relay, so links only need to resume
+    /// from the end of it
+    void bootstrap(const std::string &address);
+
+    /// What is needed to resume a link once it comes back
+    struct link_state_t {
+        std::optional<message_id_t> last_received;
+        std::optional<size_t> unsent_position;
+    };
+
+    void work(size_t index);
+
+    /// Periodically flushes peers that have queued messages
+    void flush_peers();
+
+    void broadcast(message_header_t header, bitstream &&msg,
+                   const std::shared_ptr<Peer> &except,
+                   const std::shared_ptr<ShmEndpoint> &shm_except,
+                   uint32_t priority);
+
+    void push_task(size_t worker, Task *task);
+
+    /// The first relay maps the topic of a message to its channel
+    /// @return false if the topic is invalid
+    bool assign_topic_channel(message_header_t &header);
+
+    /// @return false if the peer could not be reached
+    bool connect(const std::string &name, const yael::network::Address &addr,
+                 bool upstream = false);
+
+    /// Pick the upstream relay for a message from a local client
+    /// All messages on the same channels take the same upstream to keep
+    /// them in order
+    template <typename Channels>
+    std::shared_ptr<Peer>
+    choose_upstream(const Channels &channels,
+                    const std::vector<std::shared_ptr<Peer>> &peers);
+
+    /// Resend the messages that might have been lost with an upstream relay
+    void fail_over(const std::shared_ptr<Peer> &upstream);
 
     void
     on_new_connection(std::unique_ptr<yael::network::Socket> &&socket) override;
@@ -56,16 +252,67 @@ class Node : public yael::NetworkSocketListener {
     std::mutex m_peer_mutex;
     std::vector<std::shared_ptr<Peer>> m_peers;
 
-    std::mutex m_task_mutex;
-    std::list<Task *> m_tasks;
+    /// Serializes subscription advertisements
+    std::mutex m_interest_mutex;
+
+    std::mutex m_shm_mutex;
+    std::vector<std::shared_ptr<ShmEndpoint>> m_shm_clients;
+    std::unique_ptr<ShmListener> m_shm_listener;
+
+    std::unique_ptr<SnapshotServer> m_snapshot_server;
+
+    const node_options_t m_options;
+
+    std::vector<std::unique_ptr<task_queue_t>> m_task_queues;
+    std::atomic<size_t> m_next_queue = 0;
     std::vector<std::thread> m_workers;
 
-    std::condition_variable_any m_in_condition;
-    std::condition_variable_any m_out_condition;
+    std::mutex m_flush_mutex;
+    std::condition_variable_any m_flush_condition;
+    std::vector<std::weak_ptr<Peer>> m_flush_peers;
+    std::thread m_flush_thread;
+
+    std::mutex m_link_mutex;
+    std::condition_variable_any m_link_condition;
+    std::vector<link_t> m_pending_links;
+    std::thread m_connect_thread;
+
+    /// One per link that is currently connecting
+    std::list<std::future<void>> m_connect_attempts;
+    size_t m_num_connecting = 0;
+    std::atomic<bool> m_ready = false;
+
+    std::mutex m_link_state_mutex;
+    std::map<std::string, link_state_t> m_link_states;
 
     const NetworkConfig m_config;
 
     Storage m_message_cache;
+
+    LinkScheduler m_link_scheduler;
+
+    /// Identifies messages that originate at this node
+    const uint64_t m_node_id;
+    std::atomic<uint64_t> m_next_sequence = 0;
+
+    DedupFilter m_seen_messages;
+
+    /// Serves catch-up for new clients
+    HistoryCache m_history;
+
+    /// Decides which clients get a message on a topic
+    TopicIndex m_topics;
+
+    Counter m_num_duplicates;
+    Counter m_num_messages;
+    Counter m_num_bytes;
+    std::vector<Counter> m_channel_messages;
+
+    Histogram m_queue_time;
+    Histogram m_broadcast_time;
+
+    // declared last, so it is destroyed before everything it reports on
+    std::unique_ptr<MetricsReporter> m_metrics_reporter;
 };
 
 } // namespace relay
@@ -1,8 +1,14 @@
 #include "Peer.h"
+#include "LinkScheduler.h"
 #include "Node.h"
+#include "common/MessageHeader.h"
 #include "common/defines.h"
 
+#include <algorithm>
+#include <iterator>
+#include <sstream>
 #include <stdbitstream.h>
+#include <stdexcept>
 #include <yael/network/TcpSocket.h>
 
 namespace relay {
@@ -11,72 +17,666 @@ Peer::Peer(std::unique_ptr<yael::network::Socket> &&socket, Node &node,
            const NetworkConfig &config)
     : DelayedNetworkSocketListener(0, std::move(socket),
                                    yael::SocketType::Connection),
-      m_node(node), m_config(config) {
-    std::set<channel_id_t> subscriptions;
-    for (uint32_t i = 0; i < m_config.num_channels(); ++i) {
-        subscriptions.insert(i);
-    }
-
-    bitstream hello;
-    hello << m_config.local_name() << subscriptions;
-
-    send(hello.data(), hello.size());
+      m_node(node), m_config(config),
+      m_worker(node.assign_worker()), m_send_queue(config) {
+    send_hello();
 }
 
 Peer::Peer(const yael::network::Address &addr, Node &node,
-           const NetworkConfig &config, const std::string &name)
-    : DelayedNetworkSocketListener(0), m_node(node), m_config(config) {
+           const NetworkConfig &config, const std::string &name,
+           bool upstream)
+    : DelayedNetworkSocketListener(0), m_node(node), m_config(config),
+      m_worker(node.assign_worker()), m_upstream(upstream),
+      m_link_address(addr), m_send_queue(config) {
     using yael::network::MessageMode;
     using yael::network::TcpSocket;
 
     auto s = std::make_unique<TcpSocket>(MessageMode::Datagram, MAX_SEND_QUEUE);
     bool res = s->connect(addr);
 
-    if (res) {
-        LOG(INFO) << "Connected to peer " << name << " @" << addr;
-    } else {
-        LOG(FATAL) << "Connection to peer " << name << " @" << addr
-                   << " failed";
+    if (!res) {
+        std::ostringstream err;
+        err << "Connection to peer " << name << " @" << addr << " failed";
+        throw std::runtime_error(err.str());
     }
 
+    LOG(INFO) << "Connected to peer " << name << " @" << addr;
+
     set_socket(std::move(s), yael::SocketType::Connection);
     set_name(name);
 
-    std::set<channel_id_t> subscriptions;
-    for (uint32_t i = 0; i < m_config.num_channels(); ++i) {
-        subscriptions.insert(i);
-    }
+    send_hello();
+}
+
+void Peer::send_hello() {
+    // only ask for what somebody behind us is interested in
+    m_advertised = m_node.downstream_interest(this);
 
     bitstream hello;
-    hello << m_config.local_name() << subscriptions;
+    hello << m_config.local_name() << m_advertised;
 
     send(hello.data(), hello.size());
 }
 
+void Peer::send_resume() {
+    message_header_t header;
+    header.resume = true;
+    header.id = m_node.last_received(link_key());
+
+    bitstream resume;
+    write_header(resume, header);
+
+    try {
+        send(resume.data(), resume.size());
+    } catch (const yael::network::socket_error &e) {
+        LOG(ERROR) << "Failed to send resume request " << e.what();
+    }
+}
+
+std::string Peer::link_key() const {
+    if (m_link_address) {
+        std::ostringstream key;
+        key << *m_link_address;
+        return key.str();
+    }
+
+    // edge nodes and clients cannot be told apart when they reconnect
+    if (m_name.empty() || m_name == "\n" || m_name == CLIENT_NAME) {
+        return "";
+    }
+
+    return m_name;
+}
+
+void Peer::advertise(const std::set<channel_id_t> &interest) {
+    std::set<channel_id_t> added, removed;
+
+    std::set_difference(interest.begin(), interest.end(),
+                        m_advertised.begin(), m_advertised.end(),
+                        std::inserter(added, added.end()));
+    std::set_difference(m_advertised.begin(), m_advertised.end(),
+                        interest.begin(), interest.end(),
+                        std::inserter(removed, removed.end()));
+
+    if (added.empty() && removed.empty()) {
+        return;
+    }
+
+    m_advertised = interest;
+
+    message_header_t header;
+    header.subscription_update = true;
+
+    bitstream update;
+    update << added << removed;
+    write_header(update, header);
+
+    try {
+        send(update.data(), update.size());
+    } catch (const yael::network::socket_error &e) {
+        LOG(ERROR) << "Failed to send subscription update " << e.what();
+    }
+}
+
+void Peer::request_history(const std::set<channel_id_t> &channels,
+                           uint32_t count) {
+    message_header_t header;
+    header.channels = channels;
+    header.history_request = true;
+
+    bitstream request;
+    request << count;
+    write_header(request, header);
+
+    try {
+        send(request.data(), request.size());
+    } catch (const yael::network::socket_error &e) {
+        LOG(ERROR) << "Failed to send history request " << e.what();
+    }
+}
+
+void Peer::on_subscription_update(bitstream &input) {
+    std::set<channel_id_t> added, removed;
+    input >> added >> removed;
+
+    {
+        std::unique_lock lock(m_subscription_mutex);
+
+        for (auto cid : added) {
+            m_subscriptions.insert(cid);
+        }
+
+        for (auto cid : removed) {
+            m_subscriptions.erase(cid);
+        }
+    }
+
+    m_node.update_interest();
+}
+
+void Peer::on_topic_subscription(bitstream &input) {
+    std::set<std::string> added, removed;
+    read_topic_update(input, added, removed);
+
+    {
+        std::unique_lock lock(m_subscription_mutex);
+
+        for (auto &pattern : removed) {
+            m_topic_patterns.erase(pattern);
+        }
+
+        m_topic_patterns.insert(added.begin(), added.end());
+        m_topic_channels = m_config.topic_channels(m_topic_patterns);
+    }
+
+    m_node.update_topics(this, added, removed);
+}
+
 void Peer::on_network_message(yael::network::message_in_t &msg) {
     bitstream input;
     input.assign(msg.data, msg.length, false);
 
     if (!m_set_up) {
         std::string name;
-        input >> name >> m_subscriptions;
+        std::set<channel_id_t> subscriptions;
+        uint32_t history = 0;
+
+        input >> name >> subscriptions;
+
+        // only clients ask for history
+        if (!input.at_end()) {
+            input >> history;
+        }
+
+        // this node did not receive channels nobody else subscribed to,
+        // so their history has to come from upstream
+        std::set<channel_id_t> missing;
+
+        if (history > 0) {
+            auto interest = m_node.downstream_interest(this);
+            std::set_difference(subscriptions.begin(), subscriptions.end(),
+                                interest.begin(), interest.end(),
+                                std::inserter(missing, missing.end()));
+        }
+
+        {
+            std::unique_lock lock(m_subscription_mutex);
+            m_subscriptions = subscriptions;
+        }
 
         if (m_name.empty()) {
             set_name(name);
         }
 
         m_set_up = true;
+
+        m_node.update_interest();
+
+        if (is_relay()) {
+            send_resume();
+        }
+
+        if (history > 0) {
+            auto self = std::dynamic_pointer_cast<Peer>(shared_from_this());
+            m_node.replay_history(self, subscriptions, history);
+            m_node.fetch_history(missing, history);
+        }
+        return;
+    }
+
+    on_message(std::move(input));
+}
+
+void Peer::on_message(bitstream &&input) {
+    auto header = read_header(input);
+
+    if (header.compressed) {
+        on_compressed_frame(input);
+        return;
+    }
+
+    if (header.subscription_update) {
+        on_subscription_update(input);
+        return;
+    }
+
+    if (header.topic_subscription) {
+        on_topic_subscription(input);
+        return;
+    }
+
+    if (header.resume) {
+        auto self = std::dynamic_pointer_cast<Peer>(shared_from_this());
+        m_node.resume_peer(self, header.id);
+        return;
+    }
+
+    if (header.id) {
+        std::unique_lock lock(m_resume_mutex);
+        m_last_received = header.id;
+    }
+
+    if (header.history_request) {
+        uint32_t count = 0;
+        input >> count;
+
+        auto self = std::dynamic_pointer_cast<Peer>(shared_from_this());
+        m_node.replay_history(self, header.channels, count);
         return;
     }
 
-    std::set<channel_id_t> channels;
-    input >> channels;
-    input.move_to(0);
-    input.remove_space(sizeof(uint32_t) +
-                       channels.size() * sizeof(channel_id_t));
+    if (header.trace && header.trace->hops.size() < MAX_TRACE_HOPS) {
+        // dequeue time is set once a worker picks up the message
+        header.trace->hops.push_back(hop_trace_t{trace_time(), 0});
+    }
 
     auto except = std::dynamic_pointer_cast<Peer>(shared_from_this());
-    m_node.queue_broadcast(channels, std::move(input), except);
+    m_node.queue_broadcast(std::move(header), std::move(input), except);
+}
+
+void Peer::on_compressed_frame(bitstream &input) {
+    std::vector<bitstream> messages;
+
+    try {
+        messages = decompress_frame(input);
+    } catch (const std::exception &e) {
+        LOG(ERROR) << "Failed to decompress messages from peer " << m_name
+                   << ": " << e.what();
+        return;
+    }
+
+    for (auto &msg : messages) {
+        on_message(std::move(msg));
+    }
+}
+
+MetricsWriter::labels_t Peer::metric_labels() {
+    std::ostringstream addr;
+    addr << socket().get_remote_address();
+
+    return {{"peer", m_name == "\n" ? "edge" : m_name},
+            {"address", addr.str()}};
+}
+
+void Peer::send(std::shared_ptr<uint8_t[]> &&data, uint32_t length,
+                uint32_t priority, std::optional<conflation_key_t> key,
+                size_t position, std::shared_ptr<const bitstream> payload) {
+    SendQueue::message_t msg = {std::move(data), length, std::move(key),
+                                position, std::move(payload)};
+
+    // hold the lock while dispatching to keep messages in order
+    std::unique_lock lock(m_queue_mutex);
+    remember_position(position);
+
+    if (is_pulled(position)) {
+        return;
+    }
+
+    if (m_pulling && position >= m_pull_position) {
+        // stored before pulling started, but not pushed to us yet
+        m_unsent.insert(position);
+        return;
+    }
+
+    enqueue(priority, std::move(msg), lock);
+}
+
+void Peer::remember_position(size_t position) {
+    if (!m_upstream) {
+        return;
+    }
+
+    m_recent_positions.push_back(position);
+
+    if (m_recent_positions.size() > RESEND_WINDOW) {
+        m_recent_positions.pop_front();
+    }
+}
+
+void Peer::enqueue(uint32_t priority, SendQueue::message_t &&msg,
+                   std::unique_lock<std::mutex> &lock) {
+    if (m_send_queue.empty() && output_backlog() < SEND_WATERMARK) {
+        dispatch(std::move(msg));
+        return;
+    }
+
+    if (!m_send_queue.push(priority, std::move(msg))) {
+        m_messages_conflated.add();
+    }
+
+    if (!m_pulling && m_send_queue.num_bytes() > PULL_THRESHOLD) {
+        LOG(INFO) << "Peer " << m_name << " fell behind";
+
+        // the queued messages will be read from storage again, but not
+        // those that were sent already or came from this peer
+        auto unsent = m_send_queue.positions();
+        auto start = *unsent.begin();
+
+        start_pulling(start, m_node.message_cache().num_entries(),
+                      std::move(unsent));
+    }
+
+    schedule_flush(lock);
+}
+
+void Peer::schedule_flush(std::unique_lock<std::mutex> &lock) {
+    if (m_flush_scheduled) {
+        return;
+    }
+
+    m_flush_scheduled = true;
+    lock.unlock();
+
+    auto self = std::dynamic_pointer_cast<Peer>(shared_from_this());
+    m_node.schedule_flush(self);
+}
+
+bool Peer::flush() {
+    std::unique_lock lock(m_queue_mutex);
+
+    if (!is_connected()) {
+        // a resumed link starts with what is dropped here
+        if (!m_dropped_position) {
+            m_dropped_position = pending_position();
+        }
+
+        m_send_queue.clear();
+        m_pulling = false;
+        m_unsent.clear();
+        m_own_messages.clear();
+    }
+
+    // queued messages are older than everything left to pull
+    while (output_backlog() < SEND_WATERMARK) {
+        if (!m_send_queue.empty()) {
+            dispatch_queued();
+        } else if (!m_pulling || !pull_next()) {
+            break;
+        }
+    }
+
+    m_flush_scheduled = m_pulling || !m_send_queue.empty();
+    return m_flush_scheduled;
+}
+
+void Peer::start_pulling(size_t position, size_t end,
+                         std::set<size_t> &&unsent) {
+    m_pull_start = position;
+    m_pull_position = m_pull_start;
+    m_pull_end = end;
+    m_unsent = std::move(unsent);
+    m_pulling = true;
+
+    m_send_queue.clear();
+
+    LOG(INFO) << "Peer " << m_name << " is pulling from position "
+              << m_pull_start;
+}
+
+void Peer::pull_from(size_t position) {
+    std::unique_lock lock(m_queue_mutex);
+
+    // never skip what is queued or still to be pulled
+    auto queued = m_send_queue.min_position();
+
+    if (queued) {
+        position = std::min(position, *queued);
+    }
+
+    if (m_pulling) {
+        position = std::min(position, m_pull_position);
+    }
+
+    // a resumed link gets everything from position again
+    start_pulling(position, position, {});
+    schedule_flush(lock);
+}
+
+std::optional<size_t> Peer::unsent_position() {
+    std::unique_lock lock(m_queue_mutex);
+
+    if (m_dropped_position) {
+        return m_dropped_position;
+    }
+
+    return pending_position();
+}
+
+std::optional<size_t> Peer::pending_position() const {
+    auto queued = m_send_queue.min_position();
+
+    if (m_pulling && (!queued || m_pull_position < *queued)) {
+        return m_pull_position;
+    }
+
+    return queued;
+}
+
+bool Peer::pull_next() {
+    auto &storage = m_node.message_cache();
+
+    while (true) {
+        if (m_pull_position < m_pull_end) {
+            // skip what was sent before pulling started
+            m_pull_position = m_unsent.empty() ? m_pull_end : *m_unsent.begin();
+        }
+
+        if (m_pull_position >= storage.num_entries()) {
+            LOG(INFO) << "Peer " << m_name << " caught up at position "
+                      << m_pull_position;
+
+            m_pulling = false;
+            m_own_messages.clear();
+            return false;
+        }
+
+        auto hdl = storage.get_entry(m_pull_position);
+
+        if (!hdl) {
+            // the entry is still being inserted
+            return false;
+        }
+
+        auto position = m_pull_position++;
+        m_unsent.erase(position);
+
+        if (m_own_messages.erase(position) > 0 ||
+            !has_subscription(hdl->channels())) {
+            continue;
+        }
+
+        if (m_upstream && !m_node.routes_upstream(*this, *hdl)) {
+            continue;
+        }
+
+        auto cpy = hdl->data().duplicate(true);
+        uint8_t *data_ptr;
+        uint32_t data_size;
+
+        std::shared_ptr<const bitstream> payload;
+
+        if (m_compressor) {
+            payload = std::make_shared<const bitstream>(cpy.duplicate(true));
+        }
+
+        cpy.detach(data_ptr, data_size);
+        message_slicer().prepare_message_raw(data_ptr, data_size);
+
+        dispatch(SendQueue::message_t{std::shared_ptr<uint8_t[]>(data_ptr),
+                                      data_size, std::nullopt, position,
+                                      std::move(payload)});
+        return true;
+    }
+}
+
+void Peer::resend(const Storage::entry_handle_t &hdl) {
+    auto cpy = hdl.data().duplicate(true);
+    uint8_t *data_ptr;
+    uint32_t data_size;
+
+    std::shared_ptr<const bitstream> payload;
+
+    if (compresses()) {
+        payload = std::make_shared<const bitstream>(cpy.duplicate(true));
+    }
+
+    cpy.detach(data_ptr, data_size);
+    message_slicer().prepare_message_raw(data_ptr, data_size);
+
+    SendQueue::message_t msg = {std::shared_ptr<uint8_t[]>(data_ptr),
+                                data_size, std::nullopt, hdl.position(),
+                                std::move(payload)};
+
+    // explicit resends are sent even if pulling passed their position
+    std::unique_lock lock(m_queue_mutex);
+    remember_position(msg.position);
+    enqueue(m_config.priority(hdl.channels()), std::move(msg), lock);
+}
+
+Storage::entry_handle_t Peer::store_own_message(Storage &storage,
+                                                std::set<channel_id_t> channels,
+                                                bitstream &&msg) {
+    // pulling happens while holding the lock,
+    // so the message cannot be read before it is marked
+    std::unique_lock lock(m_queue_mutex);
+
+    auto hdl = storage.insert(std::move(channels), std::move(msg));
+
+    // messages stored before pulling started are below m_pull_end
+    // and not in m_unsent, so they are skipped anyway
+    if (m_pulling) {
+        m_own_messages.insert(hdl.position());
+    }
+
+    return hdl;
+}
+
+size_t Peer::pull_lag() {
+    std::unique_lock lock(m_queue_mutex);
+
+    if (!m_pulling) {
+        return 0;
+    }
+
+    return m_node.message_cache().num_entries() - m_pull_position;
+}
+
+uint64_t Peer::output_backlog() {
+    auto now = LinkScheduler::current_time();
+    return m_link.backlog(now) + socket().send_queue_size();
+}
+
+void Peer::dispatch(SendQueue::message_t &&msg) {
+    if (m_compressor) {
+        std::vector<SendQueue::message_t> batch;
+        batch.push_back(std::move(msg));
+        dispatch(std::move(batch));
+        return;
+    }
+
+    send_frame(std::move(msg.data), msg.length, 1);
+}
+
+void Peer::dispatch(std::vector<SendQueue::message_t> &&batch) {
+    std::vector<LinkCompressor::payload_t> payloads;
+    uint64_t raw_size = 0;
+
+    for (auto &msg : batch) {
+        if (!msg.payload) {
+            // sent before the link was configured
+            break;
+        }
+
+        payloads.push_back({msg.payload->data(), msg.payload->size()});
+        raw_size += msg.length;
+    }
+
+    if (m_compressor && payloads.size() == batch.size()) {
+        if (auto frame = m_compressor->compress(payloads)) {
+            uint8_t *data_ptr;
+            uint32_t data_size;
+
+            frame->detach(data_ptr, data_size);
+            message_slicer().prepare_message_raw(data_ptr, data_size);
+
+            if (data_size < raw_size) {
+                m_bytes_saved.add(raw_size - data_size);
+            }
+
+            send_frame(std::shared_ptr<uint8_t[]>(data_ptr), data_size,
+                       batch.size());
+            return;
+        }
+    }
+
+    for (auto &msg : batch) {
+        send_frame(std::move(msg.data), msg.length, 1);
+    }
+}
+
+void Peer::dispatch_queued() {
+    auto batch_size = m_compressor ? m_compressor->batch_size() : 1;
+
+    if (batch_size <= 1) {
+        dispatch(m_send_queue.pop());
+        return;
+    }
+
+    // compressing queued messages together saves more bandwidth, and
+    // messages only queue up when the link is busy
+    std::vector<SendQueue::message_t> batch;
+
+    while (batch.size() < batch_size && !m_send_queue.empty()) {
+        batch.push_back(m_send_queue.pop());
+    }
+
+    dispatch(std::move(batch));
+}
+
+void Peer::send_frame(std::shared_ptr<uint8_t[]> &&data, uint32_t length,
+                      size_t num_messages) {
+    m_messages_sent.add(num_messages);
+    m_bytes_sent.add(length);
+
+    if (!m_link.is_emulated()) {
+        // Defer writing to socket to the event loop
+        bool blocking = true;
+        bool async = true;
+
+        DelayedNetworkSocketListener::send(std::move(data), length, blocking,
+                                           async);
+        return;
+    }
+
+    auto now = LinkScheduler::current_time();
+    auto release_time = m_link.release_time(length, now);
+
+    if (!release_time) {
+        // message got lost on the link
+        m_messages_lost.add(num_messages);
+        return;
+    }
+
+    auto self = std::dynamic_pointer_cast<Peer>(shared_from_this());
+    m_node.link_scheduler().schedule(*release_time, self, std::move(data),
+                                     length);
+}
+
+void Peer::transmit(std::shared_ptr<uint8_t[]> &&data, uint32_t length) {
+    if (!is_connected()) {
+        return;
+    }
+
+    // the scheduler thread must never wait on the socket
+    bool blocking = false;
+    bool async = true;
+
+    try {
+        DelayedNetworkSocketListener::send(std::move(data), length, blocking,
+                                           async);
+    } catch (const yael::network::socket_error &e) {
+        LOG(ERROR) << "Failed to send message to peer " << e.what();
+    }
 }
 
 void Peer::on_disconnect() {
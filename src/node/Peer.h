@@ -1,9 +1,22 @@
 #pragma once
 
+#include <atomic>
+#include <deque>
+#include <mutex>
+#include <optional>
 #include <set>
+#include <shared_mutex>
 #include <yael/DelayedNetworkSocketListener.h>
 
+#include "LinkCompressor.h"
+#include "LinkModel.h"
+#include "LinkScheduler.h"
+#include "Metrics.h"
 #include "NetworkConfig.h"
+#include "SendQueue.h"
+#include "Storage.h"
+#include "common/MessageHeader.h"
+#include "common/defines.h"
 #include "librelay/Connection.h"
 
 namespace relay {
@@ -15,25 +28,163 @@ class Peer : public yael::DelayedNetworkSocketListener {
     Peer(std::unique_ptr<yael::network::Socket> &&socket, Node &node,
          const NetworkConfig &config);
 
+    /// Connect to another relay
+    /// Throws std::runtime_error if the connection fails
+    ///
+    /// @param upstream is the peer one of the upstream relays of an edge node?
     Peer(const yael::network::Address &addr, Node &node,
-         const NetworkConfig &config, const std::string &name);
+         const NetworkConfig &config, const std::string &name,
+         bool upstream = false);
 
     const std::string &name() const { return m_name; }
 
+    /// The task queue that broadcasts messages received from this peer
+    size_t worker() const { return m_worker; }
+
+    using DelayedNetworkSocketListener::send;
+
+    /// Send a prepared message to this peer
+    ///
+    /// Messages are queued by priority class while the socket (or emulated
+    /// link) already holds more than SEND_WATERMARK bytes
+    ///
+    /// Peers that fall behind by more than PULL_THRESHOLD bytes switch to
+    /// pull mode, where they read forward through the storage log as their
+    /// socket drains, until they caught up
+    ///
+    /// @param key if set, replaces a queued message with the same key
+    /// @param position the position of the message in storage
+    /// @param payload the message without framing, if the link compresses
+    void send(std::shared_ptr<uint8_t[]> &&data, uint32_t length,
+              uint32_t priority, std::optional<conflation_key_t> key,
+              size_t position, std::shared_ptr<const bitstream> payload);
+
+    /// Does the link to this peer compress messages?
+    /// Messages then have to be sent with their payload
+    bool compresses() const { return m_compresses; }
+
+    /// Send a message from storage again
+    void resend(const Storage::entry_handle_t &hdl);
+
+    /// Storage positions of the messages most recently sent to an upstream
+    /// relay, which may have been lost if the connection failed
+    std::vector<size_t> recent_positions() {
+        std::unique_lock lock(m_queue_mutex);
+        return {m_recent_positions.begin(), m_recent_positions.end()};
+    }
+
+    /// Read forward through storage starting at position
+    /// Used to catch up a re-established link
+    void pull_from(size_t position);
+
+    /// The oldest message that was still waiting to be sent (if any)
+    std::optional<size_t> unsent_position();
+
+    /// The last message received from this peer
+    std::optional<message_id_t> last_received() {
+        std::unique_lock lock(m_resume_mutex);
+        return m_last_received;
+    }
+
+    /// Did we connect to this peer (rather than it to us)?
+    bool is_outbound() const { return m_link_address.has_value(); }
+
+    const std::optional<yael::network::Address> &link_address() const {
+        return m_link_address;
+    }
+
+    /// Identifies the link across reconnects
+    /// Empty if the link cannot be resumed (e.g. for clients)
+    std::string link_key() const;
+
+    /// Store a message that was received from this peer
+    /// Makes sure the message is never pulled and sent back to the peer
+    Storage::entry_handle_t store_own_message(Storage &storage,
+                                              std::set<channel_id_t> channels,
+                                              bitstream &&msg);
+
+    /// Move queued messages to the socket while there is room
+    /// @return true if messages are still waiting
+    bool flush();
+
+    /// Hand a message to the socket once it reached the end of the link
+    /// Only used by the LinkScheduler
+    void transmit(std::shared_ptr<uint8_t[]> &&data, uint32_t length);
+
     bool is_set_up() const { return m_set_up; }
 
-    bool has_subscription(const std::set<channel_id_t> &channels) {
+    /// Identifies the peer in metrics
+    MetricsWriter::labels_t metric_labels();
+
+    Counter &messages_sent() { return m_messages_sent; }
+    Counter &bytes_sent() { return m_bytes_sent; }
+    Counter &messages_lost() { return m_messages_lost; }
+    Counter &messages_conflated() { return m_messages_conflated; }
+    Counter &bytes_saved() { return m_bytes_saved; }
+
+    /// Messages waiting in front of the socket
+    size_t send_queue_length() {
+        std::unique_lock lock(m_queue_mutex);
+        return m_send_queue.size();
+    }
+
+    /// Bytes waiting in front of the socket
+    uint64_t send_queue_bytes() {
+        std::unique_lock lock(m_queue_mutex);
+        return m_send_queue.num_bytes();
+    }
+
+    /// Number of storage entries a pulling peer still has to read
+    size_t pull_lag();
+
+    /// Bytes that queue in front of the emulated link
+    uint64_t link_backlog() {
+        return m_link.backlog(LinkScheduler::current_time());
+    }
+
+    /// Is this another relay (or edge node) rather than a client?
+    bool is_relay() const { return is_set_up() && m_name != CLIENT_NAME; }
+
+    bool is_upstream() const { return m_upstream; }
+
+    /// Is this an edge node (rather than a relay or client)?
+    bool is_edge() const { return is_set_up() && m_name == "\n"; }
+
+    /// The channels of a client (including those its topics map to) or the
+    /// advertised interest of a relay
+    std::set<channel_id_t> subscriptions() {
+        std::shared_lock lock(m_subscription_mutex);
+
+        auto result = m_subscriptions;
+        result.insert(m_topic_channels.begin(), m_topic_channels.end());
+        return result;
+    }
+
+    /// Tell a relay peer which channels we (and everybody behind us) want
+    /// Only sends the difference to the previous advertisement
+    void advertise(const std::set<channel_id_t> &interest);
+
+    /// Ask a relay to replay its recent messages on the channels
+    void request_history(const std::set<channel_id_t> &channels,
+                         uint32_t count);
+
+    /// @param channels a std::set or channel_list_t
+    template <typename Channels>
+    bool has_subscription(const Channels &channels) {
         // empty channels -> send to all channels
         if (channels.empty() || !is_set_up()) {
             return true;
         }
 
+        std::shared_lock lock(m_subscription_mutex);
+
         for (auto cid : channels) {
             if (cid >= m_config.num_channels()) {
                 LOG(FATAL) << "Invalid channel id: " << cid;
             }
 
-            if (m_subscriptions.find(cid) != m_subscriptions.end()) {
+            if (m_subscriptions.find(cid) != m_subscriptions.end() ||
+                m_topic_channels.find(cid) != m_topic_channels.end()) {
                 return true;
             }
         }
@@ -47,13 +198,131 @@ class Peer : public yael::DelayedNetworkSocketListener {
 
     void set_name(const std::string &name);
 
+    void send_hello();
+
+    /// Tell a relay the last message we got over the previous connection
+    void send_resume();
+
+    void on_subscription_update(bitstream &input);
+
+    void on_topic_subscription(bitstream &input);
+
+    /// Handle anything but the hello message
+    void on_message(bitstream &&input);
+
+    /// Handle the messages in a frame from a compressing peer
+    void on_compressed_frame(bitstream &input);
+
+    /// Send a message over the (emulated) link
+    void dispatch(SendQueue::message_t &&msg);
+
+    /// Send messages over the link, compressed into one frame if possible
+    void dispatch(std::vector<SendQueue::message_t> &&batch);
+
+    /// Send the next queued message (or batch of messages)
+    void dispatch_queued();
+
+    /// Hand a frame to the link or socket
+    /// @param num_messages the number of messages the frame contains
+    void send_frame(std::shared_ptr<uint8_t[]> &&data, uint32_t length,
+                    size_t num_messages);
+
+    /// Bytes handed to the link or socket that have not been sent yet
+    uint64_t output_backlog();
+
+    /// Will (or did) the message at position get sent by pulling?
+    /// Messages below m_pull_end are only pulled if they are in m_unsent
+    bool is_pulled(size_t position) const {
+        if (position < m_pull_end) {
+            return false;
+        }
+
+        return m_pulling || position < m_pull_position;
+    }
+
+    /// @param end pulling only sends the messages in unsent below end
+    void start_pulling(size_t position, size_t end, std::set<size_t> &&unsent);
+
+    /// The oldest message that is queued or still has to be pulled
+    /// Must be called while holding the queue mutex
+    std::optional<size_t> pending_position() const;
+
+    void schedule_flush(std::unique_lock<std::mutex> &lock);
+
+    /// Dispatch the message or queue it (and start pulling if the queue
+    /// grows too large); does not check if it was pulled already
+    void enqueue(uint32_t priority, SendQueue::message_t &&msg,
+                 std::unique_lock<std::mutex> &lock);
+
+    /// Track messages sent to an upstream relay for fail-over
+    void remember_position(size_t position);
+
+    /// Send the next relevant message from storage
+    /// @return false if there is nothing (yet) to send
+    bool pull_next();
+
+    uint64_t link_seed(const std::string &from, const std::string &to) const;
+
+    void configure_compression(const NetworkConfig::link_t &link);
+
     Node &m_node;
     const NetworkConfig &m_config;
+    const size_t m_worker;
+    const bool m_upstream = false;
+
+    /// Set if we initiated the connection
+    std::optional<yael::network::Address> m_link_address;
+
+    LinkModel m_link;
+
+    Counter m_messages_sent;
+    Counter m_bytes_sent;
+    Counter m_messages_lost;
+    Counter m_messages_conflated;
+    Counter m_bytes_saved;
+
+    std::mutex m_queue_mutex;
+    SendQueue m_send_queue;
+    bool m_flush_scheduled = false;
+
+    /// Set if the link to this peer is configured to compress
+    std::optional<LinkCompressor> m_compressor;
+    std::atomic<bool> m_compresses = false;
+
+    /// Messages [m_pull_start, m_pull_position) were read from storage
+    bool m_pulling = false;
+    size_t m_pull_start = 0;
+    size_t m_pull_position = 0;
 
-    bool m_set_up = false;
+    /// Everything below m_pull_end was stored before pulling started, and
+    /// was either sent already, came from this peer or is in m_unsent
+    size_t m_pull_end = 0;
+    std::set<size_t> m_unsent;
+
+    /// Messages from this peer at or above m_pull_end
+    std::set<size_t> m_own_messages;
+
+    std::deque<size_t> m_recent_positions;
+
+    /// Oldest message that was dropped because the peer disconnected
+    std::optional<size_t> m_dropped_position;
+
+    std::mutex m_resume_mutex;
+    std::optional<message_id_t> m_last_received;
+
+    std::atomic<bool> m_set_up = false;
 
     std::string m_name;
+
+    std::shared_mutex m_subscription_mutex;
     std::set<channel_id_t> m_subscriptions;
+
+    /// Topic patterns of a client and the channels they map to
+    std::set<std::string> m_topic_patterns;
+    std::set<channel_id_t> m_topic_channels;
+
+    /// What we last told this peer we are interested in
+    std::set<channel_id_t> m_advertised;
 };
 
 inline void Peer::set_name(const std::string &name) {
@@ -65,18 +334,46 @@ inline void Peer::set_name(const std::string &name) {
     }
 
     m_name = name;
-    auto delay = 0;
 
-    for (auto &e : m_config.edges()) {
-        if (e.from == m_config.local_name() && e.to == m_name) {
-            delay = e.delay;
+    auto &local_name = m_config.local_name();
+    auto now = LinkScheduler::current_time();
 
+    // Link delay and bandwidth are emulated by the LinkScheduler
+    // so the delay of the underlying socket stays at zero
+    for (auto &e : m_config.edges()) {
+        if (e.from == local_name && e.to == m_name) {
             LOG(INFO) << "Connected to relay " << m_name;
-            DelayedNetworkSocketListener::set_delay(delay);
+            m_link.configure(e.forward, link_seed(e.from, e.to), now);
+            configure_compression(e.forward);
+            return;
+        }
 
+        if (e.from == m_name && e.to == local_name && e.reverse) {
+            m_link.configure(*e.reverse, link_seed(e.to, e.from), now);
+            configure_compression(*e.reverse);
             return;
         }
     }
 }
 
+inline void Peer::configure_compression(const NetworkConfig::link_t &link) {
+    if (!link.compression) {
+        return;
+    }
+
+    std::unique_lock lock(m_queue_mutex);
+    m_compressor.emplace(*link.compression);
+    m_compresses = true;
+}
+
+inline uint64_t Peer::link_seed(const std::string &from,
+                                const std::string &to) const {
+    if (m_config.seed() == 0) {
+        return 0;
+    }
+
+    // derive a distinct, but reproducible, seed for every direction
+    return m_config.seed() ^ std::hash<std::string>()(from + "->" + to);
+}
+
 } // namespace relay
@@ -0,0 +1,174 @@
+#include "Pool.h"
+
+#include <array>
+#include <cstdint>
+#include <mutex>
+
+namespace relay::pool {
+
+// Sizes are rounded up to a multiple of this
+constexpr size_t GRANULARITY = 16;
+constexpr size_t NUM_CLASSES = MAX_BLOCK_SIZE / GRANULARITY;
+
+// Memory that is carved into blocks at once
+constexpr size_t SLAB_SIZE = 64 * 1024;
+
+// Blocks moved between a thread and the depot at once
+constexpr size_t BATCH_SIZE = 64;
+
+// Threads keep at most this many free blocks per size class
+constexpr size_t MAX_CACHED = 4 * BATCH_SIZE;
+
+struct block_t {
+    block_t *next;
+};
+
+struct free_list_t {
+    block_t *head = nullptr;
+    size_t length = 0;
+
+    void push(void *ptr) {
+        auto block = static_cast<block_t *>(ptr);
+        block->next = head;
+        head = block;
+        length++;
+    }
+
+    void *pop() {
+        auto block = head;
+        head = block->next;
+        length--;
+        return block;
+    }
+
+    /// Move up to count blocks to another list
+    void move_to(free_list_t &other, size_t count) {
+        while (head != nullptr && count > 0) {
+            other.push(pop());
+            count--;
+        }
+    }
+};
+
+struct depot_t {
+    std::mutex mutex;
+    free_list_t blocks;
+};
+
+inline std::array<depot_t, NUM_CLASSES> &depots() {
+    // never destroyed, so threads can return blocks at any time
+    static auto instance = new std::array<depot_t, NUM_CLASSES>();
+    return *instance;
+}
+
+struct thread_cache_t {
+    std::array<free_list_t, NUM_CLASSES> lists;
+
+    ~thread_cache_t();
+};
+
+thread_local bool t_cache_destroyed = false;
+
+thread_cache_t::~thread_cache_t() {
+    for (size_t cls = 0; cls < NUM_CLASSES; ++cls) {
+        auto &depot = depots()[cls];
+
+        std::unique_lock lock(depot.mutex);
+        lists[cls].move_to(depot.blocks, lists[cls].length);
+    }
+
+    t_cache_destroyed = true;
+}
+
+inline free_list_t *local_list(size_t cls) {
+    if (t_cache_destroyed) {
+        return nullptr;
+    }
+
+    thread_local thread_cache_t cache;
+    return &cache.lists[cls];
+}
+
+inline size_t size_class(size_t size) {
+    return (size + GRANULARITY - 1) / GRANULARITY - 1;
+}
+
+/// Get more blocks from the depot, or from a new slab
+inline void refill(free_list_t &list, size_t cls) {
+    auto &depot = depots()[cls];
+
+    {
+        std::unique_lock lock(depot.mutex);
+        depot.blocks.move_to(list, BATCH_SIZE);
+    }
+
+    if (list.length > 0) {
+        return;
+    }
+
+    auto block_size = (cls + 1) * GRANULARITY;
+    auto slab = static_cast<uint8_t *>(::operator new(SLAB_SIZE));
+
+    for (size_t offset = 0; offset + block_size <= SLAB_SIZE;
+         offset += block_size) {
+        list.push(slab + offset);
+    }
+}
+
+void *allocate(size_t size) {
+    if (size == 0 || size > MAX_BLOCK_SIZE) {
+        return ::operator new(size);
+    }
+
+    auto cls = size_class(size);
+    auto list = local_list(cls);
+
+    if (list == nullptr) {
+        // the thread is exiting
+        free_list_t tmp;
+        refill(tmp, cls);
+
+        auto ptr = tmp.pop();
+        auto &depot = depots()[cls];
+
+        std::unique_lock lock(depot.mutex);
+        tmp.move_to(depot.blocks, tmp.length);
+        return ptr;
+    }
+
+    if (list->length == 0) {
+        refill(*list, cls);
+    }
+
+    return list->pop();
+}
+
+void deallocate(void *ptr, size_t size) {
+    if (ptr == nullptr) {
+        return;
+    }
+
+    if (size == 0 || size > MAX_BLOCK_SIZE) {
+        ::operator delete(ptr);
+        return;
+    }
+
+    auto cls = size_class(size);
+    auto list = local_list(cls);
+    auto &depot = depots()[cls];
+
+    if (list == nullptr) {
+        std::unique_lock lock(depot.mutex);
+        depot.blocks.push(ptr);
+        return;
+    }
+
+    list->push(ptr);
+
+    if (list->length > MAX_CACHED) {
+        std::unique_lock lock(depot.mutex);
+        list->move_to(depot.blocks, BATCH_SIZE);
+    }
+}
+
+} // namespace relay::pool
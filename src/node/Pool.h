@@ -0,0 +1,57 @@
+#pragma once
+
+#include <cstddef>
+#include <new>
+
+namespace relay {
+
+/// Size-classed memory pool for small objects on the hot path
+///
+/// Every thread keeps free lists of blocks per size class, so most
+/// allocations are a pointer pop without locking. Blocks can be freed by
+/// any thread; they go to that thread's lists, and lists that grow too
+/// long hand blocks back to a shared depot. Blocks are carved from large
+/// slabs that are never returned, which keeps long-running nodes from
+/// fragmenting the heap.
+namespace pool {
+
+/// Largest size that is served from the pool
+constexpr size_t MAX_BLOCK_SIZE = 512;
+
+/// Larger sizes are forwarded to operator new
+void *allocate(size_t size);
+
+/// @param size must be the size that was passed to allocate
+void deallocate(void *ptr, size_t size);
+
+} // namespace pool
+
+/// Allocator for standard containers whose nodes should come from the pool
+template <typename T> struct PoolAllocator {
+    using value_type = T;
+
+    PoolAllocator() = default;
+
+    template <typename U> PoolAllocator(const PoolAllocator<U> &) {}
+
+    T *allocate(size_t n) {
+        return static_cast<T *>(pool::allocate(n * sizeof(T)));
+    }
+
+    void deallocate(T *ptr, size_t n) { pool::deallocate(ptr, n * sizeof(T)); }
+
+    template <typename U> bool operator==(const PoolAllocator<U> &) const {
+        return true;
+    }
+};
+
+/// Base class that makes new and delete of a type use the pool
+template <typename T> struct PoolAllocated {
+    static void *operator new(size_t size) { return pool::allocate(size); }
+
+    static void operator delete(void *ptr, size_t size) {
+        pool::deallocate(ptr, size);
+    }
+};
+
+} // namespace relay
@@ -0,0 +1,67 @@
+#pragma once
+
+#include <cstdint>
+#include <optional>
+#include <vector>
+
+#include "NetworkConfig.h"
+
+namespace relay {
+
+/// Decides which priority class is served next
+///
+/// Weighted scheduling uses smooth weighted round-robin, so that a class with
+/// weight w gets w out of every sum(weights) turns while all classes are busy,
+/// and turns of different classes are interleaved instead of bunched up.
+class PriorityScheduler {
+  public:
+    explicit PriorityScheduler(const NetworkConfig &config)
+        : m_scheduling(config.scheduling()),
+          m_weights(config.priority_weights()),
+          m_current(m_weights.size(), 0) {}
+
+    size_t num_classes() const { return m_weights.size(); }
+
+    /// @param is_ready returns true if a class has something queued
+    /// @return the class to serve or nullopt if none is ready
+    template <typename F> std::optional<size_t> next(F &&is_ready) {
+        if (m_scheduling == NetworkConfig::Scheduling::Strict) {
+            for (size_t i = 0; i < m_weights.size(); ++i) {
+                if (is_ready(i)) {
+                    return i;
+                }
+            }
+
+            return std::nullopt;
+        }
+
+        std::optional<size_t> best;
+        int64_t total = 0;
+
+        for (size_t i = 0; i < m_weights.size(); ++i) {
+            if (!is_ready(i)) {
+                continue;
+            }
+
+            m_current[i] += m_weights[i];
+            total += m_weights[i];
+
+            if (!best || m_current[i] > m_current[*best]) {
+                best = i;
+            }
+        }
+
+        if (best) {
+            m_current[*best] -= total;
+        }
+
+        return best;
+    }
+
+  private:
+    const NetworkConfig::Scheduling m_scheduling;
+    const std::vector<uint32_t> m_weights;
+    std::vector<int64_t> m_current;
+};
+
+} // namespace relay
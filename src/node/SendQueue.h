@@ -0,0 +1,153 @@
+#pragma once
+
+#include <bitstream.h>
+#include <cstdint>
+#include <deque>
+#include <map>
+#include <memory>
+#include <optional>
+#include <set>
+#include <vector>
+
+#include "PriorityScheduler.h"
+
+namespace relay {
+
+/// Identifies the value that a message on a conflating channel updates
+struct conflation_key_t {
+    std::set<channel_id_t> channels;
+    uint64_t key;
+
+    auto operator<=>(const conflation_key_t &other) const = default;
+};
+
+/// Messages that wait to be handed to the socket (or link) of a peer
+///
+/// There is one FIFO per priority class. A message with a conflation key
+/// replaces a queued message with the same key, keeping its position.
+/// Not thread-safe.
+class SendQueue {
+  public:
+    struct message_t {
+        std::shared_ptr<uint8_t[]> data;
+        uint32_t length;
+        std::optional<conflation_key_t> key;
+
+        /// Position of the message in the storage log
+        size_t position;
+
+        /// The message without the framing of the socket
+        /// Only set for links that compress
+        std::shared_ptr<const bitstream> payload;
+    };
+
+    explicit SendQueue(const NetworkConfig &config)
+        : m_queues(config.num_priorities()), m_scheduler(config) {}
+
+    /// @return false if the message replaced a queued one
+    bool push(uint32_t priority, message_t &&msg) {
+        if (msg.key) {
+            auto it = m_pending_keys.find(*msg.key);
+
+            if (it != m_pending_keys.end()) {
+                auto &pending = *it->second;
+                m_num_bytes = m_num_bytes - pending.length + msg.length;
+
+                pending.data = std::move(msg.data);
+                pending.length = msg.length;
+                pending.position = msg.position;
+                pending.payload = std::move(msg.payload);
+                return false;
+            }
+        }
+
+        m_num_bytes += msg.length;
+        ++m_size;
+
+        auto &queue = m_queues[priority];
+        queue.push_back(std::move(msg));
+
+        // references into a deque stay valid when pushing to its ends
+        auto &back = queue.back();
+        if (back.key) {
+            m_pending_keys.emplace(*back.key, &back);
+        }
+
+        return true;
+    }
+
+    /// Remove the next message according to the scheduling policy
+    /// Must not be called on an empty queue
+    message_t pop() {
+        auto priority = *m_scheduler.next(
+            [this](size_t i) { return !m_queues[i].empty(); });
+
+        auto &queue = m_queues[priority];
+        auto msg = std::move(queue.front());
+        queue.pop_front();
+
+        if (msg.key) {
+            m_pending_keys.erase(*msg.key);
+        }
+
+        m_num_bytes -= msg.length;
+        --m_size;
+
+        return msg;
+    }
+
+    void clear() {
+        for (auto &queue : m_queues) {
+            queue.clear();
+        }
+
+        m_pending_keys.clear();
+        m_num_bytes = 0;
+        m_size = 0;
+    }
+
+    /// The oldest (lowest) storage position of all queued messages
+    std::optional<size_t> min_position() const {
+        std::optional<size_t> result;
+
+        for (auto &queue : m_queues) {
+            for (auto &msg : queue) {
+                if (!result || msg.position < *result) {
+                    result = msg.position;
+                }
+            }
+        }
+
+        return result;
+    }
+
+    /// The storage positions of all queued messages
+    std::set<size_t> positions() const {
+        std::set<size_t> result;
+
+        for (auto &queue : m_queues) {
+            for (auto &msg : queue) {
+                result.insert(msg.position);
+            }
+        }
+
+        return result;
+    }
+
+    bool empty() const { return m_size == 0; }
+
+    size_t size() const { return m_size; }
+
+    uint64_t num_bytes() const { return m_num_bytes; }
+
+  private:
+    std::vector<std::deque<message_t>> m_queues;
+    PriorityScheduler m_scheduler;
+
+    std::map<conflation_key_t, message_t *> m_pending_keys;
+
+    size_t m_size = 0;
+    uint64_t m_num_bytes = 0;
+};
+
+} // namespace relay
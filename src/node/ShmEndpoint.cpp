@@ -0,0 +1,309 @@
+#include "ShmEndpoint.h"
+#include "Node.h"
+#include "common/MessageHeader.h"
+#include "common/SocketUtils.h"
+
+#include <algorithm>
+#include <glog/logging.h>
+#include <iterator>
+#include <stdbitstream.h>
+#include <sys/un.h>
+
+namespace relay {
+
+// How often the receiver checks whether the client is still there
+constexpr auto SHM_POLL_INTERVAL = std::chrono::milliseconds(100);
+
+// Largest hello message we accept from a client
+constexpr uint32_t MAX_SHM_HELLO_SIZE = 64 * 1024;
+
+// Clients that have this many bytes queued are disconnected
+constexpr size_t MAX_SHM_SEND_QUEUE = 64 * 1024 * 1024;
+
+ShmEndpoint::ShmEndpoint(Node &node, int socket,
+                         std::unique_ptr<ShmSegment> &&segment,
+                         std::set<channel_id_t> subscriptions)
+    : m_node(node), m_worker(node.assign_worker()), m_socket(socket),
+      m_segment(std::move(segment)),
+      m_subscriptions(std::move(subscriptions)) {}
+
+ShmEndpoint::~ShmEndpoint() {
+    {
+        std::unique_lock lock(m_send_mutex);
+        m_okay = false;
+        m_send_cond.notify_all();
+    }
+
+    // the ring might be full
+    m_segment->close();
+
+    if (m_send_thread.joinable()) {
+        m_send_thread.join();
+    }
+
+    if (m_receive_thread.joinable()) {
+        if (m_receive_thread.get_id() == std::this_thread::get_id()) {
+            m_receive_thread.detach();
+        } else {
+            m_receive_thread.join();
+        }
+    }
+
+    ::close(m_socket);
+}
+
+void ShmEndpoint::start() {
+    m_receive_thread = std::thread(&ShmEndpoint::receive_loop, this);
+    m_send_thread = std::thread(&ShmEndpoint::send_loop, this);
+}
+
+void ShmEndpoint::stop() {
+    {
+        std::unique_lock lock(m_send_mutex);
+        m_okay = false;
+        m_send_cond.notify_all();
+    }
+
+    m_segment->close();
+
+    if (m_receive_thread.joinable()) {
+        m_receive_thread.join();
+    }
+
+    if (m_send_thread.joinable()) {
+        m_send_thread.join();
+    }
+}
+
+void ShmEndpoint::send(const uint8_t *data, uint32_t length) {
+    auto &ring = m_segment->to_client();
+    std::unique_lock lock(m_send_mutex);
+
+    try {
+        // queued messages go first
+        if (m_send_queue.empty() && ring.try_write(data, length)) {
+            return;
+        }
+    } catch (std::exception &e) {
+        LOG(ERROR) << "Failed to send message to shared-memory client: "
+                   << e.what();
+        return;
+    }
+
+    if (ring.is_closed()) {
+        return;
+    }
+
+    if (m_send_queue_size + length > MAX_SHM_SEND_QUEUE) {
+        LOG(ERROR) << "Shared-memory client fell behind; disconnecting";
+
+        // the receiver notices and removes the client
+        m_segment->close();
+        return;
+    }
+
+    m_send_queue.emplace_back(data, data + length);
+    m_send_queue_size += length;
+    m_send_cond.notify_one();
+}
+
+void ShmEndpoint::send_loop() {
+    auto &ring = m_segment->to_client();
+    std::unique_lock lock(m_send_mutex);
+
+    while (m_okay) {
+        if (m_send_queue.empty()) {
+            m_send_cond.wait(lock);
+            continue;
+        }
+
+        // only this thread removes messages, so the reference stays valid
+        auto &msg = m_send_queue.front();
+        lock.unlock();
+
+        bool written = ring.write(msg.data(), msg.size());
+        lock.lock();
+
+        if (!written) {
+            // closed
+            return;
+        }
+
+        m_send_queue_size -= msg.size();
+        m_send_queue.pop_front();
+    }
+}
+
+void ShmEndpoint::receive_loop() {
+    auto &ring = m_segment->to_node();
+
+    while (m_okay) {
+        bitstream input;
+
+        if (!ring.read(input, SHM_POLL_INTERVAL)) {
+            if (ring.is_closed() || is_hung_up(m_socket)) {
+                break;
+            }
+
+            continue;
+        }
+
+        auto header = read_header(input);
+
+        if (header.topic_subscription) {
+            on_topic_subscription(input);
+            continue;
+        }
+
+        if (header.trace && header.trace->hops.size() < MAX_TRACE_HOPS) {
+            header.trace->hops.push_back(hop_trace_t{trace_time(), 0});
+        }
+
+        m_node.queue_broadcast(std::move(header), std::move(input),
+                               shared_from_this());
+    }
+
+    if (m_okay) {
+        LOG(INFO) << "Shared-memory client disconnected";
+
+        m_segment->close();
+        m_node.remove_shm_client(shared_from_this());
+    }
+}
+
+void ShmEndpoint::on_topic_subscription(bitstream &input) {
+    std::set<std::string> added, removed;
+    read_topic_update(input, added, removed);
+
+    {
+        std::unique_lock lock(m_topic_mutex);
+
+        for (auto &pattern : removed) {
+            m_topic_patterns.erase(pattern);
+        }
+
+        m_topic_patterns.insert(added.begin(), added.end());
+        m_topic_channels = m_node.config().topic_channels(m_topic_patterns);
+    }
+
+    m_node.update_topics(this, added, removed);
+}
+
+ShmListener::ShmListener(Node &node, const std::string &name)
+    : m_node(node), m_path(shm_socket_path(name)) {
+    sockaddr_un addr = {};
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, m_path.c_str(), sizeof(addr.sun_path) - 1);
+
+    // remove a leftover socket of a previous run
+    ::unlink(m_path.c_str());
+
+    m_socket = ::socket(AF_UNIX, SOCK_STREAM, 0);
+
+    if (m_socket < 0 ||
+        ::bind(m_socket, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)) !=
+            0 ||
+        ::listen(m_socket, 100) != 0) {
+        LOG(FATAL) << "Failed to listen for shared-memory clients at "
+                   << m_path;
+    }
+
+    LOG(INFO) << "Listening for shared-memory clients at " << m_path;
+
+    m_accept_thread = std::thread(&ShmListener::accept_loop, this);
+}
+
+ShmListener::~ShmListener() {
+    m_okay = false;
+
+    // wakes up the accept call
+    ::shutdown(m_socket, SHUT_RDWR);
+    m_accept_thread.join();
+
+    ::close(m_socket);
+    ::unlink(m_path.c_str());
+}
+
+void ShmListener::accept_loop() {
+    while (m_okay) {
+        auto socket = ::accept(m_socket, nullptr, nullptr);
+
+        if (socket < 0) {
+            if (m_okay && errno != EINTR) {
+                LOG(ERROR) << "Failed to accept shared-memory client";
+            }
+            continue;
+        }
+
+        handshake(socket);
+    }
+}
+
+void ShmListener::handshake(int socket) {
+    uint32_t length = 0;
+
+    if (!recv_all(socket, reinterpret_cast<uint8_t *>(&length),
+                  sizeof(length)) ||
+        length > MAX_SHM_HELLO_SIZE) {
+        LOG(ERROR) << "Invalid hello from shared-memory client";
+        ::close(socket);
+        return;
+    }
+
+    bitstream hello;
+    hello.resize(length);
+
+    if (!recv_all(socket, hello.data(), length)) {
+        LOG(ERROR) << "Invalid hello from shared-memory client";
+        ::close(socket);
+        return;
+    }
+
+    hello.move_to(0);
+
+    std::string segment_name;
+    std::set<channel_id_t> subscriptions;
+    uint32_t history = 0;
+    hello >> segment_name >> subscriptions >> history;
+
+    std::unique_ptr<ShmSegment> segment;
+
+    try {
+        segment = ShmSegment::open(segment_name);
+    } catch (std::exception &e) {
+        LOG(ERROR) << e.what();
+        ::close(socket);
+        return;
+    }
+
+    uint8_t ack = 1;
+    if (!send_all(socket, &ack, sizeof(ack))) {
+        ::close(socket);
+        return;
+    }
+
+    LOG(INFO) << "New shared-memory client " << segment_name;
+
+    // see Peer::on_network_message
+    std::set<channel_id_t> missing;
+
+    if (history > 0) {
+        auto interest = m_node.downstream_interest(nullptr);
+        std::set_difference(subscriptions.begin(), subscriptions.end(),
+                            interest.begin(), interest.end(),
+                            std::inserter(missing, missing.end()));
+    }
+
+    auto endpoint = std::make_shared<ShmEndpoint>(m_node, socket,
+                                                  std::move(segment),
+                                                  subscriptions);
+    m_node.add_shm_client(endpoint);
+    endpoint->start();
+
+    if (history > 0) {
+        m_node.replay_history(endpoint, subscriptions, history);
+        m_node.fetch_history(missing, history);
+    }
+}
+
+} // namespace relay
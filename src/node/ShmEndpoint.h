@@ -0,0 +1,120 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <shared_mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "common/ShmRing.h"
+#include "librelay/Connection.h"
+
+namespace relay {
+
+class Node;
+
+/// A client on the same host that is connected through shared memory
+class ShmEndpoint : public std::enable_shared_from_this<ShmEndpoint> {
+  public:
+    ShmEndpoint(Node &node, int socket, std::unique_ptr<ShmSegment> &&segment,
+                std::set<channel_id_t> subscriptions);
+    ~ShmEndpoint();
+
+    /// Start exchanging messages with the client
+    void start();
+
+    /// Disconnect the client and wait for its threads to exit
+    void stop();
+
+    /// Copy a message (including its header) to the client
+    ///
+    /// Never blocks: messages queue up while the client's ring buffer is
+    /// full, and clients that fall more than MAX_SHM_SEND_QUEUE bytes
+    /// behind are disconnected
+    void send(const uint8_t *data, uint32_t length);
+
+    template <typename Channels>
+    bool has_subscription(const Channels &channels) const {
+        // empty channels -> send to all channels
+        if (channels.empty()) {
+            return true;
+        }
+
+        std::shared_lock lock(m_topic_mutex);
+
+        for (auto cid : channels) {
+            if (m_subscriptions.find(cid) != m_subscriptions.end() ||
+                m_topic_channels.find(cid) != m_topic_channels.end()) {
+                return true;
+            }
+        }
+
+        return false;
+    }
+
+    /// Includes the channels the client's topics map to
+    std::set<channel_id_t> subscriptions() const {
+        std::shared_lock lock(m_topic_mutex);
+
+        auto result = m_subscriptions;
+        result.insert(m_topic_channels.begin(), m_topic_channels.end());
+        return result;
+    }
+
+    size_t worker() const { return m_worker; }
+
+  private:
+    void receive_loop();
+
+    /// Move queued messages to the ring as the client makes room
+    void send_loop();
+
+    void on_topic_subscription(bitstream &input);
+
+    Node &m_node;
+    const size_t m_worker;
+
+    int m_socket;
+    std::unique_ptr<ShmSegment> m_segment;
+    const std::set<channel_id_t> m_subscriptions;
+
+    mutable std::shared_mutex m_topic_mutex;
+    std::set<std::string> m_topic_patterns;
+    std::set<channel_id_t> m_topic_channels;
+
+    std::atomic<bool> m_okay = true;
+    std::thread m_receive_thread;
+
+    std::mutex m_send_mutex;
+    std::condition_variable m_send_cond;
+    std::deque<std::vector<uint8_t>> m_send_queue;
+    size_t m_send_queue_size = 0;
+    std::thread m_send_thread;
+};
+
+/// Accepts shared-memory connections on a unix socket
+class ShmListener {
+  public:
+    ShmListener(Node &node, const std::string &name);
+    ~ShmListener();
+
+  private:
+    void accept_loop();
+
+    /// Map the client's segment and answer its hello
+    void handshake(int socket);
+
+    Node &m_node;
+    const std::string m_path;
+
+    int m_socket;
+    std::atomic<bool> m_okay = true;
+    std::thread m_accept_thread;
+};
+
+} // namespace relay
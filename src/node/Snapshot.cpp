@@ -0,0 +1,225 @@
+#include "Snapshot.h"
+#include "common/SocketUtils.h"
+
+#include <algorithm>
+#include <fcntl.h>
+#include <glog/logging.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <sys/sendfile.h>
+#include <unistd.h>
+
+namespace relay {
+
+// Data moved per splice call
+constexpr size_t SPLICE_CHUNK_SIZE = 1024 * 1024;
+
+/// Move length bytes from a socket to the end of a file
+/// Uses splice through a pipe, so the data stays in the kernel
+inline bool receive_to_file(int socket, int fd, size_t length) {
+    int pipe_fds[2];
+
+    if (::pipe(pipe_fds) != 0) {
+        return false;
+    }
+
+    bool okay = true;
+
+    while (okay && length > 0) {
+        auto chunk = std::min(length, SPLICE_CHUNK_SIZE);
+        auto received = ::splice(socket, nullptr, pipe_fds[1], nullptr, chunk,
+                                 SPLICE_F_MOVE | SPLICE_F_MORE);
+
+        if (received <= 0) {
+            okay = false;
+            break;
+        }
+
+        auto remaining = static_cast<size_t>(received);
+
+        while (remaining > 0) {
+            auto written = ::splice(pipe_fds[0], nullptr, fd, nullptr,
+                                    remaining, SPLICE_F_MOVE);
+
+            if (written <= 0) {
+                okay = false;
+                break;
+            }
+
+            remaining -= written;
+        }
+
+        length -= received;
+    }
+
+    ::close(pipe_fds[0]);
+    ::close(pipe_fds[1]);
+    return okay;
+}
+
+SnapshotServer::SnapshotServer(Storage &storage, uint16_t port)
+    : m_storage(storage) {
+    sockaddr_in addr = {};
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    addr.sin_port = htons(port);
+
+    m_socket = ::socket(AF_INET, SOCK_STREAM, 0);
+
+    int reuse = 1;
+    ::setsockopt(m_socket, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+
+    if (m_socket < 0 ||
+        ::bind(m_socket, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)) !=
+            0 ||
+        ::listen(m_socket, 10) != 0) {
+        LOG(FATAL) << "Failed to listen for snapshot requests on port "
+                   << port;
+    }
+
+    LOG(INFO) << "Serving storage snapshots on port " << port;
+
+    m_accept_thread = std::thread(&SnapshotServer::accept_loop, this);
+}
+
+SnapshotServer::~SnapshotServer() {
+    m_okay = false;
+
+    // wakes up the accept call
+    ::shutdown(m_socket, SHUT_RDWR);
+    m_accept_thread.join();
+
+    ::close(m_socket);
+}
+
+void SnapshotServer::accept_loop() {
+    while (m_okay) {
+        auto socket = ::accept(m_socket, nullptr, nullptr);
+
+        if (socket < 0) {
+            if (m_okay && errno != EINTR) {
+                LOG(ERROR) << "Failed to accept snapshot request";
+            }
+            continue;
+        }
+
+        send_snapshot(socket);
+        ::close(socket);
+    }
+}
+
+void SnapshotServer::send_snapshot(int socket) {
+    // Layout: #segments | (segment size | segment data)*
+    uint64_t num_segments = Storage::NUM_SEGMENTS;
+
+    if (!send_all(socket, reinterpret_cast<uint8_t *>(&num_segments),
+                  sizeof(num_segments))) {
+        return;
+    }
+
+    uint64_t total = 0;
+
+    for (size_t sid = 0; sid < Storage::NUM_SEGMENTS; ++sid) {
+        uint64_t size = m_storage.segment_size(sid);
+
+        if (!send_all(socket, reinterpret_cast<uint8_t *>(&size),
+                      sizeof(size))) {
+            return;
+        }
+
+        if (size == 0) {
+            continue;
+        }
+
+        auto fd = ::open(m_storage.segment_path(sid).c_str(), O_RDONLY);
+
+        if (fd < 0) {
+            LOG(ERROR) << "Failed to open storage segment " << sid;
+            return;
+        }
+
+        off_t offset = 0;
+
+        while (static_cast<uint64_t>(offset) < size) {
+            auto sent = ::sendfile(socket, fd, &offset, size - offset);
+
+            if (sent <= 0) {
+                LOG(ERROR) << "Failed to send storage segment " << sid;
+                ::close(fd);
+                return;
+            }
+        }
+
+        ::close(fd);
+        total += size;
+    }
+
+    LOG(INFO) << "Sent storage snapshot of " << total << " bytes";
+}
+
+bool fetch_snapshot(Storage &storage, const yael::network::Address &addr) {
+    addrinfo hints = {};
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+
+    addrinfo *info = nullptr;
+    auto port = std::to_string(addr.PortNumber);
+
+    if (::getaddrinfo(addr.IP.c_str(), port.c_str(), &hints, &info) != 0) {
+        LOG(ERROR) << "Failed to resolve snapshot server " << addr.IP;
+        return false;
+    }
+
+    auto socket = ::socket(info->ai_family, SOCK_STREAM, 0);
+    bool connected =
+        socket >= 0 && ::connect(socket, info->ai_addr, info->ai_addrlen) == 0;
+    ::freeaddrinfo(info);
+
+    if (!connected) {
+        LOG(ERROR) << "Failed to connect to snapshot server " << addr.IP << ":"
+                   << addr.PortNumber;
+        ::close(socket);
+        return false;
+    }
+
+    uint64_t num_segments = 0;
+    bool okay = recv_all(socket, reinterpret_cast<uint8_t *>(&num_segments),
+                         sizeof(num_segments)) &&
+                num_segments == Storage::NUM_SEGMENTS;
+
+    for (size_t sid = 0; okay && sid < num_segments; ++sid) {
+        uint64_t size = 0;
+
+        if (!recv_all(socket, reinterpret_cast<uint8_t *>(&size),
+                      sizeof(size))) {
+            okay = false;
+            break;
+        }
+
+        auto fd = ::open(storage.segment_path(sid).c_str(),
+                         O_WRONLY | O_CREAT | O_TRUNC, 0644);
+
+        okay = fd >= 0 && receive_to_file(socket, fd, size);
+
+        if (fd >= 0) {
+            ::close(fd);
+        }
+    }
+
+    ::close(socket);
+
+    if (!okay) {
+        LOG(ERROR) << "Failed to receive storage snapshot";
+
+        for (size_t sid = 0; sid < Storage::NUM_SEGMENTS; ++sid) {
+            std::filesystem::remove(storage.segment_path(sid));
+        }
+
+        return false;
+    }
+
+    storage.adopt_segments();
+    return true;
+}
+
+} // namespace relay
@@ -0,0 +1,36 @@
+#pragma once
+
+#include <atomic>
+#include <thread>
+#include <yael/network/Address.h>
+
+#include "Storage.h"
+
+namespace relay {
+
+/// Streams the segment files of a relay's storage to relays that join
+///
+/// Segments are sent with sendfile, so the history never passes through
+/// user space. The new relay writes them to disk as its own segments.
+class SnapshotServer {
+  public:
+    SnapshotServer(Storage &storage, uint16_t port);
+    ~SnapshotServer();
+
+  private:
+    void accept_loop();
+
+    void send_snapshot(int socket);
+
+    Storage &m_storage;
+
+    int m_socket;
+    std::atomic<bool> m_okay = true;
+    std::thread m_accept_thread;
+};
+
+/// Copy the storage of another relay before this one starts
+/// @return false if the transfer failed (storage stays empty)
+bool fetch_snapshot(Storage &storage, const yael::network::Address &addr);
+
+} // namespace relay
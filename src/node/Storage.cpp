@@ -1,5 +1,10 @@
 #include "node/Storage.h"
 
+#include <algorithm>
+#include <array>
+#include <set>
+#include <vector>
+
 namespace relay {
 
 Storage::Storage(const std::string &prefix, size_t max_mem_size)
@@ -70,21 +75,24 @@ void Storage::shard_t::make_space(size_t max_mem_size) {
 
 std::unique_ptr<Storage::entry_t>
 Storage::shard_t::get_entry_from_disk(std::filesystem::path path,
-                                      size_t offset) {
+                                      size_t pos, size_t offset) {
     std::ifstream file(path, std::fstream::in | std::fstream::binary);
     file.seekg(offset);
 
-    std::set<channel_id_t> channels;
+    size_t stored_pos;
+    file.read(reinterpret_cast<char *>(&stored_pos), sizeof(stored_pos));
+
+    if (stored_pos != pos) {
+        LOG(FATAL) << "Storage file " << path << " is corrupted";
+    }
 
     size_t num_channels;
     file.read(reinterpret_cast<char *>(&num_channels), sizeof(num_channels));
 
-    for (size_t i = 0; i < num_channels; ++i) {
-        channel_id_t id;
-        file.read(reinterpret_cast<char *>(&id), sizeof(id));
-
-        channels.insert(id);
-    }
+    // ids were written in sorted order
+    channel_list_t channels(num_channels);
+    file.read(reinterpret_cast<char *>(channels.data()),
+              num_channels * sizeof(channel_id_t));
 
     size_t data_size;
     file.read(reinterpret_cast<char *>(&data_size), sizeof(data_size));
@@ -94,7 +102,8 @@ Storage::shard_t::get_entry_from_disk(std::filesystem::path path,
     file.read(reinterpret_cast<char *>(data.data()), data_size);
 
     current_mem_size += data_size;
-    return std::make_unique<entry_t>(std::move(channels), std::move(data));
+    return std::make_unique<entry_t>(pos, std::move(channels),
+                                     std::move(data));
 }
 
 std::optional<Storage::entry_handle_t> Storage::get_entry(size_t pos) {
@@ -106,6 +115,7 @@ std::optional<Storage::entry_handle_t> Storage::get_entry(size_t pos) {
     auto it = shard.data.find(pos);
 
     if (it == shard.data.end()) {
+        m_misses.add();
         return std::nullopt;
     }
 
@@ -113,8 +123,10 @@ std::optional<Storage::entry_handle_t> Storage::get_entry(size_t pos) {
     entry_handle_t hdl;
 
     if (val.second == nullptr) {
+        m_disk_reads.add();
+
         auto path = m_prefix / (std::to_string(sid) + ".dat");
-        val.second = shard.get_entry_from_disk(path, val.first);
+        val.second = shard.get_entry_from_disk(path, pos, val.first);
 
         // increase read count before we evict stuff
         hdl = entry_handle_t{val.second.get()};
@@ -122,6 +134,8 @@ std::optional<Storage::entry_handle_t> Storage::get_entry(size_t pos) {
         // evict other stuff to make space
         shard.make_space(m_max_mem_size);
     } else {
+        m_memory_hits.add();
+
         hdl = entry_handle_t{val.second.get()};
         shard.lru.erase(val.second->lru_it);
     }
@@ -144,7 +158,8 @@ Storage::entry_handle_t Storage::insert(std::set<channel_id_t> channels,
 
     std::pair<size_t, std::unique_ptr<entry_t>> new_val = {
         shard.storage_pos,
-        std::make_unique<entry_t>(std::move(channels), std::move(value))};
+        std::make_unique<entry_t>(key, channel_list_t(channels),
+                                  std::move(value))};
 
     auto [it, res] = shard.data.emplace(key, std::move(new_val));
 
@@ -179,6 +194,30 @@ Storage::entry_handle_t Storage::insert(std::set<channel_id_t> channels,
     return hdl;
 }
 
+void Storage::write_metrics(MetricsWriter &writer) {
+    size_t mem_size = 0;
+    for (auto &shard : m_data_shards) {
+        std::unique_lock lock(shard.mutex);
+        mem_size += shard.current_mem_size;
+    }
+
+    writer.gauge("relay_storage_entries", "Number of messages in storage",
+                 m_num_entries);
+    writer.gauge("relay_storage_memory_bytes",
+                 "Bytes of message data cached in memory", mem_size);
+    writer.gauge("relay_storage_write_queue_length",
+                 "Messages waiting to be written to disk",
+                 write_queue_length());
+
+    auto lookups = "Storage lookups by where the entry was found";
+    writer.counter("relay_storage_lookups_total", lookups,
+                   m_memory_hits.value(), {{"result", "memory"}});
+    writer.counter("relay_storage_lookups_total", lookups, m_disk_reads.value(),
+                   {{"result", "disk"}});
+    writer.counter("relay_storage_lookups_total", lookups, m_misses.value(),
+                   {{"result", "missing"}});
+}
+
 void Storage::write_worker_loop() {
     while (m_okay) {
         std::unique_lock lock(m_write_queue_mutex);
@@ -207,6 +246,9 @@ void Storage::write_worker_loop() {
         auto path = m_prefix / (std::to_string(sid) + ".dat");
         std::ofstream file(path, std::fstream::app | std::fstream::binary);
 
+        size_t position = entry.position();
+        file.write(reinterpret_cast<const char *>(&position), sizeof(position));
+
         size_t num_channels = entry.channels().size();
         file.write(reinterpret_cast<const char *>(&num_channels),
                    sizeof(num_channels));
@@ -225,7 +267,121 @@ void Storage::write_worker_loop() {
         if (file.bad()) {
             LOG(FATAL) << "Write to disk failed. Storage full?";
         }
+
+        file.close();
+        shard.written_size += 3 * sizeof(size_t) +
+                              num_channels * sizeof(channel_id_t) + data_size;
     }
 }
 
+size_t Storage::segment_size(size_t sid) {
+    auto &shard = m_data_shards[sid];
+    std::unique_lock file_lock(shard.file_mutex);
+    return shard.written_size;
+}
+
+void Storage::adopt_segments() {
+    // (position, offset) of the complete records in each segment
+    std::array<std::vector<std::pair<size_t, size_t>>, NUM_SHARDS> records;
+    std::array<size_t, NUM_SHARDS> sizes = {};
+    std::set<size_t> positions;
+
+    for (size_t sid = 0; sid < NUM_SHARDS; ++sid) {
+        auto path = segment_path(sid);
+        std::ifstream file(path, std::fstream::in | std::fstream::binary);
+
+        size_t offset = 0;
+
+        while (file) {
+            size_t pos, num_channels, data_size;
+
+            if (!file.read(reinterpret_cast<char *>(&pos), sizeof(pos)) ||
+                !file.read(reinterpret_cast<char *>(&num_channels),
+                           sizeof(num_channels)) ||
+                !file.seekg(num_channels * sizeof(channel_id_t),
+                            std::ios::cur) ||
+                !file.read(reinterpret_cast<char *>(&data_size),
+                           sizeof(data_size)) ||
+                !file.seekg(data_size, std::ios::cur)) {
+                break;
+            }
+
+            auto end = offset + 3 * sizeof(size_t) +
+                       num_channels * sizeof(channel_id_t) + data_size;
+
+            // the last record might have been cut off
+            if (end > std::filesystem::file_size(path)) {
+                break;
+            }
+
+            records[sid].emplace_back(pos, offset);
+            positions.insert(pos);
+            offset = end;
+        }
+
+        sizes[sid] = offset;
+    }
+
+    // Later positions will be resent by the other relays. This node then
+    // stores its own records under these positions, so each segment is
+    // cut off at its first record past the gap. That can open another gap,
+    // as records are not written in position order.
+    size_t num_entries = 0;
+    bool truncated = true;
+
+    while (truncated) {
+        num_entries = 0;
+
+        while (positions.count(num_entries) > 0) {
+            num_entries++;
+        }
+
+        truncated = false;
+
+        for (size_t sid = 0; sid < NUM_SHARDS; ++sid) {
+            auto &segment = records[sid];
+            auto it = std::find_if(
+                segment.begin(), segment.end(),
+                [&](auto &record) { return record.first >= num_entries; });
+
+            if (it == segment.end()) {
+                continue;
+            }
+
+            sizes[sid] = it->second;
+
+            for (auto rit = it; rit != segment.end(); ++rit) {
+                positions.erase(rit->first);
+            }
+
+            segment.erase(it, segment.end());
+            truncated = true;
+        }
+    }
+
+    for (size_t sid = 0; sid < NUM_SHARDS; ++sid) {
+        auto &shard = m_data_shards[sid];
+        auto path = segment_path(sid);
+
+        std::unique_lock lock(shard.mutex);
+
+        // loaded from disk on first access
+        for (auto [pos, offset] : records[sid]) {
+            shard.data.emplace(pos, std::pair{offset, nullptr});
+        }
+
+        if (std::filesystem::exists(path)) {
+            std::filesystem::resize_file(path, sizes[sid]);
+        }
+
+        std::unique_lock file_lock(shard.file_mutex);
+        shard.storage_pos = sizes[sid];
+        shard.written_size = sizes[sid];
+    }
+
+    m_num_entries = num_entries;
+
+    LOG(INFO) << "Adopted " << num_entries << " storage entries";
+}
+
 } // namespace relay
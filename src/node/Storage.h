@@ -13,6 +13,9 @@
 #include <tuple>
 #include <unordered_map>
 
+#include "ChannelList.h"
+#include "Metrics.h"
+#include "Pool.h"
 #include "librelay/Connection.h"
 
 namespace relay {
@@ -21,26 +24,36 @@ namespace relay {
 class Storage {
   private:
     struct entry_t;
-    using data_map_t =
-        std::unordered_map<size_t, std::pair<size_t, std::unique_ptr<entry_t>>>;
-
-    struct entry_t {
+    using data_value_t = std::pair<size_t, std::unique_ptr<entry_t>>;
+    using data_map_t = std::unordered_map<
+        size_t, data_value_t, std::hash<size_t>, std::equal_to<size_t>,
+        PoolAllocator<std::pair<const size_t, data_value_t>>>;
+    using lru_list_t =
+        std::list<data_map_t::iterator, PoolAllocator<data_map_t::iterator>>;
+
+    // entries, map nodes and list nodes are allocated for every message,
+    // so they come from the pool
+    struct entry_t : PoolAllocated<entry_t> {
         friend class entry_handle_t;
 
-        entry_t(std::set<channel_id_t> channels_, bitstream data_)
-            : channels(std::move(channels_)), data(std::move(data_)),
-              usage_count(0) {}
+        entry_t(size_t position_, channel_list_t &&channels_, bitstream data_)
+            : position(position_), channels(std::move(channels_)),
+              data(std::move(data_)), usage_count(0) {}
 
         entry_t(const entry_t &other) = delete;
 
-        const std::set<channel_id_t> channels;
+        /// Index of the entry in the log
+        const size_t position;
+        const channel_list_t channels;
         const bitstream data;
 
         std::atomic<uint32_t> usage_count;
 
-        std::list<data_map_t::iterator>::iterator lru_it;
+        lru_list_t::iterator lru_it;
 
-        size_t disk_size() const { return mem_size(); }
+        /// Size of the record in the segment file
+        /// (position | #channels | channels | data size | data)
+        size_t disk_size() const { return mem_size() + sizeof(size_t); }
 
         /// Total amount of memory used by this file
         size_t mem_size() const {
@@ -73,7 +86,7 @@ class Storage {
 
         ~entry_handle_t() { discard(); }
 
-        const std::set<channel_id_t> channels() const {
+        const channel_list_t &channels() const {
             if (m_entry == nullptr) {
                 LOG(FATAL) << "Invalid state";
             }
@@ -81,6 +94,14 @@ class Storage {
             return m_entry->channels;
         }
 
+        size_t position() const {
+            if (m_entry == nullptr) {
+                LOG(FATAL) << "Invalid state";
+            }
+
+            return m_entry->position;
+        }
+
         void discard() {
             if (m_entry ==
                 nullptr) // NOLINT: clang seems to raise a false positive here
@@ -146,10 +167,38 @@ class Storage {
 
     size_t num_entries() const { return m_num_entries; }
 
+    /// Number of entries that have not been written to disk yet
+    size_t write_queue_length() {
+        std::unique_lock lock(m_write_queue_mutex);
+        return m_write_queue.size();
+    }
+
     iterator_t iterate() { return iterator_t(*this, m_num_entries); }
 
+    /// Each shard appends its entries to one segment file
+    static constexpr size_t NUM_SEGMENTS = 10;
+
+    std::filesystem::path segment_path(size_t sid) const {
+        return m_prefix / (std::to_string(sid) + ".dat");
+    }
+
+    /// Bytes of complete records in a segment
+    /// Records are only appended, so this prefix of the file is stable
+    size_t segment_size(size_t sid);
+
+    /// Take over segment files that were copied from another relay
+    /// Must be called before anything is inserted
+    ///
+    /// Positions are adopted as they are, up to the first one that is
+    /// missing (because it had not been written to disk yet). Segments are
+    /// truncated before their first record past that gap, so that new
+    /// records never follow stale ones with the same position.
+    void adopt_segments();
+
+    void write_metrics(MetricsWriter &writer);
+
   private:
-    static constexpr size_t NUM_SHARDS = 10;
+    static constexpr size_t NUM_SHARDS = NUM_SEGMENTS;
 
     void write_worker_loop();
 
@@ -162,13 +211,16 @@ class Storage {
         size_t current_mem_size = 0;
 
         data_map_t data;
-        std::list<data_map_t::iterator> lru;
+        lru_list_t lru;
 
         void make_space(size_t max_mem_size);
         std::unique_ptr<entry_t> get_entry_from_disk(std::filesystem::path path,
-                                                     size_t offset);
+                                                     size_t pos, size_t offset);
 
         size_t storage_pos;
+
+        /// Bytes of the segment file that hold complete records
+        size_t written_size = 0;
     };
 
     std::atomic<bool> m_okay = true;
@@ -176,10 +228,16 @@ class Storage {
 
     std::mutex m_write_queue_mutex;
     std::condition_variable m_write_queue_cond;
-    std::list<std::pair<size_t, entry_handle_t>> m_write_queue;
+    std::list<std::pair<size_t, entry_handle_t>,
+              PoolAllocator<std::pair<size_t, entry_handle_t>>>
+        m_write_queue;
 
     std::atomic<size_t> m_num_entries = 0;
 
+    Counter m_memory_hits;
+    Counter m_disk_reads;
+    Counter m_misses;
+
     const std::filesystem::path m_prefix;
     const size_t m_max_mem_size;
 
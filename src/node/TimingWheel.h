@@ -0,0 +1,120 @@
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+namespace relay {
+
+/// Hierarchical timing wheel
+///
+/// Items are bucketed by the tick in which they expire. Insertion is O(1) and
+/// every tick only touches the items that expire in it (plus the occasional
+/// cascade of a coarser slot into the finer levels).
+///
+/// Items that expire in the same tick are returned in insertion order.
+template <typename T, size_t LEVEL_BITS = 8, size_t NUM_LEVELS = 4>
+class TimingWheel {
+  public:
+    explicit TimingWheel(uint64_t start_tick) : m_current(start_tick) {}
+
+    /// The last tick that has been processed
+    uint64_t current_tick() const { return m_current; }
+
+    size_t size() const { return m_size; }
+
+    bool empty() const { return m_size == 0; }
+
+    /// Add an item that expires at the specified tick
+    /// Items for ticks that have already passed expire in the next tick
+    void insert(uint64_t tick, T &&item) {
+        if (tick <= m_current) {
+            tick = m_current + 1;
+        }
+
+        place(entry_t{tick, std::move(item)});
+        m_size++;
+    }
+
+    /// Process all ticks up to (and including) tick
+    /// Expired items are appended to out
+    void advance(uint64_t tick, std::vector<T> &out) {
+        while (m_current < tick) {
+            if (m_size == 0) {
+                // nothing to expire or cascade
+                m_current = tick;
+                return;
+            }
+
+            m_current++;
+            cascade();
+
+            auto &slot = m_slots[0][m_current & SLOT_MASK];
+
+            for (auto &entry : slot) {
+                out.emplace_back(std::move(entry.item));
+            }
+
+            m_size -= slot.size();
+            slot.clear();
+        }
+    }
+
+  private:
+    static constexpr size_t NUM_SLOTS = 1 << LEVEL_BITS;
+    static constexpr uint64_t SLOT_MASK = NUM_SLOTS - 1;
+
+    struct entry_t {
+        uint64_t tick;
+        T item;
+    };
+
+    /// Put an entry into the level that corresponds to the highest bits in
+    /// which its tick differs from the current tick
+    void place(entry_t &&entry) {
+        auto diff = entry.tick ^ m_current;
+
+        size_t level = 0;
+        while (level + 1 < NUM_LEVELS && (diff >> ((level + 1) * LEVEL_BITS))) {
+            level++;
+        }
+
+        auto idx = (entry.tick >> (level * LEVEL_BITS)) & SLOT_MASK;
+        m_slots[level][idx].emplace_back(std::move(entry));
+    }
+
+    /// Move entries of coarser slots that start at the current tick down
+    void cascade() {
+        size_t top = 0;
+        while (top + 1 < NUM_LEVELS) {
+            auto mask = (uint64_t(1) << ((top + 1) * LEVEL_BITS)) - 1;
+
+            if ((m_current & mask) != 0) {
+                break;
+            }
+
+            top++;
+        }
+
+        // coarsest level first, so finer levels see all their entries
+        for (size_t level = top; level > 0; --level) {
+            auto idx = (m_current >> (level * LEVEL_BITS)) & SLOT_MASK;
+
+            auto entries = std::move(m_slots[level][idx]);
+            m_slots[level][idx].clear();
+
+            for (auto &entry : entries) {
+                place(std::move(entry));
+            }
+        }
+    }
+
+    uint64_t m_current;
+    size_t m_size = 0;
+
+    std::array<std::array<std::vector<entry_t>, NUM_SLOTS>, NUM_LEVELS>
+        m_slots;
+};
+
+} // namespace relay
@@ -0,0 +1,92 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+
+namespace relay {
+
+/// Token bucket used to emulate the serialization delay of a
+/// bandwidth-constrained link
+///
+/// All times are in microseconds. The bucket is allowed to go into debt, which
+/// models the queue that builds up in front of a saturated link: every
+/// reservation is scheduled after all previous ones have left the link.
+class TokenBucket {
+  public:
+    /// @param rate the link bandwidth in bytes per second (0 = unlimited)
+    /// @param burst the bucket capacity in bytes
+    TokenBucket(uint64_t rate, uint64_t burst)
+        : m_rate(rate), m_burst(std::max<uint64_t>(burst, 1)),
+          m_tokens(static_cast<double>(m_burst)) {}
+
+    bool is_limited() const { return m_rate > 0; }
+
+    uint64_t rate() const { return m_rate; }
+
+    uint64_t burst() const { return m_burst; }
+
+    /// Change the bandwidth at time now
+    /// Tokens accumulated until now are still computed with the old rate.
+    /// Switching to an unlimited link drops any queued debt.
+    void set_rate(uint64_t rate, uint64_t now) {
+        if (rate == m_rate) {
+            return;
+        }
+
+        refill(now);
+        m_rate = rate;
+
+        if (!is_limited()) {
+            m_tokens = static_cast<double>(m_burst);
+        }
+    }
+
+    /// Reserve size bytes on the link at time now
+    ///
+    /// @return the time at which the last byte will have left the link
+    uint64_t reserve(uint64_t size, uint64_t now) {
+        if (!is_limited()) {
+            return now;
+        }
+
+        refill(now);
+        m_tokens -= static_cast<double>(size);
+
+        if (m_tokens >= 0.0) {
+            return now;
+        }
+
+        auto wait = (-m_tokens * 1'000'000.0) / static_cast<double>(m_rate);
+        return now + static_cast<uint64_t>(wait);
+    }
+
+    /// Bytes that are currently queued in front of the link
+    uint64_t backlog(uint64_t now) {
+        if (!is_limited()) {
+            return 0;
+        }
+
+        refill(now);
+        return m_tokens < 0.0 ? static_cast<uint64_t>(-m_tokens) : 0;
+    }
+
+  private:
+    void refill(uint64_t now) {
+        if (now <= m_last_update) {
+            return;
+        }
+
+        auto elapsed = static_cast<double>(now - m_last_update);
+        m_tokens += elapsed * static_cast<double>(m_rate) / 1'000'000.0;
+        m_tokens = std::min(m_tokens, static_cast<double>(m_burst));
+        m_last_update = now;
+    }
+
+    uint64_t m_rate;
+    uint64_t m_burst;
+
+    double m_tokens;
+    uint64_t m_last_update = 0;
+};
+
+} // namespace relay
@@ -0,0 +1,132 @@
+#pragma once
+
+#include <bitstream.h>
+#include <glog/logging.h>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <shared_mutex>
+#include <stdbitstream.h>
+#include <string>
+#include <unordered_map>
+
+#include "common/Topics.h"
+
+namespace relay {
+
+// Topics whose matching clients are remembered
+constexpr size_t MAX_CACHED_TOPICS = 256 * 1024;
+
+/// The topic patterns of the clients of a node
+///
+/// Relays forward topics at the granularity of channels; this index decides
+/// which of the local clients get a message. Results are cached per topic
+/// until a subscription changes, so a message on a known topic costs a
+/// single lookup.
+class TopicIndex {
+  public:
+    /// Identifies a client (a Peer or ShmEndpoint)
+    using subscriber_t = const void *;
+    using subscribers_t = std::set<subscriber_t>;
+
+    void update(subscriber_t subscriber, const std::set<std::string> &added,
+                const std::set<std::string> &removed) {
+        std::unique_lock lock(m_mutex);
+        auto &patterns = m_patterns[subscriber];
+
+        for (auto &pattern : removed) {
+            if (patterns.erase(pattern) > 0) {
+                m_trie.erase(pattern, subscriber);
+            }
+        }
+
+        for (auto &pattern : added) {
+            if (patterns.insert(pattern).second) {
+                m_trie.insert(pattern, subscriber);
+            }
+        }
+
+        if (patterns.empty()) {
+            m_patterns.erase(subscriber);
+        }
+
+        clear_cache();
+    }
+
+    /// Forget all patterns of a client that went away
+    void remove(subscriber_t subscriber) {
+        std::unique_lock lock(m_mutex);
+        auto it = m_patterns.find(subscriber);
+
+        if (it == m_patterns.end()) {
+            return;
+        }
+
+        for (auto &pattern : it->second) {
+            m_trie.erase(pattern, subscriber);
+        }
+
+        m_patterns.erase(it);
+        clear_cache();
+    }
+
+    /// The clients with a pattern that matches the topic
+    std::shared_ptr<const subscribers_t> match(const std::string &topic) {
+        // subscriptions cannot change (and clear the cache) meanwhile
+        std::shared_lock lock(m_mutex);
+
+        {
+            std::unique_lock cache_lock(m_cache_mutex);
+            auto it = m_cache.find(topic);
+
+            if (it != m_cache.end()) {
+                return it->second;
+            }
+        }
+
+        auto result = std::make_shared<subscribers_t>();
+        m_trie.match(topic, [&](subscriber_t s) { result->insert(s); });
+
+        std::unique_lock cache_lock(m_cache_mutex);
+
+        if (m_cache.size() >= MAX_CACHED_TOPICS) {
+            m_cache.clear();
+        }
+
+        m_cache.emplace(topic, result);
+        return result;
+    }
+
+  private:
+    void clear_cache() {
+        std::unique_lock cache_lock(m_cache_mutex);
+        m_cache.clear();
+    }
+
+    std::shared_mutex m_mutex;
+    TopicTrie<subscriber_t> m_trie;
+    std::unordered_map<subscriber_t, std::set<std::string>> m_patterns;
+
+    std::mutex m_cache_mutex;
+    std::unordered_map<std::string, std::shared_ptr<const subscribers_t>>
+        m_cache;
+};
+
+/// Parse a topic subscription update from a client
+/// Invalid patterns are dropped
+inline void read_topic_update(bitstream &input, std::set<std::string> &added,
+                              std::set<std::string> &removed) {
+    input >> added >> removed;
+
+    for (auto it = added.begin(); it != added.end();) {
+        if (is_valid_pattern(*it)) {
+            ++it;
+            continue;
+        }
+
+        LOG(ERROR) << "Ignoring invalid topic pattern \"" << *it << "\"";
+        it = added.erase(it);
+    }
+}
+
+} // namespace relay
@@ -0,0 +1,68 @@
+#pragma once
+
+#include <glog/logging.h>
+#include <pthread.h>
+#include <sched.h>
+#include <string>
+#include <vector>
+
+namespace relay {
+
+/// Parse a list of CPUs such as "0-3,8,10"
+inline std::vector<uint32_t> parse_cpu_list(const std::string &str) {
+    std::vector<uint32_t> result;
+    size_t pos = 0;
+
+    while (pos < str.size()) {
+        auto end = str.find(',', pos);
+        if (end == std::string::npos) {
+            end = str.size();
+        }
+
+        auto range = str.substr(pos, end - pos);
+        pos = end + 1;
+
+        if (range.empty()) {
+            continue;
+        }
+
+        auto dash = range.find('-');
+
+        try {
+            if (dash == std::string::npos) {
+                result.push_back(std::stoul(range));
+                continue;
+            }
+
+            auto first = std::stoul(range.substr(0, dash));
+            auto last = std::stoul(range.substr(dash + 1));
+
+            if (first > last) {
+                LOG(FATAL) << "Invalid CPU range: " << range;
+            }
+
+            for (auto cpu = first; cpu <= last; ++cpu) {
+                result.push_back(cpu);
+            }
+        } catch (std::logic_error &) {
+            LOG(FATAL) << "Invalid CPU list: " << str;
+        }
+    }
+
+    return result;
+}
+
+/// Restrict the calling thread to a single CPU
+inline void pin_current_thread(uint32_t cpu) {
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+
+    auto res = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+
+    if (res != 0) {
+        LOG(ERROR) << "Failed to pin thread to CPU " << cpu;
+    }
+}
+
+} // namespace relay
@@ -0,0 +1,241 @@
+#include "sim/Simulator.h"
+
+#include <glog/logging.h>
+
+#include "common/MessageHeader.h"
+#include "common/defines.h"
+
+namespace relay {
+
+Simulator::Simulator(const std::string &config_file)
+    : m_config("", config_file) {
+    auto add_node = [&](const std::string &name) {
+        auto it = m_node_ids.find(name);
+        if (it != m_node_ids.end()) {
+            return it->second;
+        }
+
+        auto id = m_nodes.size();
+        m_nodes.emplace_back(sim_node_t{
+            name, {}, {}, std::make_unique<DedupFilter>(DEDUP_WINDOW)});
+        m_node_ids.emplace(name, id);
+        return id;
+    };
+
+    auto seed = m_config.seed();
+    auto &edges = m_config.edges();
+
+    for (size_t i = 0; i < edges.size(); ++i) {
+        auto &e = edges[i];
+        auto from = add_node(e.from);
+        auto to = add_node(e.to);
+
+        // mirror the relays: forward is emulated by the connecting node,
+        // reverse by the accepting node (if configured at all)
+        auto forward = std::make_unique<LinkModel>();
+        forward->configure(e.forward, seed == 0 ? 0 : seed + 2 * i, 0);
+
+        auto reverse = std::make_unique<LinkModel>();
+        if (e.reverse) {
+            reverse->configure(*e.reverse, seed == 0 ? 0 : seed + 2 * i + 1,
+                               0);
+        }
+
+        m_nodes[from].links.emplace_back(
+            sim_link_t{to, std::move(forward), {}});
+        m_nodes[to].links.emplace_back(
+            sim_link_t{from, std::move(reverse), {}});
+    }
+
+    if (m_nodes.empty()) {
+        LOG(FATAL) << "Network config does not contain any edges";
+    }
+}
+
+void Simulator::schedule(uint64_t time, std::function<void()> &&action) {
+    m_events.push(event_t{time, m_next_sequence++, std::move(action)});
+}
+
+void Simulator::propagate_interest() {
+    for (auto &node : m_nodes) {
+        for (auto &link : node.links) {
+            link.interest.clear();
+        }
+    }
+
+    // interest only grows, so this terminates (also on cycles)
+    bool changed = true;
+
+    while (changed) {
+        changed = false;
+
+        for (size_t id = 0; id < m_nodes.size(); ++id) {
+            for (auto &link : m_nodes[id].links) {
+                auto &peer = m_nodes[link.to];
+                std::set<channel_id_t> interest;
+
+                for (auto cid : peer.clients) {
+                    auto &subs = m_clients[cid].subscriptions;
+                    interest.insert(subs.begin(), subs.end());
+                }
+
+                // everything the peer's other neighbors asked it for
+                for (auto &other : peer.links) {
+                    if (other.to != id) {
+                        interest.insert(other.interest.begin(),
+                                        other.interest.end());
+                    }
+                }
+
+                if (interest != link.interest) {
+                    link.interest = std::move(interest);
+                    changed = true;
+                }
+            }
+        }
+    }
+}
+
+void Simulator::on_relay_message(
+    size_t node_id, std::optional<size_t> from,
+    const std::shared_ptr<const sim_message_t> &msg) {
+    auto &node = m_nodes[node_id];
+
+    if (!node.seen_messages->insert(msg->id)) {
+        m_result.num_duplicates++;
+        return;
+    }
+
+    // local clients are not behind emulated links
+    for (auto cid : node.clients) {
+        if (!from && cid == msg->origin) {
+            // this is where the message came from
+            continue;
+        }
+
+        auto &subs = m_clients[cid].subscriptions;
+        bool subscribed = msg->channels.empty();
+
+        for (auto c : msg->channels) {
+            if (subs.find(c) != subs.end()) {
+                subscribed = true;
+                break;
+            }
+        }
+
+        if (subscribed) {
+            m_result.num_delivered++;
+            m_result.latencies.push_back(m_now - msg->send_time);
+        }
+    }
+
+    for (auto &link : node.links) {
+        if (from && *from == link.to) {
+            continue;
+        }
+
+        bool wanted = msg->channels.empty();
+
+        for (auto c : msg->channels) {
+            if (link.interest.find(c) != link.interest.end()) {
+                wanted = true;
+                break;
+            }
+        }
+
+        if (!wanted) {
+            continue;
+        }
+
+        std::optional<uint64_t> release = m_now;
+
+        if (link.model->is_emulated()) {
+            release = link.model->release_time(msg->size, m_now);
+        }
+
+        if (!release) {
+            m_result.num_lost++;
+            continue;
+        }
+
+        auto to = link.to;
+        schedule(*release, [this, to, node_id, msg]() {
+            on_relay_message(to, node_id, msg);
+        });
+    }
+}
+
+Simulator::result_t Simulator::run(const workload_t &workload) {
+    if (workload.rate <= 0.0) {
+        LOG(FATAL) << "Message rate must be positive";
+    }
+
+    m_result = result_t{};
+    m_clients.clear();
+
+    for (auto &node : m_nodes) {
+        node.clients.clear();
+        node.seen_messages = std::make_unique<DedupFilter>(DEDUP_WINDOW);
+    }
+
+    for (size_t i = 0; i < workload.num_clients; ++i) {
+        auto node = i % m_nodes.size();
+
+        m_clients.emplace_back(sim_client_t{node, workload.channels});
+        m_nodes[node].clients.push_back(i);
+    }
+
+    propagate_interest();
+
+    auto interval = static_cast<uint64_t>(1'000'000.0 / workload.rate);
+
+    std::set<channel_id_t> channels;
+    if (!workload.channels.empty()) {
+        channels.insert(*workload.channels.begin());
+    }
+
+    // messages carry the same header as on the wire
+    message_header_t header;
+    header.channels = channels;
+
+    uint32_t size = workload.message_size + header.size();
+
+    for (size_t cid = 0; cid < m_clients.size(); ++cid) {
+        for (size_t i = 0; i < workload.num_messages; ++i) {
+            schedule(m_now + i * interval, [this, cid, i, channels, size]() {
+                auto msg = std::make_shared<const sim_message_t>(
+                    sim_message_t{message_id_t{cid, i}, channels, size,
+                                  m_now, cid});
+
+                m_result.num_sent++;
+                on_relay_message(m_clients[cid].node, std::nullopt, msg);
+            });
+        }
+    }
+
+    auto start = m_now;
+
+    while (!m_events.empty()) {
+        if (workload.duration > 0 &&
+            m_events.top().time > start + workload.duration) {
+            // drop what is still in flight
+            m_events = {};
+            m_now = start + workload.duration;
+            break;
+        }
+
+        // top() is const, but we are about to pop the element
+        auto event = std::move(const_cast<event_t &>(m_events.top()));
+        m_events.pop();
+
+        m_now = event.time;
+        m_result.num_events++;
+
+        event.action();
+    }
+
+    m_result.virtual_time = m_now - start;
+    return std::move(m_result);
+}
+
+} // namespace relay
@@ -0,0 +1,145 @@
+#pragma once
+
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <optional>
+#include <queue>
+#include <set>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "librelay/Connection.h"
+#include "node/DedupFilter.h"
+#include "node/LinkModel.h"
+#include "node/NetworkConfig.h"
+
+namespace relay {
+
+/// Discrete-event simulation of a relay network
+///
+/// All relays of a network config are instantiated in one process and
+/// exchange messages over the same link models the relay nodes use. Time is
+/// virtual, so emulated delays do not cost any wall-clock time.
+///
+/// Relays forward like the relay nodes do: only over links whose other end
+/// advertised interest in a channel, and only the first copy of a message.
+/// Send queues (and with them priorities and conflation) are not modelled.
+class Simulator {
+  public:
+    struct workload_t {
+        /// Number of clients; they are spread evenly across all relays
+        size_t num_clients;
+
+        /// Number of messages each client sends
+        size_t num_messages;
+
+        /// Messages per second and client
+        double rate;
+
+        /// Payload size in bytes
+        uint32_t message_size;
+
+        /// Channels each client subscribes to; messages are sent to the first
+        std::set<channel_id_t> channels;
+
+        /// Stop after this much virtual time (in microseconds; 0 = never)
+        uint64_t duration;
+    };
+
+    struct result_t {
+        uint64_t num_events;
+        uint64_t num_sent;
+        uint64_t num_delivered;
+        uint64_t num_lost;
+
+        /// Copies that arrived over a second path and were dropped
+        uint64_t num_duplicates;
+
+        /// Virtual time it took to run the workload (in microseconds)
+        uint64_t virtual_time;
+
+        /// End-to-end latencies of all delivered messages (in microseconds)
+        std::vector<uint64_t> latencies;
+    };
+
+    explicit Simulator(const std::string &config_file);
+
+    /// Run the workload until all messages are delivered or dropped,
+    /// or its duration passed
+    result_t run(const workload_t &workload);
+
+    size_t num_nodes() const { return m_nodes.size(); }
+
+  private:
+    struct sim_link_t {
+        size_t to;
+        std::unique_ptr<LinkModel> model;
+
+        /// Channels the relay at the other end asked for
+        std::set<channel_id_t> interest;
+    };
+
+    struct sim_client_t {
+        size_t node;
+        std::set<channel_id_t> subscriptions;
+    };
+
+    struct sim_node_t {
+        std::string name;
+        std::vector<sim_link_t> links;
+        std::vector<size_t> clients;
+
+        std::unique_ptr<DedupFilter> seen_messages;
+    };
+
+    struct sim_message_t {
+        message_id_t id;
+        std::set<channel_id_t> channels;
+        uint32_t size;
+        uint64_t send_time;
+
+        /// The client that sent this message
+        size_t origin;
+    };
+
+    struct event_t {
+        uint64_t time;
+        uint64_t sequence;
+        std::function<void()> action;
+
+        bool operator<(const event_t &other) const {
+            if (time != other.time) {
+                return time > other.time;
+            }
+
+            return sequence > other.sequence;
+        }
+    };
+
+    void schedule(uint64_t time, std::function<void()> &&action);
+
+    /// Compute what every relay advertises to its neighbors
+    /// Mirrors Node::downstream_interest, iterated until nothing changes
+    void propagate_interest();
+
+    /// A message arrived at a relay
+    /// @param from the relay it came from or nullopt for local clients
+    void on_relay_message(size_t node, std::optional<size_t> from,
+                          const std::shared_ptr<const sim_message_t> &msg);
+
+    const NetworkConfig m_config;
+
+    std::vector<sim_node_t> m_nodes;
+    std::vector<sim_client_t> m_clients;
+    std::unordered_map<std::string, size_t> m_node_ids;
+
+    uint64_t m_now = 0;
+    uint64_t m_next_sequence = 0;
+    std::priority_queue<event_t> m_events;
+
+    result_t m_result;
+};
+
+} // namespace relay
@@ -0,0 +1,104 @@
+#include "sim/Simulator.h"
+
+#include <algorithm>
+#include <chrono>
+#include <iostream>
+
+#include <boost/program_options.hpp>
+#include <glog/logging.h>
+
+namespace po = boost::program_options;
+using namespace relay;
+
+uint64_t percentile(const std::vector<uint64_t> &sorted, double p) {
+    if (sorted.empty()) {
+        return 0;
+    }
+
+    auto pos = static_cast<size_t>(p * static_cast<double>(sorted.size() - 1));
+    return sorted[pos];
+}
+
+int main(int ac, char *av[]) {
+    google::InitGoogleLogging(av[0]);
+    FLAGS_logtostderr = true;
+
+    po::positional_options_description p;
+    p.add("config", 1);
+
+    po::options_description desc("Allowed options");
+    desc.add_options()("help", "show this help message")(
+        "config", po::value<std::string>()->required(),
+        "the network config to simulate")(
+        "num_clients", po::value<size_t>()->default_value(5),
+        "number of clients (spread across all relays)")(
+        "num_messages", po::value<size_t>()->default_value(10'000),
+        "number of messages each client sends")(
+        "rate", po::value<double>()->default_value(1000.0),
+        "messages per second sent by each client")(
+        "message_size", po::value<uint32_t>()->default_value(4),
+        "payload size in bytes")(
+        "channel", po::value<channel_id_t>()->default_value(7),
+        "the channel all clients use")(
+        "duration", po::value<double>()->default_value(0.0),
+        "seconds of virtual time to simulate (0 = until all messages are "
+        "delivered or lost)");
+
+    po::variables_map vm;
+
+    try {
+        po::store(
+            po::command_line_parser(ac, av).options(desc).positional(p).run(),
+            vm);
+        po::notify(vm);
+    } catch (boost::wrapexcept<boost::program_options::unknown_option> &err) {
+        std::cerr << "ERROR: " << err.what() << std::endl;
+        std::cout << desc << std::endl;
+        return 1;
+    } catch (boost::wrapexcept<boost::program_options::required_option> &err) {
+        std::cerr << "ERROR: " << err.what() << std::endl;
+        std::cout << desc << std::endl;
+        return 1;
+    }
+
+    if (vm.count("help")) {
+        std::cout << desc << std::endl;
+        return 0;
+    }
+
+    Simulator sim(vm["config"].as<std::string>());
+
+    Simulator::workload_t workload = {
+        vm["num_clients"].as<size_t>(), vm["num_messages"].as<size_t>(),
+        vm["rate"].as<double>(), vm["message_size"].as<uint32_t>(),
+        std::set<channel_id_t>{vm["channel"].as<channel_id_t>()},
+        static_cast<uint64_t>(vm["duration"].as<double>() * 1'000'000.0)};
+
+    LOG(INFO) << "Simulating " << sim.num_nodes() << " relays with "
+              << workload.num_clients << " clients";
+
+    auto start = std::chrono::steady_clock::now();
+    auto result = sim.run(workload);
+    auto end = std::chrono::steady_clock::now();
+
+    auto wall_time =
+        std::chrono::duration_cast<std::chrono::microseconds>(end - start)
+            .count();
+
+    auto &lat = result.latencies;
+    std::sort(lat.begin(), lat.end());
+
+    std::cout << "events: " << result.num_events << std::endl
+              << "sent: " << result.num_sent << std::endl
+              << "delivered: " << result.num_delivered << std::endl
+              << "lost: " << result.num_lost << std::endl
+              << "duplicates: " << result.num_duplicates << std::endl
+              << "virtual_time_us: " << result.virtual_time << std::endl
+              << "wall_time_us: " << wall_time << std::endl
+              << "latency_p50_us: " << percentile(lat, 0.5) << std::endl
+              << "latency_p99_us: " << percentile(lat, 0.99) << std::endl
+              << "latency_p999_us: " << percentile(lat, 0.999) << std::endl
+              << "latency_max_us: " << percentile(lat, 1.0) << std::endl;
+
+    return 0;
+}
@@ -0,0 +1,130 @@
+#! /usr/bin/python3
+
+''' Launches generated relay networks locally and benchmarks them
+
+For every network size, a config is generated with scripts/gen-topology.py,
+all relays are started, and relay-bench runs with its clients spread across
+all relays. Results are appended (one JSON object per line) to the output
+file, tagged with the topology and the number of relays.
+
+Use --sim to run relay-sim on the same configs instead of real processes.
+'''
+
+import argparse
+import json
+import os
+import sys
+import tempfile
+from time import sleep, time
+from subprocess import Popen, run, PIPE
+
+sys.path.append(os.path.join(os.path.dirname(os.path.abspath(__file__)),
+    '..', 'scripts'))
+
+import importlib
+gen_topology = importlib.import_module('gen-topology')
+
+def int_list(s):
+    return [int(x) for x in s.split(',')]
+
+parser = argparse.ArgumentParser(description=__doc__,
+        formatter_class=argparse.RawDescriptionHelpFormatter)
+parser.add_argument('--type', type=str, default='tree')
+parser.add_argument('--sizes', type=int_list, default=[4, 16, 64])
+parser.add_argument('--delay', type=int, default=20)
+parser.add_argument('--base-port', type=int, default=55000)
+parser.add_argument('--clients-per-node', type=int, default=1)
+parser.add_argument('--rate', type=float, default=1000.0)
+parser.add_argument('--message-size', type=int, default=64)
+parser.add_argument('--duration', type=float, default=10.0)
+parser.add_argument('--seed', type=int, default=42)
+parser.add_argument('--sim', action='store_true')
+parser.add_argument('--output', type=str, default='cluster-results.json')
+args = parser.parse_args()
+
+out = open(args.output, 'a')
+workdir = tempfile.mkdtemp(prefix='relay-cluster-')
+
+for size in args.sizes:
+    config = gen_topology.generate(args.type, size, args.base_port,
+            args.delay, seed=args.seed)
+
+    fname = os.path.join(workdir, '%s-%d.conf' % (args.type, size))
+    with open(fname, 'w') as f:
+        json.dump(config, f, indent=4)
+
+    num_clients = size * args.clients_per_node
+    nodes = config["nodes"]
+
+    if args.sim:
+        res = run(['./relay-sim', fname, '--num_clients='+str(num_clients),
+            '--num_messages='+str(int(args.rate * args.duration / num_clients)),
+            '--rate='+str(args.rate / num_clients),
+            '--message_size='+str(args.message_size)],
+            stdout=PIPE, universal_newlines=True)
+
+        result = {"type": args.type, "num_relays": size, "sim": True}
+        for line in res.stdout.splitlines():
+            key, value = line.split(':')
+            result[key.strip()] = int(value)
+
+        line = json.dumps(result)
+    else:
+        processes = []
+        ready_files = []
+
+        # run relays in the work directory, so their storage ends up there
+        relay_node = os.path.abspath('./relay-node')
+
+        for name in nodes:
+            ready_file = os.path.join(workdir, '%s.ready' % name)
+            if os.path.exists(ready_file):
+                os.remove(ready_file)
+
+            ready_files.append(ready_file)
+            processes.append(Popen([relay_node, name, fname,
+                '--ready_file='+ready_file], cwd=workdir))
+
+        # relays connect to their neighbors as soon as those are up
+        start = time()
+        while not all(os.path.exists(f) for f in ready_files):
+            if time() - start > 60.0:
+                print("relays did not come up for %d relays" % size)
+                break
+            sleep(0.01)
+
+        print("%d relays ready after %.3fs" % (size, time() - start),
+              file=sys.stderr)
+
+        res = run(['./relay-bench'] + list(nodes.values()) + [
+            '--mode=open', '--num_clients='+str(num_clients),
+            '--rate='+str(args.rate), '--duration='+str(args.duration),
+            '--message_size='+str(args.message_size), '--trace_rate=100',
+            '--label=%s-%d' % (args.type, size)],
+            stdout=PIPE, universal_newlines=True)
+
+        for p in processes:
+            p.terminate()
+
+        failed = False
+        for p in processes:
+            p.wait()
+            failed = failed or p.returncode != 0
+
+        if failed:
+            print("relay node did not shut down correctly")
+
+        if not res.stdout:
+            print("relay-bench failed for %d relays" % size)
+            continue
+
+        result = json.loads(res.stdout)
+        result["type"] = args.type
+        result["num_relays"] = size
+        line = json.dumps(result)
+
+    print(line)
+    out.write(line + '\n')
+    out.flush()
+
+out.close()
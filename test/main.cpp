@@ -83,20 +83,11 @@ int main(int ac, char *av[]) {
     g_num_clients = vm["num_clients"].as<size_t>();
     g_num_messages = vm["num_messages"].as<size_t>();
 
-    auto found = addr_str.find(':');
-    auto host = addr_str.substr(0, found);
-    auto port =
-        std::atoi(addr_str.substr(found + 1, std::string::npos).c_str());
-
-    if (port <= 0 || port > std::numeric_limits<uint16_t>::max()) {
-        LOG(ERROR) << "Not a valid port number: " << port;
-    }
-
     auto msg = vm["message"].as<int32_t>();
 
     Callback callback;
-    auto conn = relay::create_connection(yael::network::resolve_URL(host, port),
-                                         callback, {1, 3, 4, 7});
+    // either host:port or shm://name
+    auto conn = relay::create_connection(addr_str, callback, {1, 3, 4, 7});
 
     // Wait for other clients to start
     std::this_thread::sleep_for(0.5s);
@@ -13,13 +13,17 @@ clients = []
 num_clients = 5
 node_names = []
 edge_addr = "localhost:45451"
+shm_name = "relay-test"
 
 for name in nodes:
     node_names.append(name)
     p = Popen(['./relay-node', name, fname])
     processes.append(p)
 
-e = Popen(['./relay-edge-node', edge_addr, nodes[node_names[0]], fname])
+# use two upstream relays to exercise load balancing and deduplication
+upstreams = ','.join(nodes[name] for name in node_names[:2])
+e = Popen(['./relay-edge-node', edge_addr, upstreams, fname,
+           '--shm_name='+shm_name])
 processes.append(e)
 
 # wait for servers to start
@@ -28,7 +32,9 @@ sleep(2.0)
 for i in range(num_clients):
     node = node_names[i % len(node_names)]
     addr = nodes[node]
-    c = Popen(['./relay-test', edge_addr, str(i)])
+    # alternate between tcp and shared memory
+    client_addr = edge_addr if i % 2 == 0 else 'shm://' + shm_name
+    c = Popen(['./relay-test', client_addr, str(i)])
     clients.append(c)
 
 for c in clients:
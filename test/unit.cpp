@@ -0,0 +1,89 @@
+#include "client/Chunking.h"
+#include "node/TokenBucket.h"
+#include <glog/logging.h>
+#include <thread>
+
+using namespace relay;
+
+/// A link that becomes unlimited must not keep the backlog it had before
+void test_token_bucket_unlimited() {
+    TokenBucket bucket(1000, 100);
+
+    bucket.reserve(5100, 0);
+    CHECK_EQ(bucket.backlog(0), 5000);
+
+    bucket.set_rate(0, 1'000'000);
+    CHECK_EQ(bucket.backlog(1'000'000), 0);
+    CHECK_EQ(bucket.reserve(5000, 1'000'000), 1'000'000);
+    CHECK_EQ(bucket.backlog(2'000'000), 0);
+
+    // Going back to a limited link starts from a full bucket
+    bucket.set_rate(1000, 3'000'000);
+    CHECK_EQ(bucket.backlog(3'000'000), 0);
+    CHECK_EQ(bucket.reserve(1100, 3'000'000), 4'000'000);
+}
+
+struct message_counter_t : public Callback {
+    void on_new_message(std::set<channel_id_t> channels,
+                        bitstream &&data) override {
+        (void)channels;
+        sizes.push_back(data.size());
+    }
+
+    void on_disconnect() override {}
+
+    std::vector<uint32_t> sizes;
+};
+
+/// A message that lost a chunk in the middle is given up after the timeout
+void test_reassembler_lost_chunk() {
+    message_counter_t callback;
+    Reassembler reassembler(callback, std::chrono::milliseconds(10));
+
+    Chunker chunker;
+    chunker.set_chunk_size(100);
+
+    message_header_t header;
+    header.channels = {1};
+
+    bitstream data;
+    std::vector<uint8_t> bytes(250, 42);
+    data.write_raw_data(bytes.data(), bytes.size());
+
+    auto chunks = chunker.prepare(header, std::move(data));
+    CHECK_EQ(chunks.size(), 3);
+
+    auto deliver = [&](bitstream &chunk) {
+        auto cpy = chunk.duplicate(true);
+        auto chunk_header = read_header(cpy);
+        reassembler.deliver(std::move(chunk_header), std::move(cpy));
+    };
+
+    deliver(chunks[0]);
+    deliver(chunks[2]);
+
+    std::this_thread::sleep_for(std::chrono::milliseconds(20));
+
+    // the next message expires the incomplete one
+    bitstream small;
+    small.write_raw_data(bytes.data(), 10);
+    auto unsplit = chunker.prepare(header, std::move(small));
+    deliver(unsplit[0]);
+
+    // and the missing chunk is ignored once it shows up
+    deliver(chunks[1]);
+
+    CHECK_EQ(callback.sizes.size(), 1);
+    CHECK_EQ(callback.sizes[0], 10);
+}
+
+int main(int argc, char **argv) {
+    (void)argc;
+    google::InitGoogleLogging(argv[0]);
+
+    test_token_bucket_unlimited();
+    test_reassembler_lost_chunk();
+
+    LOG(INFO) << "All unit tests passed";
+    return 0;
+}